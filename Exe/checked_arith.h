@@ -0,0 +1,128 @@
+// checked_arith.h - Overflow-checked add, sub and mul for every integer
+// width, the uadd_ok / tadd_ok / tsub_ok / tmult_ok checks of ch2.c
+// (problems 2.27, 2.30, 2.74, 2.35) grown into a library.
+//
+// Scalar: ck_add_i32(x, y, &r) stores the wrapped result in r and
+// returns 1 on overflow, 0 otherwise, like the __builtin_*_overflow
+// functions they are built on. The same goes for sub and mul, and for
+// i8, i16, i64 and u8 .. u64. ck_add(x, y, &r) and friends take any
+// types, and overflow if the exact result does not fit in r.
+//
+// Batch: ck_add_i32_batch(x, y, out, ovf, n) sets out[i] to the wrapped
+// x[i] + y[i] and ovf[i] to 1 if it overflowed, 0 otherwise, and returns
+// the number of overflows. The builtins do not vectorize, so the batch
+// versions use the wrapping formulations instead, which do:
+//   signed add:    s = x + y wraps iff x and y have the same sign and s
+//                  the other one: ((x ^ s) & (y ^ s)) < 0
+//   signed sub:    s = x - y wraps iff x and y have different signs and
+//                  s the sign of y: ((x ^ y) & (x ^ s)) < 0
+//   unsigned add:  s < x        unsigned sub:  x < y
+//   mul:           the product in twice the width does not fit (2.36)
+// 64-bit mul has no vector widening multiply, so it is a loop of
+// builtins. Compile with -O3 for the loops to be vectorized, and for a
+// target with AVX2 (-mavx2, or a function with target("avx2") calling
+// them) for 256-bit vectors.
+#ifndef CHECKED_ARITH_H
+#define CHECKED_ARITH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Any types: 1 if the exact result does not fit in *r
+#define ck_add(x, y, r) __builtin_add_overflow(x, y, r)
+#define ck_sub(x, y, r) __builtin_sub_overflow(x, y, r)
+#define ck_mul(x, y, r) __builtin_mul_overflow(x, y, r)
+
+#define CK_SCALAR(t, T)                                                 \
+  static inline int ck_add_##t(T x, T y, T *r) {                        \
+    return __builtin_add_overflow(x, y, r);                             \
+  }                                                                     \
+  static inline int ck_sub_##t(T x, T y, T *r) {                        \
+    return __builtin_sub_overflow(x, y, r);                             \
+  }                                                                     \
+  static inline int ck_mul_##t(T x, T y, T *r) {                        \
+    return __builtin_mul_overflow(x, y, r);                             \
+  }
+
+CK_SCALAR(i8, int8_t)
+CK_SCALAR(i16, int16_t)
+CK_SCALAR(i32, int32_t)
+CK_SCALAR(i64, int64_t)
+CK_SCALAR(u8, uint8_t)
+CK_SCALAR(u16, uint16_t)
+CK_SCALAR(u32, uint32_t)
+CK_SCALAR(u64, uint64_t)
+
+// The batch loops. The arithmetic is done in the unsigned type U, so it
+// wraps; the overflow of each element is computed as 0 or 1 and summed.
+#define CK_BATCH_LOOP(name, T, body)                                    \
+  static inline size_t name(const T *x, const T *y, T *out,             \
+                            unsigned char *ovf, size_t n) {             \
+    size_t i, count = 0;                                                \
+    for (i = 0; i < n; i++) {                                           \
+      unsigned o;                                                       \
+      body                                                              \
+      ovf[i] = o;                                                       \
+      count += o;                                                       \
+    }                                                                   \
+    return count;                                                       \
+  }
+
+// Signed T, unsigned U of the same width, and W twice as wide
+#define CK_BATCH_SIGNED(t, T, U, W, bits)                               \
+  CK_BATCH_LOOP(ck_add_##t##_batch, T,                                  \
+    U s = (U) x[i] + (U) y[i];                                          \
+    o = (U) (((U) x[i] ^ s) & ((U) y[i] ^ s)) >> (bits - 1);            \
+    out[i] = (T) s;)                                                    \
+  CK_BATCH_LOOP(ck_sub_##t##_batch, T,                                  \
+    U s = (U) x[i] - (U) y[i];                                          \
+    o = (U) (((U) x[i] ^ (U) y[i]) & ((U) x[i] ^ s)) >> (bits - 1);     \
+    out[i] = (T) s;)                                                    \
+  CK_BATCH_LOOP(ck_mul_##t##_batch, T,                                  \
+    W p = (W) x[i] * y[i];                                              \
+    o = p != (T) p;                                                     \
+    out[i] = (T) p;)
+
+// Unsigned U, and UW twice as wide
+#define CK_BATCH_UNSIGNED(t, U, UW, bits)                               \
+  CK_BATCH_LOOP(ck_add_##t##_batch, U,                                  \
+    U s = x[i] + y[i];                                                  \
+    o = s < x[i];                                                       \
+    out[i] = s;)                                                        \
+  CK_BATCH_LOOP(ck_sub_##t##_batch, U,                                  \
+    o = x[i] < y[i];                                                    \
+    out[i] = x[i] - y[i];)                                              \
+  CK_BATCH_LOOP(ck_mul_##t##_batch, U,                                  \
+    UW p = (UW) x[i] * y[i];                                            \
+    o = (p >> bits) != 0;                                               \
+    out[i] = (U) p;)
+
+CK_BATCH_SIGNED(i8, int8_t, uint8_t, int16_t, 8)
+CK_BATCH_SIGNED(i16, int16_t, uint16_t, int32_t, 16)
+CK_BATCH_SIGNED(i32, int32_t, uint32_t, int64_t, 32)
+CK_BATCH_UNSIGNED(u8, uint8_t, uint16_t, 8)
+CK_BATCH_UNSIGNED(u16, uint16_t, uint32_t, 16)
+CK_BATCH_UNSIGNED(u32, uint32_t, uint64_t, 32)
+
+// 64 bits: add and sub as above, mul with the builtin
+CK_BATCH_LOOP(ck_add_i64_batch, int64_t,
+  uint64_t s = (uint64_t) x[i] + (uint64_t) y[i];
+  o = (((uint64_t) x[i] ^ s) & ((uint64_t) y[i] ^ s)) >> 63;
+  out[i] = (int64_t) s;)
+CK_BATCH_LOOP(ck_sub_i64_batch, int64_t,
+  uint64_t s = (uint64_t) x[i] - (uint64_t) y[i];
+  o = (((uint64_t) x[i] ^ (uint64_t) y[i]) & ((uint64_t) x[i] ^ s)) >> 63;
+  out[i] = (int64_t) s;)
+CK_BATCH_LOOP(ck_mul_i64_batch, int64_t,
+  o = __builtin_mul_overflow(x[i], y[i], &out[i]);)
+CK_BATCH_LOOP(ck_add_u64_batch, uint64_t,
+  uint64_t s = x[i] + y[i];
+  o = s < x[i];
+  out[i] = s;)
+CK_BATCH_LOOP(ck_sub_u64_batch, uint64_t,
+  o = x[i] < y[i];
+  out[i] = x[i] - y[i];)
+CK_BATCH_LOOP(ck_mul_u64_batch, uint64_t,
+  o = __builtin_mul_overflow(x[i], y[i], &out[i]);)
+
+#endif
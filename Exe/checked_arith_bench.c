@@ -0,0 +1,351 @@
+// checked_arith_bench.c - Check the checked_arith.h batch kernels, and
+// time them against the scalar builtins and the ch2.c formulations.
+//
+// Build: gcc -O3 -Wall -fwrapv -o checked_arith_bench checked_arith_bench.c
+//
+// usage: checked_arith_bench [-n values] [-r repetitions]
+// Every kernel, for the default target and for AVX2 if the CPU has it,
+// is first compared with the scalar builtin loop on all pairs of edge
+// cases of its width, then random values of random magnitudes. Then
+// the time per value is reported, best of <repetitions> runs over
+// arrays of <values> values (default 2^20), for the ch2.c check where
+// there is one, the scalar builtin and the kernels. -fwrapv is for
+// ch2.c, whose tadd_ok tests the sign of a sum that overflowed, as the
+// book assumes signed arithmetic wraps.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include "checked_arith.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#else
+#define HAVE_X86 0
+#endif
+
+// The ch2.c checks, as they are there but with 1 and 0 for true and
+// false, and INT_MIN for -(1 << 31): 1 if there is no overflow
+
+// 2.27
+int uadd_ok(unsigned x, unsigned y) {
+  return (x + y) < x ? 0: 1;
+}
+
+// 2.30
+int tadd_ok(int x, int y) {
+  int sum = x + y;
+  if (x > 0 && y > 0 && sum < 0) return 0;
+  if (x < 0 && y < 0 && sum > 0) return 0;
+  return 1;
+}
+
+// 2.74
+int tsub_ok(int x, int y) {
+  if (y == INT_MIN) return 0;
+  return tadd_ok(x, -y);
+}
+
+// 2.35. Divides INT_MIN by -1 for tmult_ok(-1, INT_MIN), which traps,
+// so the values timed never have x == -1
+int tmult_ok(int x, int y) {
+  int p = x * y;
+  return !x || p / x == y;
+}
+
+// 2.36
+int tmult_ok2(int x, int y) {
+  long long p = (long long)x * y;
+  return p == (int)p;
+}
+
+// The arguments, results and overflows, as bytes, of any width
+static uint64_t *xs, *ys, *out, *ref;
+static unsigned char *ovf, *ref_ovf;
+static size_t n = 1 << 20;
+static int reps = 5;
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t mix64(uint64_t z) {
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// set - Store the low bits of v as element i of width bits
+static void set(uint64_t *a, int bits, size_t i, uint64_t v) {
+  switch (bits) {
+  case 8: ((uint8_t *) a)[i] = (uint8_t) v; break;
+  case 16: ((uint16_t *) a)[i] = (uint16_t) v; break;
+  case 32: ((uint32_t *) a)[i] = (uint32_t) v; break;
+  default: a[i] = v;
+  }
+}
+
+// random_val - The i-th random value of width bits, of a random
+// magnitude and sign, never -1 so tmult_ok can be timed
+static uint64_t random_val(int bits, uint64_t i) {
+  uint64_t r = mix64(i), m = mix64(~i);
+  uint64_t v = (r >> (64 - bits)) >> (m % bits);
+  v = (m >> 32) & 1 ? ~v : v;
+  return v == ~0ULL ? 0 : v;
+}
+
+// fill - Random values of width bits; with edges, all pairs of the
+// edge cases come first
+static void fill(int bits, int edges) {
+  uint64_t top = 1ULL << (bits - 1), half = 1ULL << (bits / 2);
+  uint64_t e[] = {
+    0, 1, 2, ~0ULL, top, top - 1, top + 1, ~top, half, half - 1,
+    half + 1, -half, -(half - 1), top >> 1, (top >> 1) + 1, ~0ULL - 1,
+  };
+  size_t ne = sizeof(e) / sizeof(e[0]), i;
+
+  for (i = 0; i < n; i++) {
+    uint64_t x = random_val(bits, 2 * i), y = random_val(bits, 2 * i + 1);
+    if (edges && i < ne * ne) {
+      x = e[i / ne];
+      y = e[i % ne];
+    }
+    set(xs, bits, i, x);
+    set(ys, bits, i, y);
+  }
+}
+
+// A kernel, its scalar loop and, if any, the ch2.c check for it
+typedef struct {
+  const char *name;
+  int bits;
+  void (*scalar)(void);
+  size_t (*batch[2])(void);
+  void (*ch2)(void);
+  const char *ch2_name;
+} kernel_t;
+
+#define SCALAR_LOOP(op, t, T)                                           \
+  static void op##_##t##_scalar(void) {                                 \
+    size_t i;                                                           \
+    for (i = 0; i < n; i++)                                             \
+      ref_ovf[i] = ck_##op##_##t(((T *) xs)[i], ((T *) ys)[i],          \
+                                 &((T *) ref)[i]);                      \
+  }
+
+#define BATCH(op, t, T, isa, attr)                                      \
+  attr static size_t op##_##t##_##isa(void) {                           \
+    return ck_##op##_##t##_batch((T *) xs, (T *) ys, (T *) out, ovf, n); \
+  }
+
+#define TYPE_FUNCTIONS(t, T)                                            \
+  SCALAR_LOOP(add, t, T) SCALAR_LOOP(sub, t, T) SCALAR_LOOP(mul, t, T)  \
+  BATCH(add, t, T, default, ) BATCH(sub, t, T, default, )               \
+  BATCH(mul, t, T, default, ) AVX2_FUNCTIONS(t, T)
+
+#if HAVE_X86
+#define AVX2 __attribute__((target("avx2")))
+#define AVX2_FUNCTIONS(t, T)                                            \
+  BATCH(add, t, T, avx2, AVX2) BATCH(sub, t, T, avx2, AVX2)             \
+  BATCH(mul, t, T, avx2, AVX2)
+#define AVX2_KERNEL(op, t) op##_##t##_avx2
+#else
+#define AVX2_FUNCTIONS(t, T)
+#define AVX2_KERNEL(op, t) NULL
+#endif
+
+TYPE_FUNCTIONS(i8, int8_t)
+TYPE_FUNCTIONS(i16, int16_t)
+TYPE_FUNCTIONS(i32, int32_t)
+TYPE_FUNCTIONS(i64, int64_t)
+TYPE_FUNCTIONS(u8, uint8_t)
+TYPE_FUNCTIONS(u16, uint16_t)
+TYPE_FUNCTIONS(u32, uint32_t)
+TYPE_FUNCTIONS(u64, uint64_t)
+
+// The ch2.c checks over the arrays, with the wrapped result as well
+#define CH2_LOOP(name, T, U, expr, check)                               \
+  static void name##_loop(void) {                                       \
+    size_t i;                                                           \
+    for (i = 0; i < n; i++) {                                           \
+      T x = ((T *) xs)[i], y = ((T *) ys)[i];                           \
+      ((T *) out)[i] = (T) ((U) x expr (U) y);                          \
+      ovf[i] = !check(x, y);                                            \
+    }                                                                   \
+  }
+
+CH2_LOOP(uadd_ok, unsigned, unsigned, +, uadd_ok)
+CH2_LOOP(tadd_ok, int, unsigned, +, tadd_ok)
+CH2_LOOP(tsub_ok, int, unsigned, -, tsub_ok)
+CH2_LOOP(tmult_ok, int, unsigned, *, tmult_ok)
+CH2_LOOP(tmult_ok2, int, unsigned, *, tmult_ok2)
+
+#define KERNEL(op, t, bits, ch2, ch2_name)                              \
+  { #op " " #t, bits, op##_##t##_scalar,                                \
+    { op##_##t##_default, AVX2_KERNEL(op, t) }, ch2, ch2_name }
+#define KERNELS(t, bits)                                                \
+  KERNEL(add, t, bits, NULL, NULL), KERNEL(sub, t, bits, NULL, NULL),   \
+  KERNEL(mul, t, bits, NULL, NULL)
+
+static const kernel_t kernels[] = {
+  KERNELS(i8, 8), KERNELS(i16, 16),
+  KERNEL(add, i32, 32, tadd_ok_loop, "tadd_ok"),
+  KERNEL(sub, i32, 32, tsub_ok_loop, "tsub_ok"),
+  KERNEL(mul, i32, 32, tmult_ok_loop, "tmult_ok"),
+  KERNEL(mul, i32, 32, tmult_ok2_loop, "tmult_ok2"),
+  KERNELS(i64, 64), KERNELS(u8, 8), KERNELS(u16, 16),
+  KERNEL(add, u32, 32, uadd_ok_loop, "uadd_ok"),
+  KERNEL(sub, u32, 32, NULL, NULL), KERNEL(mul, u32, 32, NULL, NULL),
+  KERNELS(u64, 64),
+};
+#define NKERNELS (int) (sizeof(kernels) / sizeof(kernels[0]))
+
+// differ - How many results and overflows in out and ovf differ from
+// the scalar ones; the first is printed
+static size_t differ(const kernel_t *k, const char *what) {
+  size_t i, bad = 0, w = k->bits / 8;
+
+  for (i = 0; i < n; i++) {
+    uint64_t x = 0, y = 0, r = 0, e = 0;
+    if (!memcmp((char *) out + i * w, (char *) ref + i * w, w) &&
+        ovf[i] == ref_ovf[i])
+      continue;
+    if (!bad++) {
+      memcpy(&x, (char *) xs + i * w, w);
+      memcpy(&y, (char *) ys + i * w, w);
+      memcpy(&r, (char *) out + i * w, w);
+      memcpy(&e, (char *) ref + i * w, w);
+      printf("  %s %s(0x%llx, 0x%llx) = 0x%llx, overflow %d, should be "
+             "0x%llx, overflow %d\n", k->name, what, (unsigned long long) x,
+             (unsigned long long) y, (unsigned long long) r, ovf[i],
+             (unsigned long long) e, ref_ovf[i]);
+    }
+  }
+  return bad;
+}
+
+// check - Run a kernel and compare it with the scalar loop
+static int check(const kernel_t *k, int isa, const char *what) {
+  size_t count, i, want = 0;
+
+  memset(out, 0x55, n * sizeof(uint64_t));
+  memset(ovf, 0x55, n);
+  count = k->batch[isa]();
+  for (i = 0; i < n; i++)
+    want += ref_ovf[i];
+  if (differ(k, what) || count != want) {
+    printf("  %s: the %s kernel is WRONG (%zu overflows, should be %zu)\n",
+           k->name, what, count, want);
+    return 1;
+  }
+  return 0;
+}
+
+// time_ns - Best time per value of f, in ns
+static double time_ns(void (*f)(void), size_t (*g)(void)) {
+  double best = 0;
+  int r;
+
+  for (r = 0; r < reps; r++) {
+    double beg = now_sec(), t;
+    if (f)
+      f();
+    else
+      g();
+    t = now_sec() - beg;
+    if (!best || t < best)
+      best = t;
+  }
+  return best * 1e9 / n;
+}
+
+static const char *isa_names[] = { "default", "avx2" };
+
+int main(int argc, char *argv[]) {
+  int c, i, isa, nisa = 1, failed = 0;
+
+  while ((c = getopt(argc, argv, "n:r:")) != -1) {
+    switch (c) {
+    case 'n':
+      n = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <values>] [-r <repetitions>]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (n < 256 || reps < 1) {
+    fprintf(stderr, "%s: need at least 256 values and 1 repetition\n",
+            argv[0]);
+    exit(1);
+  }
+
+  xs = malloc(n * sizeof(uint64_t));
+  ys = malloc(n * sizeof(uint64_t));
+  out = malloc(n * sizeof(uint64_t));
+  ref = malloc(n * sizeof(uint64_t));
+  ovf = malloc(n);
+  ref_ovf = malloc(n);
+  if (!xs || !ys || !out || !ref || !ovf || !ref_ovf) {
+    perror("malloc");
+    exit(1);
+  }
+#if HAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    nisa = 2;
+#endif
+
+  printf("%zu values, ns per value (best of %d)\n", n, reps);
+  printf("%-8s %8s %8s", "kernel", "ch2.c", "builtin");
+  for (isa = 0; isa < nisa; isa++)
+    printf(" %8s", isa_names[isa]);
+  printf("\n");
+
+  for (i = 0; i < NKERNELS; i++) {
+    const kernel_t *k = &kernels[i];
+    double t_isa[2], t_scalar, t_ch2 = 0;
+    size_t ch2_bad = 0;
+
+    // every kernel must match the builtins, edge cases included
+    fill(k->bits, 1);
+    k->scalar();
+    for (isa = 0; isa < nisa; isa++)
+      failed |= check(k, isa, isa_names[isa]);
+
+    // the timings, and the ch2.c check, are on random values only
+    fill(k->bits, 0);
+    k->scalar();
+    if (k->ch2) {
+      k->ch2();
+      ch2_bad = differ(k, k->ch2_name);
+      t_ch2 = time_ns(k->ch2, NULL);
+    }
+    t_scalar = time_ns(k->scalar, NULL);
+    for (isa = 0; isa < nisa; isa++)
+      t_isa[isa] = time_ns(NULL, k->batch[isa]);
+
+    printf("%-8s", k->name);
+    if (k->ch2)
+      printf(" %8.3f", t_ch2);
+    else
+      printf(" %8s", "-");
+    printf(" %8.3f", t_scalar);
+    for (isa = 0; isa < nisa; isa++)
+      printf(" %8.3f", t_isa[isa]);
+    if (k->ch2)
+      printf("   (ch2.c: %s%s)", k->ch2_name,
+             ch2_bad ? ", differs" : "");
+    printf("\n");
+  }
+  return failed;
+}
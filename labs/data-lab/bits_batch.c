@@ -0,0 +1,429 @@
+/*
+ * CS:APP Data Lab
+ *
+ * bits_batch.c - Array versions of some of the bits.c puzzles, see
+ * bits_batch.h.
+ *
+ * Every kernel has a portable scalar version, which also handles the
+ * tail of the arrays that does not fill a vector, an SSE2 version (4
+ * values at a time) and an AVX2 version (8 values at a time). The
+ * vector versions are compiled with target attributes, so the file
+ * needs no special flags, and are only called if the CPU supports
+ * them. Floating point kernels assume the default rounding mode, with
+ * denormals neither flushed to zero nor treated as zero.
+ */
+#include <string.h>
+#include "bits_batch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_X86 0
+#endif
+
+/* Is the float with bit representation u a NaN? */
+#define IS_NAN(u) (((u) & 0x7fffffff) > 0x7f800000)
+
+/******************
+ * Scalar kernels
+ ******************/
+
+/* popcount - The bitCount trick: add up bits in ever wider fields */
+static inline int popcount(unsigned u)
+{
+    u = u - ((u >> 1) & 0x55555555);
+    u = (u & 0x33333333) + ((u >> 2) & 0x33333333);
+    u = (u + (u >> 4)) & 0x0f0f0f0f;
+    u = u + (u >> 8);
+    u = u + (u >> 16);
+    return u & 0x3f;
+}
+
+static void bitCount_scalar(const int *x, int *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = popcount(x[i]);
+}
+
+/* Smear the leftmost 1 to the right, then count: ilog2 is one less */
+static void ilog2_scalar(const int *x, int *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+	unsigned u = x[i];
+	u |= u >> 1;
+	u |= u >> 2;
+	u |= u >> 4;
+	u |= u >> 8;
+	u |= u >> 16;
+	out[i] = popcount(u) - 1;
+    }
+}
+
+static void isLessOrEqual_scalar(const int *x, const int *y, int *out,
+				 size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = x[i] <= y[i];
+}
+
+static void logicalShift_scalar(const int *x, const int *s, int *out,
+				size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = (unsigned) x[i] >> s[i];
+}
+
+static void float_i2f_scalar(const int *x, unsigned *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+	float f = (float) x[i];
+	memcpy(&out[i], &f, sizeof(f));
+    }
+}
+
+static void float_twice_scalar(const unsigned *uf, unsigned *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+	float f;
+	memcpy(&f, &uf[i], sizeof(f));
+	f = 2 * f;
+	if (IS_NAN(uf[i]))
+	    out[i] = uf[i];
+	else
+	    memcpy(&out[i], &f, sizeof(f));
+    }
+}
+
+#if HAVE_X86
+
+/******************
+ * SSE2 kernels
+ ******************/
+
+#define SSE2 __attribute__((target("sse2")))
+
+/* The bitCount trick on 4 values */
+SSE2 static inline __m128i popcount_sse2(__m128i v)
+{
+    v = _mm_sub_epi32(v, _mm_and_si128(_mm_srli_epi32(v, 1),
+				       _mm_set1_epi32(0x55555555)));
+    v = _mm_add_epi32(_mm_and_si128(v, _mm_set1_epi32(0x33333333)),
+		      _mm_and_si128(_mm_srli_epi32(v, 2),
+				    _mm_set1_epi32(0x33333333)));
+    v = _mm_and_si128(_mm_add_epi32(v, _mm_srli_epi32(v, 4)),
+		      _mm_set1_epi32(0x0f0f0f0f));
+    v = _mm_add_epi32(v, _mm_srli_epi32(v, 8));
+    v = _mm_add_epi32(v, _mm_srli_epi32(v, 16));
+    return _mm_and_si128(v, _mm_set1_epi32(0x3f));
+}
+
+SSE2 static void bitCount_sse2(const int *x, int *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (x + i));
+	_mm_storeu_si128((__m128i *) (out + i), popcount_sse2(v));
+    }
+    bitCount_scalar(x + i, out + i, n - i);
+}
+
+SSE2 static void ilog2_sse2(const int *x, int *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (x + i));
+	v = _mm_or_si128(v, _mm_srli_epi32(v, 1));
+	v = _mm_or_si128(v, _mm_srli_epi32(v, 2));
+	v = _mm_or_si128(v, _mm_srli_epi32(v, 4));
+	v = _mm_or_si128(v, _mm_srli_epi32(v, 8));
+	v = _mm_or_si128(v, _mm_srli_epi32(v, 16));
+	v = _mm_sub_epi32(popcount_sse2(v), _mm_set1_epi32(1));
+	_mm_storeu_si128((__m128i *) (out + i), v);
+    }
+    ilog2_scalar(x + i, out + i, n - i);
+}
+
+SSE2 static void isLessOrEqual_sse2(const int *x, const int *y, int *out,
+				      size_t n)
+{
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128i vx = _mm_loadu_si128((const __m128i *) (x + i));
+	__m128i vy = _mm_loadu_si128((const __m128i *) (y + i));
+	__m128i gt = _mm_cmpgt_epi32(vx, vy);
+	_mm_storeu_si128((__m128i *) (out + i),
+			 _mm_andnot_si128(gt, _mm_set1_epi32(1)));
+    }
+    isLessOrEqual_scalar(x + i, y + i, out + i, n - i);
+}
+
+/*
+ * SSE2 only shifts all the values by the same count, so each value is
+ * shifted by 16, 8, 4, 2 and 1 where its count has that bit set
+ */
+SSE2 static void logicalShift_sse2(const int *x, const int *s, int *out,
+				     size_t n)
+{
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (x + i));
+	__m128i vs = _mm_loadu_si128((const __m128i *) (s + i));
+	__m128i zero = _mm_setzero_si128(), m;
+#define SHIFT_IF(bit)							\
+	m = _mm_cmpeq_epi32(_mm_and_si128(vs, _mm_set1_epi32(bit)), zero); \
+	v = _mm_or_si128(_mm_and_si128(m, v),				\
+			 _mm_andnot_si128(m, _mm_srli_epi32(v, bit)))
+	SHIFT_IF(16);
+	SHIFT_IF(8);
+	SHIFT_IF(4);
+	SHIFT_IF(2);
+	SHIFT_IF(1);
+#undef SHIFT_IF
+	_mm_storeu_si128((__m128i *) (out + i), v);
+    }
+    logicalShift_scalar(x + i, s + i, out + i, n - i);
+}
+
+SSE2 static void float_i2f_sse2(const int *x, unsigned *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (x + i));
+	_mm_storeu_si128((__m128i *) (out + i),
+			 _mm_castps_si128(_mm_cvtepi32_ps(v)));
+    }
+    float_i2f_scalar(x + i, out + i, n - i);
+}
+
+/* Doubling is exact up to overflow, NaNs are put back as they were */
+SSE2 static void float_twice_sse2(const unsigned *uf, unsigned *out,
+				    size_t n)
+{
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (uf + i));
+	__m128i twice = _mm_castps_si128(_mm_mul_ps(_mm_castsi128_ps(v),
+						    _mm_set1_ps(2.0f)));
+	__m128i nan = _mm_cmpgt_epi32(
+	    _mm_and_si128(v, _mm_set1_epi32(0x7fffffff)),
+	    _mm_set1_epi32(0x7f800000));
+	_mm_storeu_si128((__m128i *) (out + i),
+			 _mm_or_si128(_mm_and_si128(nan, v),
+				      _mm_andnot_si128(nan, twice)));
+    }
+    float_twice_scalar(uf + i, out + i, n - i);
+}
+
+/******************
+ * AVX2 kernels
+ ******************/
+
+#define AVX2 __attribute__((target("avx2")))
+
+/* Count the bits of each nibble with a table lookup, then add them up */
+AVX2 static inline __m256i popcount_avx2(__m256i v)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+					   1, 2, 2, 3, 2, 3, 3, 4,
+					   0, 1, 1, 2, 1, 2, 2, 3,
+					   1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i bytes = _mm256_add_epi8(
+	_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+	_mm256_shuffle_epi8(table,
+			    _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+    __m256i pairs = _mm256_maddubs_epi16(bytes, _mm256_set1_epi8(1));
+    return _mm256_madd_epi16(pairs, _mm256_set1_epi16(1));
+}
+
+AVX2 static void bitCount_avx2(const int *x, int *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) (x + i));
+	_mm256_storeu_si256((__m256i *) (out + i), popcount_avx2(v));
+    }
+    bitCount_scalar(x + i, out + i, n - i);
+}
+
+/*
+ * Keep only the leftmost 1 and convert it to float, which is exact for
+ * a power of 2: ilog2 is the exponent. 0 gives exponent -127, raised
+ * to -1.
+ */
+AVX2 static void ilog2_avx2(const int *x, int *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) (x + i));
+	v = _mm256_or_si256(v, _mm256_srli_epi32(v, 1));
+	v = _mm256_or_si256(v, _mm256_srli_epi32(v, 2));
+	v = _mm256_or_si256(v, _mm256_srli_epi32(v, 4));
+	v = _mm256_or_si256(v, _mm256_srli_epi32(v, 8));
+	v = _mm256_or_si256(v, _mm256_srli_epi32(v, 16));
+	v = _mm256_xor_si256(v, _mm256_srli_epi32(v, 1));
+	__m256i e = _mm256_castps_si256(_mm256_cvtepi32_ps(v));
+	e = _mm256_and_si256(_mm256_srli_epi32(e, 23), _mm256_set1_epi32(0xff));
+	e = _mm256_sub_epi32(e, _mm256_set1_epi32(127));
+	_mm256_storeu_si256((__m256i *) (out + i),
+			    _mm256_max_epi32(e, _mm256_set1_epi32(-1)));
+    }
+    ilog2_scalar(x + i, out + i, n - i);
+}
+
+AVX2 static void isLessOrEqual_avx2(const int *x, const int *y, int *out,
+				      size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256i vx = _mm256_loadu_si256((const __m256i *) (x + i));
+	__m256i vy = _mm256_loadu_si256((const __m256i *) (y + i));
+	__m256i gt = _mm256_cmpgt_epi32(vx, vy);
+	_mm256_storeu_si256((__m256i *) (out + i),
+			    _mm256_andnot_si256(gt, _mm256_set1_epi32(1)));
+    }
+    isLessOrEqual_scalar(x + i, y + i, out + i, n - i);
+}
+
+AVX2 static void logicalShift_avx2(const int *x, const int *s, int *out,
+				     size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) (x + i));
+	__m256i vs = _mm256_loadu_si256((const __m256i *) (s + i));
+	_mm256_storeu_si256((__m256i *) (out + i), _mm256_srlv_epi32(v, vs));
+    }
+    logicalShift_scalar(x + i, s + i, out + i, n - i);
+}
+
+AVX2 static void float_i2f_avx2(const int *x, unsigned *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) (x + i));
+	_mm256_storeu_si256((__m256i *) (out + i),
+			    _mm256_castps_si256(_mm256_cvtepi32_ps(v)));
+    }
+    float_i2f_scalar(x + i, out + i, n - i);
+}
+
+AVX2 static void float_twice_avx2(const unsigned *uf, unsigned *out,
+				    size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) (uf + i));
+	__m256 twice = _mm256_mul_ps(_mm256_castsi256_ps(v),
+				     _mm256_set1_ps(2.0f));
+	__m256i nan = _mm256_cmpgt_epi32(
+	    _mm256_and_si256(v, _mm256_set1_epi32(0x7fffffff)),
+	    _mm256_set1_epi32(0x7f800000));
+	_mm256_storeu_si256((__m256i *) (out + i),
+			    _mm256_blendv_epi8(_mm256_castps_si256(twice),
+					       v, nan));
+    }
+    float_twice_scalar(uf + i, out + i, n - i);
+}
+
+#endif /* HAVE_X86 */
+
+/******************
+ * Dispatch
+ ******************/
+
+typedef struct {
+    const char *name;
+    void (*bitCount)(const int *, int *, size_t);
+    void (*ilog2)(const int *, int *, size_t);
+    void (*isLessOrEqual)(const int *, const int *, int *, size_t);
+    void (*logicalShift)(const int *, const int *, int *, size_t);
+    void (*float_i2f)(const int *, unsigned *, size_t);
+    void (*float_twice)(const unsigned *, unsigned *, size_t);
+} kernels_t;
+
+static const kernels_t kernels[] = {
+    { "scalar", bitCount_scalar, ilog2_scalar, isLessOrEqual_scalar,
+      logicalShift_scalar, float_i2f_scalar, float_twice_scalar },
+#if HAVE_X86
+    { "sse2", bitCount_sse2, ilog2_sse2, isLessOrEqual_sse2,
+      logicalShift_sse2, float_i2f_sse2, float_twice_sse2 },
+    { "avx2", bitCount_avx2, ilog2_avx2, isLessOrEqual_avx2,
+      logicalShift_avx2, float_i2f_avx2, float_twice_avx2 },
+#endif
+};
+
+static const kernels_t *use = NULL;
+
+int bits_batch_select(int isa)
+{
+    int best = BITS_BATCH_SCALAR;
+
+#if HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+	best = BITS_BATCH_SSE2;
+    if (__builtin_cpu_supports("avx2"))
+	best = BITS_BATCH_AVX2;
+#endif
+    if (isa < 0 || isa > best)
+	isa = best;
+    use = &kernels[isa];
+    return isa;
+}
+
+const char *bits_batch_name(int isa)
+{
+    if (isa < 0 || isa >= (int) (sizeof(kernels) / sizeof(kernels[0])))
+	return "none";
+    return kernels[isa].name;
+}
+
+void bitCount_batch(const int *x, int *out, size_t n)
+{
+    if (!use)
+	bits_batch_select(-1);
+    use->bitCount(x, out, n);
+}
+
+void ilog2_batch(const int *x, int *out, size_t n)
+{
+    if (!use)
+	bits_batch_select(-1);
+    use->ilog2(x, out, n);
+}
+
+void isLessOrEqual_batch(const int *x, const int *y, int *out, size_t n)
+{
+    if (!use)
+	bits_batch_select(-1);
+    use->isLessOrEqual(x, y, out, n);
+}
+
+void logicalShift_batch(const int *x, const int *s, int *out, size_t n)
+{
+    if (!use)
+	bits_batch_select(-1);
+    use->logicalShift(x, s, out, n);
+}
+
+void float_i2f_batch(const int *x, unsigned *out, size_t n)
+{
+    if (!use)
+	bits_batch_select(-1);
+    use->float_i2f(x, out, n);
+}
+
+void float_twice_batch(const unsigned *uf, unsigned *out, size_t n)
+{
+    if (!use)
+	bits_batch_select(-1);
+    use->float_twice(uf, out, n);
+}
@@ -0,0 +1,49 @@
+/*
+ * CS:APP Data Lab
+ *
+ * bits_batch.h - Array versions of some of the bits.c puzzles.
+ *
+ * Each kernel applies a puzzle to n values at a time, with the exact
+ * semantics of its reference in tests.c, using SSE2 or AVX2 where the
+ * CPU has them. The best instruction set the CPU supports is picked at
+ * the first call, or with bits_batch_select.
+ */
+#ifndef __BITS_BATCH_H__
+#define __BITS_BATCH_H__
+
+#include <stddef.h>
+
+/* Instruction sets of the kernels */
+#define BITS_BATCH_SCALAR 0
+#define BITS_BATCH_SSE2   1
+#define BITS_BATCH_AVX2   2
+
+/* out[i] = bitCount(x[i]) */
+void bitCount_batch(const int *x, int *out, size_t n);
+
+/* out[i] = ilog2(x[i]), 31 for negative x[i] and -1 for 0 */
+void ilog2_batch(const int *x, int *out, size_t n);
+
+/* out[i] = isLessOrEqual(x[i], y[i]) */
+void isLessOrEqual_batch(const int *x, const int *y, int *out, size_t n);
+
+/* out[i] = logicalShift(x[i], s[i]), for 0 <= s[i] <= 31 */
+void logicalShift_batch(const int *x, const int *s, int *out, size_t n);
+
+/* out[i] = float_i2f(x[i]) */
+void float_i2f_batch(const int *x, unsigned *out, size_t n);
+
+/* out[i] = float_twice(uf[i]), NaNs are returned unchanged */
+void float_twice_batch(const unsigned *uf, unsigned *out, size_t n);
+
+/*
+ * bits_batch_select - Use the kernels for instruction set isa, or for
+ * the best one the CPU supports if isa is -1 or not supported. Return
+ * the instruction set in use.
+ */
+int bits_batch_select(int isa);
+
+/* bits_batch_name - The name of an instruction set */
+const char *bits_batch_name(int isa);
+
+#endif /* __BITS_BATCH_H__ */
@@ -0,0 +1,281 @@
+/*
+ * CS:APP Data Lab
+ *
+ * bits_bench.c - Check the bits_batch.c kernels against the references
+ * in tests.c, and time them against the bits.c solutions and the
+ * hardware instructions.
+ *
+ * Build: gcc -O2 -Wall -o bits_bench bits_bench.c bits_batch.c bits.c tests.c -lm
+ *
+ * usage: bits_bench [-n <values>] [-r <repetitions>]
+ * For each puzzle, every instruction set of the kernels is first run on
+ * random values and edge cases and compared with the reference. Then
+ * the time per value is reported, best of <repetitions> runs over
+ * arrays of <values> values (default 2^20, to stay in cache), for the
+ * bits.c solution called once per value, for each instruction set of
+ * the kernel and, for bitCount and ilog2, for loops of the popcnt and
+ * lzcnt instructions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "bits.h"
+#include "bits_batch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#else
+#define HAVE_X86 0
+#endif
+
+/* The arguments and results of the puzzles */
+static int *xs, *ys, *shifts, *out, *ref;
+static size_t n = 1 << 20;
+static int reps = 5;
+
+/* The instruction sets the CPU supports */
+static int best_isa;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned random_u32(void)
+{
+    return ((unsigned) rand() << 16) ^ (unsigned) rand();
+}
+
+/*
+ * fill_args - Random arguments, with edge cases at the start. ilog2 is
+ * only defined for x != 0, and logicalShift for 0 <= s <= 31.
+ */
+static void fill_args(void)
+{
+    static const unsigned edges[] = {
+	0, 1, 2, 3, 0x7fffffff, 0x80000000, 0x80000001, 0xffffffff,
+	0x00800000, 0x007fffff, 0x7f7fffff, 0x7f800000, 0xff800000,
+	0x7f800001, 0x7fc00000, 0xffc00001, 0x3f800000, 0x01000001,
+	0x00ffffff, 0x01ffffff, 0x7ffffff0,
+    };
+    size_t i, nedges = sizeof(edges) / sizeof(edges[0]);
+
+    for (i = 0; i < n; i++) {
+	xs[i] = i < nedges ? edges[i] : random_u32();
+	ys[i] = i < nedges ? edges[nedges - 1 - i] : random_u32();
+	/* make near and equal pairs common too */
+	if (i % 4 == 1)
+	    ys[i] = xs[i] + (int) (random_u32() % 3) - 1;
+	shifts[i] = random_u32() % 32;
+    }
+}
+
+/* A puzzle with its reference, bits.c solution and kernel */
+typedef struct {
+    const char *name;
+    void (*reference)(void);
+    void (*solution)(void);
+    void (*batch)(void);
+    void (*hardware)(void);    /* NULL if there is none */
+    const char *hardware_name;
+} puzzle_t;
+
+/*
+ * The reference and the solution write to ref and to out, the batch
+ * and hardware versions to out
+ */
+#define SCALAR_LOOP(name, dst, expr)				\
+    static void name(void)					\
+    {								\
+	size_t i;						\
+	for (i = 0; i < n; i++)					\
+	    dst[i] = expr;					\
+    }
+
+SCALAR_LOOP(bitCount_ref, ref, test_bitCount(xs[i]))
+SCALAR_LOOP(bitCount_sol, out, bitCount(xs[i]))
+SCALAR_LOOP(ilog2_ref, ref, xs[i] ? test_ilog2(xs[i]) : -1)
+SCALAR_LOOP(ilog2_sol, out, ilog2(xs[i]))
+SCALAR_LOOP(isLessOrEqual_ref, ref, test_isLessOrEqual(xs[i], ys[i]))
+SCALAR_LOOP(isLessOrEqual_sol, out, isLessOrEqual(xs[i], ys[i]))
+SCALAR_LOOP(logicalShift_ref, ref, test_logicalShift(xs[i], shifts[i]))
+SCALAR_LOOP(logicalShift_sol, out, logicalShift(xs[i], shifts[i]))
+SCALAR_LOOP(float_i2f_ref, ref, test_float_i2f(xs[i]))
+SCALAR_LOOP(float_i2f_sol, out, float_i2f(xs[i]))
+SCALAR_LOOP(float_twice_ref, ref, test_float_twice(xs[i]))
+SCALAR_LOOP(float_twice_sol, out, float_twice(xs[i]))
+
+static void bitCount_bat(void) { bitCount_batch(xs, out, n); }
+static void ilog2_bat(void) { ilog2_batch(xs, out, n); }
+static void isLessOrEqual_bat(void) { isLessOrEqual_batch(xs, ys, out, n); }
+static void logicalShift_bat(void) { logicalShift_batch(xs, shifts, out, n); }
+static void float_i2f_bat(void)
+{
+    float_i2f_batch(xs, (unsigned *) out, n);
+}
+static void float_twice_bat(void)
+{
+    float_twice_batch((unsigned *) xs, (unsigned *) out, n);
+}
+
+#if HAVE_X86
+__attribute__((target("popcnt")))
+static void bitCount_popcnt(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = _mm_popcnt_u32(xs[i]);
+}
+
+/* lzcnt of 0 is 32, which gives ilog2(0) = -1 as the kernels do */
+__attribute__((target("lzcnt")))
+static void ilog2_lzcnt(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = 31 - (int) _lzcnt_u32(xs[i]);
+}
+#define POPCNT bitCount_popcnt
+#define LZCNT ilog2_lzcnt
+#else
+#define POPCNT NULL
+#define LZCNT NULL
+#endif
+
+static const puzzle_t puzzles[] = {
+    { "bitCount", bitCount_ref, bitCount_sol, bitCount_bat, POPCNT, "popcnt" },
+    { "ilog2", ilog2_ref, ilog2_sol, ilog2_bat, LZCNT, "lzcnt" },
+    { "isLessOrEqual", isLessOrEqual_ref, isLessOrEqual_sol,
+      isLessOrEqual_bat, NULL, NULL },
+    { "logicalShift", logicalShift_ref, logicalShift_sol, logicalShift_bat,
+      NULL, NULL },
+    { "float_i2f", float_i2f_ref, float_i2f_sol, float_i2f_bat, NULL, NULL },
+    { "float_twice", float_twice_ref, float_twice_sol, float_twice_bat,
+      NULL, NULL },
+};
+#define NPUZZLES (int) (sizeof(puzzles) / sizeof(puzzles[0]))
+
+/*
+ * check - Run f into out and compare with ref. Return the number of
+ * values that differ, and print the first one.
+ */
+static size_t check(const puzzle_t *p, const char *what, void (*f)(void))
+{
+    size_t i, bad = 0;
+
+    memset(out, 0x55, n * sizeof(int));
+    f();
+    for (i = 0; i < n; i++) {
+	if (out[i] != ref[i] && !bad++)
+	    printf("  %s %s(0x%08x, 0x%08x, %d) = 0x%08x, should be 0x%08x\n",
+		   p->name, what, xs[i], ys[i], shifts[i], out[i], ref[i]);
+    }
+    return bad;
+}
+
+/* time_ns - Best time per value of f, in ns */
+static double time_ns(void (*f)(void))
+{
+    double best = 0;
+    int r;
+
+    for (r = 0; r < reps; r++) {
+	double beg = now_sec(), t;
+	f();
+	t = now_sec() - beg;
+	if (!best || t < best)
+	    best = t;
+    }
+    return best * 1e9 / n;
+}
+
+int main(int argc, char *argv[])
+{
+    int c, i, isa, failed = 0;
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+	switch (c) {
+	case 'n':
+	    n = strtoul(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    reps = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-n <values>] [-r <repetitions>]\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+    if (n < 64 || reps < 1) {
+	fprintf(stderr, "%s: need at least 64 values and 1 repetition\n",
+		argv[0]);
+	exit(1);
+    }
+
+    xs = malloc(n * sizeof(int));
+    ys = malloc(n * sizeof(int));
+    shifts = malloc(n * sizeof(int));
+    out = malloc(n * sizeof(int));
+    ref = malloc(n * sizeof(int));
+    if (!xs || !ys || !shifts || !out || !ref) {
+	perror("malloc");
+	exit(1);
+    }
+    srand(1);
+    fill_args();
+    best_isa = bits_batch_select(-1);
+
+    printf("%zu values, ns per value (best of %d), kernels up to %s\n",
+	   n, reps, bits_batch_name(best_isa));
+    printf("%-14s %8s", "puzzle", "bits.c");
+    for (isa = 0; isa <= best_isa; isa++)
+	printf(" %8s", bits_batch_name(isa));
+    printf(" %8s\n", "hardware");
+
+    for (i = 0; i < NPUZZLES; i++) {
+	const puzzle_t *p = &puzzles[i];
+	double t_isa[BITS_BATCH_AVX2 + 1];
+	double t_sol, t_hw = 0;
+	size_t sol_bad;
+
+	/* the kernels must match the reference on every value */
+	p->reference();
+	for (isa = 0; isa <= best_isa; isa++) {
+	    bits_batch_select(isa);
+	    if (check(p, bits_batch_name(isa), p->batch)) {
+		printf("  %s: the %s kernel is WRONG\n", p->name,
+		       bits_batch_name(isa));
+		failed = 1;
+	    }
+	}
+	if (p->hardware && check(p, p->hardware_name, p->hardware))
+	    failed = 1;
+	sol_bad = check(p, "bits.c", p->solution);
+
+	t_sol = time_ns(p->solution);
+	for (isa = 0; isa <= best_isa; isa++) {
+	    bits_batch_select(isa);
+	    t_isa[isa] = time_ns(p->batch);
+	}
+	if (p->hardware)
+	    t_hw = time_ns(p->hardware);
+
+	printf("%-14s %8.3f", p->name, t_sol);
+	for (isa = 0; isa <= best_isa; isa++)
+	    printf(" %8.3f", t_isa[isa]);
+	if (p->hardware)
+	    printf(" %8.3f %s", t_hw, p->hardware_name);
+	else
+	    printf(" %8s", "-");
+	if (sol_bad)
+	    printf("  (bits.c differs on %zu values)", sol_bad);
+	printf("\n");
+    }
+    return failed;
+}
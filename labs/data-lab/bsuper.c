@@ -0,0 +1,1090 @@
+/*
+ * CS:APP Data Lab
+ *
+ * bsuper.c - Superoptimizer for the integer puzzles: find a program with
+ * the fewest operators, and then the shortest latency, that computes a
+ * puzzle with the operators its test_rec allows.
+ *
+ * Build: gcc -O2 -Wall -pthread -o bsuper bsuper.c decl.c tests.c bits.c -lm
+ *
+ * usage: bsuper [-f <name>] [-n <max ops>] [-c <constants>] [-m <MB>]
+ *               [-j <threads>] [-v <vectors>]
+ *
+ * The search is bottom-up. Programs with 0 operators are the arguments
+ * and the constants (by default 1 2 3 4 8 16 24 31 0xf 0x33 0x55 0xff,
+ * or the list given with -c). Programs with k operators apply an
+ * operator to programs with fewer. Every program is run on a few dozen
+ * test vectors, and only the first program with the same results on all
+ * of them is kept (the bank holds one program per "signature"), which
+ * keeps the bank to the programs that behave differently. A program with
+ * the puzzle's results on the vectors is a candidate. The size of the
+ * programs grows until a candidate is found, or the bank fills its
+ * memory budget (-m, default 1024 MB), or the size passes the puzzle's
+ * op_limit (or -n).
+ *
+ * Once all the programs with up to L operators are in the bank, the
+ * programs A ^ B, A + B and ~A over the bank are also tried, by looking
+ * up the signature B needs. That reaches programs of up to 2L + 1
+ * operators, but only of that shape, so they are reported as minimal
+ * only if they have L + 1 operators.
+ *
+ * Candidates are checked against the reference in tests.c on every
+ * argument if there are at most 2^32 of them, otherwise on <vectors>
+ * (default 2^24) corner and random cases. A candidate that fails gives a
+ * counterexample, which is added to the test vectors before the search
+ * starts over. "No program with up to L ops" is exact: the vectors are
+ * valid arguments, so a correct program would have been a candidate.
+ *
+ * Each level is built in rounds of tiles of candidates, which the
+ * threads (-j, default one per CPU) run in parallel against the bank as
+ * it was at the start of the round. The tiles are then merged into the
+ * bank in order, so the result does not depend on the thread count.
+ * Floating point puzzles are not searched.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include "btest.h"
+
+/* The operators of dlc, and the leaves of the programs */
+enum { OP_ARG, OP_CONST, OP_NOT, OP_INV, OP_AND, OP_XOR, OP_OR, OP_ADD,
+       OP_SHL, OP_SHR, NOPS };
+static const char *op_names[NOPS] = {
+    "", "", "!", "~", "&", "^", "|", "+", "<<", ">>"
+};
+#define IS_UNARY(op) ((op) == OP_NOT || (op) == OP_INV)
+#define IS_COMMUTATIVE(op) ((op) >= OP_AND && (op) <= OP_ADD)
+
+#define MAXSIZE 250          /* max operators in a program */
+#define MAXVECS 256          /* max test vectors, with the counterexamples */
+#define INIT_VECS 32         /* test vectors to start with */
+#define MAXCONSTS 256
+#define TILE 8192            /* candidates in a unit of work */
+#define TILES_PER_THREAD 4   /* units of work per thread in a round */
+#define TILE_SOLS 64         /* candidates a tile keeps */
+#define MAXSOLS 1024         /* candidates kept for checking */
+#define BLOCK 1024           /* arguments checked at a time */
+#define PRECHECK 65536       /* random arguments tried before the full check */
+#define NCORNERS 7           /* corner values of an argument */
+#define MAXTHREADS 256
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* A program: an operator applied to programs in the bank */
+typedef struct {
+    unsigned char op;
+    unsigned char size;      /* number of operators */
+    unsigned char depth;     /* operators on the longest path: the latency */
+    int a, b;                /* operands, or the arg number or constant */
+} node_t;
+
+/* A unit of work: op applied to left operands l0..l1 and right r0..r1 */
+typedef struct {
+    int op, unary, tri;      /* tri: only right >= left, for a op a */
+    int l0, l1, r0, r1;
+    node_t *out;             /* new programs, with their signatures */
+    unsigned *hashes;
+    int *sigs;
+    int nout;
+    node_t sols[TILE_SOLS];  /* candidates */
+    int nsols;
+} tile_t;
+
+/* The operators and sizes of the operands of a level */
+typedef struct {
+    int op, unary, tri;
+    int s1, s2;
+} task_t;
+
+/* A slot of the hash table of signatures */
+typedef struct {
+    unsigned hash;
+    unsigned node;           /* node index + 1, 0 if empty */
+} slot_t;
+
+/* Options */
+static int nthreads = 0;
+static int max_ops = MAXSIZE;
+static size_t mem_mb = 1024;
+static long long nverify = 1 << 24;
+static int consts[MAXCONSTS] = { 1, 2, 3, 4, 8, 16, 24, 31, 0xf, 0x33, 0x55,
+				 0xff };
+static int nconsts = 12;
+
+/* The puzzle being searched */
+static test_ptr t;
+static int allowed[NOPS];
+static const char *arg_names[3];
+
+/* Test vectors, with the puzzle's results on them */
+static int nvecs, npending;
+static int vec_args[3][MAXVECS];
+static int target[MAXVECS];
+
+/* The bank: one program per signature, by size */
+static node_t *nodes;
+static int *sigs;            /* nvecs results of each node */
+static int nnodes, max_nodes;
+static int level_start[MAXSIZE + 2];
+static slot_t *table;
+static unsigned table_mask;
+
+/* The level being built */
+static task_t tasks[NOPS * (MAXSIZE + 1)];
+static int ntasks;
+static struct { int task, l, r; } cur;
+static tile_t *tiles;
+static int ntiles, ntiles_round;
+static volatile int next_work;
+static node_t sols[MAXSOLS];
+static int nsols;
+
+static double start_time;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long mix64(unsigned long long z)
+{
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (!p) {
+	fprintf(stderr, "bsuper: out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+/*
+ * run_threads - Run fn in every thread, and wait for them. The threads
+ * take their work from next_work.
+ */
+static void run_threads(void *(*fn)(void *))
+{
+    pthread_t tid[MAXTHREADS];
+    int i;
+
+    next_work = 0;
+    if (nthreads == 1) {
+	fn(NULL);
+	return;
+    }
+    for (i = 0; i < nthreads; i++)
+	if (pthread_create(&tid[i], NULL, fn, NULL)) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tid[i], NULL);
+}
+
+/**************************
+ * Arguments of the puzzle
+ **************************/
+
+/* corner - The i-th corner value of argument a, clamped to its range */
+static int corner(int a, int i)
+{
+    long long lo = t->arg_ranges[a][0], hi = t->arg_ranges[a][1];
+    long long v[NCORNERS] = { lo, lo + 1, -1, 0, 1, hi - 1, hi };
+    return (int) MAX(lo, MIN(hi, v[i]));
+}
+
+/*
+ * random_arg - A random value of argument a. Uniform values are poor at
+ * telling programs apart, so small values, powers of two and their
+ * neighbors, and values close to the first argument are as frequent.
+ */
+static int random_arg(int a, unsigned long long r, int x0)
+{
+    long long lo = t->arg_ranges[a][0], hi = t->arg_ranges[a][1];
+    long long v;
+
+    switch (r & 3) {
+    case 0:
+	v = (int) (r >> 32);
+	break;
+    case 1:
+	v = (long long) ((r >> 8) % 64) - 32;
+	break;
+    case 2:
+	v = (int) (1u << ((r >> 8) % 32)) + (long long) ((r >> 16) % 3) - 1;
+	if (r & 4)
+	    v = -v;
+	break;
+    default:
+	v = a ? (long long) x0 + (long long) ((r >> 8) % 5) - 2
+	    : (int) ((r >> 32) >> ((r >> 8) % 32));
+	break;
+    }
+    if (v < lo || v > hi)
+	v = lo + (long long) ((r >> 32) % (unsigned long long) (hi - lo + 1));
+    return (int) v;
+}
+
+/* domain_size - The number of argument tuples of the puzzle */
+static double domain_size(void)
+{
+    double n = 1;
+    int a;
+
+    for (a = 0; a < t->args; a++)
+	n *= (double) t->arg_ranges[a][1] - t->arg_ranges[a][0] + 1;
+    return n;
+}
+
+/*
+ * get_tuple - The i-th argument tuple: every tuple in order if exhaustive,
+ * otherwise the corners and then random ones
+ */
+static void get_tuple(long long i, int exhaustive, int x[3])
+{
+    unsigned long long r;
+    long long ncorner = 1;
+    int a;
+
+    if (exhaustive) {
+	for (a = 0; a < t->args; a++) {
+	    long long lo = t->arg_ranges[a][0], hi = t->arg_ranges[a][1];
+	    x[a] = (int) (lo + i % (hi - lo + 1));
+	    i /= hi - lo + 1;
+	}
+	return;
+    }
+    for (a = 0; a < t->args; a++)
+	ncorner *= NCORNERS;
+    if (i < ncorner) {
+	for (a = 0; a < t->args; a++, i /= NCORNERS)
+	    x[a] = corner(a, i % NCORNERS);
+	return;
+    }
+    r = mix64(i);
+    for (a = 0; a < t->args; a++, r = mix64(r))
+	x[a] = random_arg(a, r, x[0]);
+}
+
+static int call_ref(const int x[3])
+{
+    switch (t->args) {
+    case 0:
+	return t->test_funct();
+    case 1:
+	return ((funct1_t) t->test_funct)(x[0]);
+    case 2:
+	return ((funct2_t) t->test_funct)(x[0], x[1]);
+    default:
+	return ((funct3_t) t->test_funct)(x[0], x[1], x[2]);
+    }
+}
+
+/*
+ * add_vector - Add a test vector for the next start of the search.
+ * Return 0 if there is no room or it is there already.
+ */
+static int add_vector(const int x[3])
+{
+    int i, a, n = nvecs + npending;
+
+    for (i = 0; i < n; i++) {
+	for (a = 0; a < t->args && vec_args[a][i] == x[a]; a++)
+	    ;
+	if (a == t->args)
+	    return 0;
+    }
+    if (n == MAXVECS)
+	return 0;
+    for (a = 0; a < 3; a++)
+	vec_args[a][n] = a < t->args ? x[a] : 0;
+    target[n] = call_ref(x);
+    npending++;
+    return 1;
+}
+
+/*************************
+ * Evaluating the programs
+ *************************/
+
+/*
+ * apply - out = a op b on n values. Return nonzero if a shift amount is
+ * outside 0..31, where the result is undefined in C.
+ */
+static int apply(int op, const int *a, const int *b, int *out, int n)
+{
+    unsigned bad = 0;
+    int i;
+
+    switch (op) {
+    case OP_NOT:
+	for (i = 0; i < n; i++)
+	    out[i] = !a[i];
+	break;
+    case OP_INV:
+	for (i = 0; i < n; i++)
+	    out[i] = ~a[i];
+	break;
+    case OP_AND:
+	for (i = 0; i < n; i++)
+	    out[i] = a[i] & b[i];
+	break;
+    case OP_XOR:
+	for (i = 0; i < n; i++)
+	    out[i] = a[i] ^ b[i];
+	break;
+    case OP_OR:
+	for (i = 0; i < n; i++)
+	    out[i] = a[i] | b[i];
+	break;
+    case OP_ADD:
+	for (i = 0; i < n; i++)
+	    out[i] = (int) ((unsigned) a[i] + (unsigned) b[i]);
+	break;
+    case OP_SHL:
+	for (i = 0; i < n; i++) {
+	    bad |= (unsigned) b[i] > 31;
+	    out[i] = (int) ((unsigned) a[i] << (b[i] & 31));
+	}
+	break;
+    case OP_SHR:
+	for (i = 0; i < n; i++) {
+	    bad |= (unsigned) b[i] > 31;
+	    out[i] = a[i] >> (b[i] & 31);
+	}
+	break;
+    }
+    return bad;
+}
+
+/*
+ * eval_block - Run program n on the n tuples of in, into out, and set
+ * bad[i] where a shift amount is out of range. tmp has room for BLOCK
+ * values per operator of the program.
+ */
+static void eval_block(const node_t *n, int *in[3], int cnt, int *out,
+		       int *bad, int *tmp)
+{
+    int i;
+
+    switch (n->op) {
+    case OP_ARG:
+	memcpy(out, in[n->a], cnt * sizeof(int));
+	return;
+    case OP_CONST:
+	for (i = 0; i < cnt; i++)
+	    out[i] = n->a;
+	return;
+    }
+    eval_block(&nodes[n->a], in, cnt, out, bad, tmp);
+    if (!IS_UNARY(n->op)) {
+	eval_block(&nodes[n->b], in, cnt, tmp, bad, tmp + BLOCK);
+	if (n->op == OP_SHL || n->op == OP_SHR)
+	    for (i = 0; i < cnt; i++)
+		bad[i] |= (unsigned) tmp[i] > 31;
+    }
+    apply(n->op, out, tmp, out, cnt);
+}
+
+/* The program being checked, and the first argument tuple it fails on */
+static const node_t *check_prog;
+static long long check_count;
+static int check_exhaustive;
+static volatile long long check_fail;
+
+static void *check_worker(void *arg)
+{
+    int *buf = xmalloc((6 + MAXSIZE + 1) * BLOCK * sizeof(int));
+    int *in[3] = { buf, buf + BLOCK, buf + 2 * BLOCK };
+    int *out = buf + 3 * BLOCK, *bad = buf + 4 * BLOCK, *ref = buf + 5 * BLOCK;
+    long long beg;
+    int i, cnt, x[3];
+
+    while ((beg = (long long) __sync_fetch_and_add(&next_work, 1) * BLOCK)
+	   < check_count) {
+	if (check_fail >= 0 && check_fail < beg)
+	    break;
+	cnt = (int) MIN(BLOCK, check_count - beg);
+	for (i = 0; i < cnt; i++) {
+	    get_tuple(beg + i, check_exhaustive, x);
+	    in[0][i] = x[0];
+	    in[1][i] = x[1];
+	    in[2][i] = x[2];
+	    ref[i] = call_ref(x);
+	    bad[i] = 0;
+	}
+	eval_block(check_prog, in, cnt, out, bad, buf + 6 * BLOCK);
+	for (i = 0; i < cnt; i++) {
+	    if (out[i] != ref[i] || bad[i]) {
+		long long fail;
+		do {
+		    fail = check_fail;
+		} while ((fail < 0 || beg + i < fail) &&
+			 !__sync_bool_compare_and_swap(&check_fail, fail,
+						       beg + i));
+		break;
+	    }
+	}
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * check - Run program n on count tuples. Return -1 if it is right on all
+ * of them, otherwise the first tuple it is wrong on, in x.
+ */
+static long long check(const node_t *n, long long count, int exhaustive,
+		       int x[3])
+{
+    /* the block counter is an int */
+    if (count / BLOCK >= INT_MAX)
+	count = (long long) (INT_MAX - 1) * BLOCK;
+    check_prog = n;
+    check_count = count;
+    check_exhaustive = exhaustive;
+    check_fail = -1;
+    run_threads(check_worker);
+    if (check_fail >= 0)
+	get_tuple(check_fail, exhaustive, x);
+    return check_fail;
+}
+
+/*
+ * verify - Check candidate n against the reference, first on a few
+ * random tuples, then on every tuple or on nverify of them. On failure,
+ * add the counterexample to the test vectors and return 0.
+ */
+static int verify(const node_t *n)
+{
+    int x[3], exhaustive = domain_size() <= 4294967296.0;
+    long long count = exhaustive ? (long long) domain_size() : nverify;
+
+    if (check(n, MIN(PRECHECK, count), 0, x) >= 0 ||
+	check(n, count, exhaustive, x) >= 0) {
+	add_vector(x);
+	return 0;
+    }
+    return 1;
+}
+
+/* print_prog - Write program n as a C expression */
+static char *print_prog(const node_t *n, int top, char *p, char *end)
+{
+    switch (n->op) {
+    case OP_ARG:
+	return p + snprintf(p, end - p, "%s", arg_names[n->a]);
+    case OP_CONST:
+	return p + snprintf(p, end - p, n->a <= 32 ? "%d" : "0x%x", n->a);
+    }
+    if (IS_UNARY(n->op)) {
+	p += snprintf(p, end - p, "%s", op_names[n->op]);
+	return print_prog(&nodes[n->a], 0, p, end);
+    }
+    if (!top)
+	p += snprintf(p, end - p, "(");
+    p = print_prog(&nodes[n->a], 0, p, end);
+    p += snprintf(p, end - p, " %s ", op_names[n->op]);
+    p = print_prog(&nodes[n->b], 0, p, end);
+    if (!top)
+	p += snprintf(p, end - p, ")");
+    return p;
+}
+
+/**********
+ * The bank
+ **********/
+
+static unsigned hash_sig(const int *s)
+{
+    unsigned long long h = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for (i = 0; i < nvecs; i++)
+	h = (h ^ (unsigned) s[i]) * 0xff51afd7ed558ccdULL;
+    return (unsigned) (h ^ (h >> 29));
+}
+
+/* lookup - The node with signature s (of hash h), or -1 */
+static int lookup(const int *s, unsigned h)
+{
+    unsigned i;
+
+    for (i = h & table_mask; table[i].node; i = (i + 1) & table_mask)
+	if (table[i].hash == h &&
+	    !memcmp(sigs + (size_t) (table[i].node - 1) * nvecs, s,
+		    nvecs * sizeof(int)))
+	    return table[i].node - 1;
+    return -1;
+}
+
+/* insert - Add n with signature s (of hash h), which is not in the bank */
+static void insert(const node_t *n, const int *s, unsigned h)
+{
+    unsigned i;
+
+    for (i = h & table_mask; table[i].node; i = (i + 1) & table_mask)
+	;
+    table[i].hash = h;
+    table[i].node = nnodes + 1;
+    nodes[nnodes] = *n;
+    memcpy(sigs + (size_t) nnodes * nvecs, s, nvecs * sizeof(int));
+    nnodes++;
+}
+
+/* free_bank - Free the bank and the tiles */
+static void free_bank(void)
+{
+    int i;
+
+    for (i = 0; i < ntiles; i++) {
+	free(tiles[i].out);
+	free(tiles[i].hashes);
+	free(tiles[i].sigs);
+    }
+    free(tiles);
+    free(nodes);
+    free(sigs);
+    free(table);
+}
+
+/*
+ * init_bank - Make an empty bank that fits in the memory budget, for the
+ * current test vectors, and add the arguments and constants to it
+ */
+static void init_bank(void)
+{
+    size_t per_node = sizeof(node_t) + nvecs * sizeof(int) +
+	2 * sizeof(slot_t);
+    size_t size = 1;
+    int s[MAXVECS], i, a;
+    node_t n = { 0 };
+
+    max_nodes = (int) MIN(mem_mb * 1024 * 1024 / per_node, INT_MAX / 4);
+    while (size < 2 * (size_t) max_nodes)
+	size *= 2;
+    nodes = xmalloc(max_nodes * sizeof(node_t));
+    sigs = xmalloc((size_t) max_nodes * nvecs * sizeof(int));
+    table = calloc(size, sizeof(slot_t));
+    if (!table) {
+	fprintf(stderr, "bsuper: out of memory\n");
+	exit(1);
+    }
+    table_mask = size - 1;
+    nnodes = 0;
+
+    ntiles = nthreads * TILES_PER_THREAD;
+    tiles = xmalloc(ntiles * sizeof(tile_t));
+    for (i = 0; i < ntiles; i++) {
+	tiles[i].out = xmalloc(TILE * sizeof(node_t));
+	tiles[i].hashes = xmalloc(TILE * sizeof(unsigned));
+	tiles[i].sigs = xmalloc((size_t) TILE * nvecs * sizeof(int));
+    }
+
+    /* the programs with no operators */
+    nsols = 0;
+    for (a = 0; a < t->args + nconsts; a++) {
+	n.op = a < t->args ? OP_ARG : OP_CONST;
+	n.a = a < t->args ? a : consts[a - t->args];
+	for (i = 0; i < nvecs; i++)
+	    s[i] = a < t->args ? vec_args[a][i] : n.a;
+	if (!memcmp(s, target, nvecs * sizeof(int)) && nsols < MAXSOLS)
+	    sols[nsols++] = n;
+	if (lookup(s, hash_sig(s)) < 0)
+	    insert(&n, s, hash_sig(s));
+    }
+    level_start[0] = 0;
+    level_start[1] = nnodes;
+}
+
+/**********************
+ * Building the levels
+ **********************/
+
+/* next_tile - The next unit of work of the level, in tl. 0 at the end. */
+static int next_tile(tile_t *tl)
+{
+    for (; cur.task < ntasks; cur.task++, cur.l = cur.r = 0) {
+	task_t *tk = &tasks[cur.task];
+	int l0 = level_start[tk->s1], nl = level_start[tk->s1 + 1] - l0;
+	int r0 = tk->unary ? 0 : level_start[tk->s2];
+	int nr = tk->unary ? 1 : level_start[tk->s2 + 1] - r0;
+
+	if (cur.l >= nl || nr == 0)
+	    continue;
+	tl->op = tk->op;
+	tl->unary = tk->unary;
+	tl->tri = tk->tri;
+	if (nr >= TILE) {
+	    /* one left operand, a slice of the right ones */
+	    tl->l0 = l0 + cur.l;
+	    tl->l1 = tl->l0 + 1;
+	    tl->r0 = r0 + cur.r;
+	    tl->r1 = r0 + MIN(cur.r + TILE, nr);
+	    cur.r += TILE;
+	    if (cur.r >= nr) {
+		cur.r = 0;
+		cur.l++;
+	    }
+	} else {
+	    tl->l0 = l0 + cur.l;
+	    tl->l1 = l0 + MIN(cur.l + TILE / nr, nl);
+	    tl->r0 = r0;
+	    tl->r1 = r0 + nr;
+	    cur.l += TILE / nr;
+	}
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * run_tile - Run the candidates of a tile of level k on the test vectors.
+ * Keep the ones whose signature is not in the bank, or is in it from
+ * level k with a longer latency, and the ones that match the target.
+ */
+static void run_tile(tile_t *tl, int k)
+{
+    int i, j, idx, depth;
+
+    tl->nout = tl->nsols = 0;
+    for (i = tl->l0; i < tl->l1; i++) {
+	const int *a = sigs + (size_t) i * nvecs;
+	for (j = tl->tri ? MAX(i, tl->r0) : tl->r0; j < tl->r1; j++) {
+	    int *s = tl->sigs + (size_t) tl->nout * nvecs;
+	    node_t n;
+	    unsigned h;
+
+	    if (apply(tl->op, a, sigs + (size_t) j * nvecs, s, nvecs))
+		continue;
+	    depth = 1 + MAX(nodes[i].depth, tl->unary ? 0 : nodes[j].depth);
+	    n.op = tl->op;
+	    n.size = k;
+	    n.depth = depth;
+	    n.a = i;
+	    n.b = tl->unary ? 0 : j;
+	    if (!memcmp(s, target, nvecs * sizeof(int)) &&
+		tl->nsols < TILE_SOLS)
+		tl->sols[tl->nsols++] = n;
+	    h = hash_sig(s);
+	    idx = lookup(s, h);
+	    if (idx >= 0 && (nodes[idx].size < k || nodes[idx].depth <= depth))
+		continue;
+	    tl->hashes[tl->nout] = h;
+	    tl->out[tl->nout++] = n;
+	}
+    }
+}
+
+static int level_k;
+
+static void *tile_worker(void *arg)
+{
+    int i;
+
+    while ((i = __sync_fetch_and_add(&next_work, 1)) < ntiles_round)
+	run_tile(&tiles[i], level_k);
+    return NULL;
+}
+
+/*
+ * build_level - Add the programs with k operators to the bank, and the
+ * candidates among them to sols. Return 0 if the bank is full before
+ * the level is complete.
+ */
+static int build_level(int k)
+{
+    int op, s1, i, j, complete = 1;
+
+    ntasks = 0;
+    for (op = OP_NOT; op < NOPS; op++) {
+	if (!allowed[op])
+	    continue;
+	for (s1 = IS_UNARY(op) ? k - 1 : 0; s1 < k; s1++) {
+	    task_t *tk = &tasks[ntasks];
+	    tk->op = op;
+	    tk->unary = IS_UNARY(op);
+	    tk->s1 = s1;
+	    tk->s2 = k - 1 - s1;
+	    if (IS_COMMUTATIVE(op) && tk->s1 > tk->s2)
+		continue;
+	    tk->tri = IS_COMMUTATIVE(op) && tk->s1 == tk->s2;
+	    ntasks++;
+	}
+    }
+    cur.task = cur.l = cur.r = 0;
+    level_k = k;
+
+    while (complete) {
+	for (ntiles_round = 0; ntiles_round < ntiles; ntiles_round++)
+	    if (!next_tile(&tiles[ntiles_round]))
+		break;
+	if (!ntiles_round)
+	    break;
+	run_threads(tile_worker);
+
+	/* merge the tiles in order */
+	for (i = 0; i < ntiles_round; i++) {
+	    tile_t *tl = &tiles[i];
+	    for (j = 0; j < tl->nsols && nsols < MAXSOLS; j++)
+		sols[nsols++] = tl->sols[j];
+	    for (j = 0; j < tl->nout; j++) {
+		int *s = tl->sigs + (size_t) j * nvecs;
+		int idx = lookup(s, tl->hashes[j]);
+		if (idx >= 0) {
+		    if (nodes[idx].size == k &&
+			nodes[idx].depth > tl->out[j].depth)
+			nodes[idx] = tl->out[j];
+		} else if (nnodes < max_nodes) {
+		    insert(&tl->out[j], s, tl->hashes[j]);
+		} else {
+		    complete = 0;
+		}
+	    }
+	}
+    }
+    level_start[k + 1] = nnodes;
+    return complete;
+}
+
+/****************************
+ * Meeting in the middle
+ ****************************/
+
+/* The programs A op B found over the bank, with their size */
+static node_t hits[MAXSOLS];
+static int nhits;
+static pthread_mutex_t hits_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_node(const void *p, const void *q)
+{
+    const node_t *a = p, *b = q;
+
+    if (a->size != b->size)
+	return a->size - b->size;
+    if (a->depth != b->depth)
+	return a->depth - b->depth;
+    if (a->op != b->op)
+	return a->op - b->op;
+    if (a->a != b->a)
+	return a->a < b->a ? -1 : 1;
+    return (a->b > b->b) - (a->b < b->b);
+}
+
+/* add_hit - Keep the smallest programs found, up to MAXSOLS */
+static void add_hit(const node_t *n)
+{
+    pthread_mutex_lock(&hits_lock);
+    if (nhits < MAXSOLS) {
+	hits[nhits++] = *n;
+    } else {
+	/* replace the worst one, if n is better */
+	int i, worst = 0;
+	for (i = 1; i < nhits; i++)
+	    if (cmp_node(&hits[i], &hits[worst]) > 0)
+		worst = i;
+	if (cmp_node(n, &hits[worst]) < 0)
+	    hits[worst] = *n;
+    }
+    pthread_mutex_unlock(&hits_lock);
+}
+
+#define MITM_CHUNK 4096
+
+static void *mitm_worker(void *arg)
+{
+    int need[MAXVECS], i, beg, v, op, j;
+
+    while ((beg = __sync_fetch_and_add(&next_work, 1) * MITM_CHUNK)
+	   < nnodes) {
+	for (i = beg; i < MIN(beg + MITM_CHUNK, nnodes); i++) {
+	    const int *a = sigs + (size_t) i * nvecs;
+	    for (op = OP_XOR; op <= OP_ADD; op++) {
+		node_t n;
+		if (op == OP_OR || !allowed[op])
+		    continue;
+		/* B = T ^ A, or T - A */
+		for (v = 0; v < nvecs; v++)
+		    need[v] = op == OP_XOR ? target[v] ^ a[v]
+			: (int) ((unsigned) target[v] - (unsigned) a[v]);
+		j = lookup(need, hash_sig(need));
+		if (j < 0 || nodes[i].size + nodes[j].size + 1 > max_ops)
+		    continue;
+		n.op = op;
+		n.size = nodes[i].size + nodes[j].size + 1;
+		n.depth = 1 + MAX(nodes[i].depth, nodes[j].depth);
+		n.a = MIN(i, j);
+		n.b = MAX(i, j);
+		add_hit(&n);
+	    }
+	}
+    }
+    return NULL;
+}
+
+/*
+ * meet_in_middle - Find the programs A ^ B, A + B and ~A that match the
+ * target, over a bank complete up to some size. Sort them by size and
+ * latency, into hits.
+ */
+static void meet_in_middle(void)
+{
+    int need[MAXVECS], v, j;
+
+    nhits = 0;
+    if (allowed[OP_INV]) {
+	for (v = 0; v < nvecs; v++)
+	    need[v] = ~target[v];
+	j = lookup(need, hash_sig(need));
+	if (j >= 0 && nodes[j].size + 1 <= max_ops) {
+	    node_t n = { OP_INV, nodes[j].size + 1, nodes[j].depth + 1, j, 0 };
+	    add_hit(&n);
+	}
+    }
+    run_threads(mitm_worker);
+    qsort(hits, nhits, sizeof(node_t), cmp_node);
+}
+
+/*******************
+ * The search
+ *******************/
+
+/* The best program found so far, which survives a restart as text */
+static char best_prog[4096];
+static int best_size, best_depth;
+static char best_how[64];
+
+/*
+ * report - Print the best program, with n if it is better. There is no
+ * program with up to lower ops, so one with lower + 1 is the minimum.
+ */
+static void report(const char *name, const node_t *n, int lower)
+{
+    char buf[sizeof(best_prog)];
+    int a, minimal;
+
+    if (n) {
+	print_prog(n, 1, buf, buf + sizeof(buf));
+	if (!best_size || n->size < best_size ||
+	    (n->size == best_size && n->depth < best_depth)) {
+	    strcpy(best_prog, buf);
+	    best_size = n->size;
+	    best_depth = n->depth;
+	}
+    }
+    if (!n && !best_size) {
+	printf("%s: no program with up to %d ops\n", name, lower);
+	return;
+    }
+    minimal = best_size <= lower + 1;
+    printf("%s: %d ops%s, latency %d, checked %s\n", name, best_size,
+	   minimal ? " (minimum)" : "", best_depth, best_how);
+    if (!minimal)
+	printf("  no program with up to %d ops\n", lower);
+    printf("  int %s(", name);
+    for (a = 0; a < t->args; a++)
+	printf("%sint %s", a ? ", " : "", arg_names[a]);
+    printf(") {\n    return %s;\n  }\n", best_prog);
+}
+
+/*
+ * try_candidates - Verify the candidates in order. Return the first
+ * right one, or NULL. The wrong ones add counterexamples.
+ */
+static const node_t *try_candidates(node_t *c, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	if (verify(&c[i]))
+	    return &c[i];
+    return NULL;
+}
+
+/* search - Search for the best program for puzzle tp */
+static void search(test_ptr tp)
+{
+    char ops[64], *tok;
+    int i, k, complete, lower = -1;
+    double dom;
+
+    t = tp;
+    if (!strcmp(t->ops, "$")) {
+	printf("%s: floating point puzzles are not searched\n", t->name);
+	return;
+    }
+    memset(allowed, 0, sizeof(allowed));
+    strncpy(ops, t->ops, sizeof(ops) - 1);
+    ops[sizeof(ops) - 1] = '\0';
+    for (tok = strtok(ops, " "); tok; tok = strtok(NULL, " "))
+	for (i = OP_NOT; i < NOPS; i++)
+	    if (!strcmp(tok, op_names[i]))
+		allowed[i] = 1;
+    for (i = 0; i < t->args; i++)
+	arg_names[i] = i == 0 ? "x" :
+	    t->arg_ranges[i][0] != INT_MIN || t->arg_ranges[i][1] != INT_MAX
+	    ? "n" : i == 1 ? "y" : "z";
+    max_ops = MIN(max_ops, MIN(t->op_limit, MAXSIZE));
+    dom = domain_size();
+    if (dom <= 4294967296.0)
+	snprintf(best_how, sizeof(best_how), "on all %.0f arguments", dom);
+    else
+	snprintf(best_how, sizeof(best_how), "on %lld arguments", nverify);
+    best_size = best_depth = 0;
+
+    printf("%s: ops \"%s\", up to %d ops, %d constants, %d threads\n",
+	   t->name, t->ops, max_ops, nconsts, nthreads);
+    nvecs = npending = 0;
+    for (i = 0; i < INIT_VECS; i++) {
+	int x[3];
+	get_tuple(mix64(i) % (1ULL << 40), 0, x);
+	if (i < NCORNERS)
+	    for (k = 0; k < t->args; k++)
+		x[k] = corner(k, i);
+	add_vector(x);
+    }
+
+    while (1) {
+	const node_t *found;
+	nvecs += npending;
+	npending = 0;
+	init_bank();
+	start_time = now_sec();
+	complete = 1;
+	found = try_candidates(sols, nsols);
+	if (found) {
+	    report(t->name, found, -1);
+	    free_bank();
+	    return;
+	}
+	for (k = 0; ; k++) {
+	    if (k > 0) {
+		nsols = 0;
+		complete = build_level(k);
+		printf("  %2d ops: %10d programs, %7.2f s%s\n", k,
+		       level_start[k + 1] - level_start[k],
+		       now_sec() - start_time, complete ? "" : " (bank full)");
+		fflush(stdout);
+		/* the shortest latency first */
+		qsort(sols, nsols, sizeof(node_t), cmp_node);
+		if ((found = try_candidates(sols, nsols))) {
+		    report(t->name, found, k - 1);
+		    free_bank();
+		    return;
+		}
+		if (npending)
+		    break;
+	    }
+	    /* a full bank can still hold the halves of a program */
+	    if (complete)
+		lower = k;
+	    meet_in_middle();
+	    for (i = 0; i < nhits; i++)
+		if (!best_size || hits[i].size < best_size ||
+		    (hits[i].size == best_size && hits[i].depth < best_depth))
+		    break;
+	    if ((found = try_candidates(hits + i, nhits - i))) {
+		if (found->size == lower + 1) {
+		    report(t->name, found, lower);
+		    free_bank();
+		    return;
+		}
+		/* keep it in case the search stops before its size */
+		print_prog(found, 1, best_prog, best_prog + sizeof(best_prog));
+		best_size = found->size;
+		best_depth = found->depth;
+	    }
+	    if (npending && !found)
+		break;
+	    npending = 0;
+	    if (!complete || k + 1 > max_ops ||
+		(best_size && best_size <= k + 1))
+		break;
+	}
+	if (!npending)
+	    break;
+	printf("  wrong candidate, restarting with %d test vectors\n",
+	       nvecs + npending);
+	free_bank();
+    }
+    report(t->name, NULL, lower);
+    free_bank();
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-f <name>] [-n <max ops>] [-c <constants>] [-m <MB>] [-j <threads>] [-v <vectors>]\n", cmd);
+    printf("  -f <name>  Search only for the named puzzle\n");
+    printf("  -n <n>     Search programs of up to n operators (default: op limit)\n");
+    printf("  -c <list>  Comma separated constants (default: 1,2,3,4,8,16,24,31,0xf,0x33,0x55,0xff)\n");
+    printf("  -m <MB>    Memory for the programs (default: 1024)\n");
+    printf("  -j <n>     Search with n threads (default: one per CPU)\n");
+    printf("  -v <n>     Check candidates on n arguments when there are more than 2^32\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char *name = NULL, *tok;
+    int c, i, found = 0;
+
+    while ((c = getopt(argc, argv, "hf:n:c:m:j:v:")) != -1) {
+	switch (c) {
+	case 'f':
+	    name = optarg;
+	    break;
+	case 'n':
+	    max_ops = atoi(optarg);
+	    break;
+	case 'c':
+	    nconsts = 0;
+	    for (tok = strtok(optarg, ", "); tok && nconsts < MAXCONSTS;
+		 tok = strtok(NULL, ", "))
+		consts[nconsts++] = (int) strtol(tok, NULL, 0);
+	    break;
+	case 'm':
+	    mem_mb = strtoul(optarg, NULL, 0);
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'v':
+	    nverify = strtoll(optarg, NULL, 0);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (max_ops < 1 || mem_mb < 1 || nverify < 1)
+	usage(argv[0]);
+    if (nthreads <= 0)
+	nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1, MIN(nthreads, MAXTHREADS));
+
+    for (i = 0; test_set[i].solution_funct; i++) {
+	int save = max_ops;
+	if (name && strcmp(test_set[i].name, name) != 0)
+	    continue;
+	search(&test_set[i]);
+	max_ops = save;
+	found = 1;
+    }
+    if (!found) {
+	fprintf(stderr, "bsuper: no puzzle named %s\n", name);
+	exit(1);
+    }
+    return 0;
+}
@@ -21,6 +21,13 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <math.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "btest.h"
 
 /* Not declared in some stdlib.h files, so define here */
@@ -41,11 +48,42 @@ float strtof(const char *nptr, char **endptr);
    explosion */
 #define TEST_RANGE 500000
 
-/* This defines the maximum size of any test value array. The
-   gen_vals() routine creates k test values for each value of
-   TEST_RANGE, thus MAX_TEST_VALS must be at least k*TEST_RANGE */
+/* Integer arguments with at most this many values are tested on all
+   of them */
 #define MAX_TEST_VALS 13*TEST_RANGE
 
+/* Test values are generated a tile of this many values at a time, as
+   the tests need them, so memory does not grow with TEST_RANGE */
+#define TILE_VALS 1024
+
+/* The second and third args have O(TEST_RANGE^1/2) and O(TEST_RANGE^1/3)
+   values, and are walked once per value of the args before them. Their
+   tiles hold this many values, so up to 100x TEST_RANGE they are
+   generated whole, once per range, and only the first arg is streamed */
+#define INNER_VALS (1 << 16)
+
+/* With several workers, a function with at least this many tests is
+   split into shards, one per worker, by the values of its first
+   argument */
+#define SHARD_TESTS (1 << 20)
+
+/* In exhaustive mode, the arguments a single-argument function is
+   called with at a time, before the results are compared */
+#define BATCH_SIZE (1 << 16)
+
+/* Is the float with bit representation u a NaN? */
+#define IS_NAN(u) (((u) & 0x7fffffff) > 0x7f800000)
+
+/* Benchmark mode times passes over BENCH_VALS random arguments, until
+   the BENCH_K fastest passes are within BENCH_EPSILON of each other
+   (the K-best scheme), or after BENCH_MAX_PASSES */
+#define BENCH_VALS (1 << 14)
+#define BENCH_K 3
+#define BENCH_EPSILON 0.01
+#define BENCH_MAX_PASSES 200
+#define MAXLINE_OPS 256    /* max line length of the dlc -e output */
+#define MAXFUNCS_OPS 64    /* max number of functions in test_set */
+
 /**********************************
  * Globals defined in other modules 
  **********************************/
@@ -74,6 +112,19 @@ static unsigned argval[3] = {0,0,0};
 /* Use fixed weight for rating, and if so, what should it  be? (-r) */
 static int global_rating = 0;
 
+/* Number of worker processes that run the tests (-j) */
+static int workers = 1;
+
+/* Test single-argument functions on all of their arguments (-x) */
+static int exhaustive = 0;
+
+/* Time the functions instead of testing them (-b) */
+static int bench = 0;
+
+/* If non-NULL, read the operator counts of the solutions from this
+   output of dlc -e (-o) */
+static char *opcount_fname = NULL;
+
 /******************
  * Helper functions
  ******************/
@@ -114,31 +165,96 @@ static int random_val(int min, int max)
     return result;
 }
 
+/*
+ * The test values of an argument are a sequence of steps, each of a few
+ * values, that is computed from the index of the step: around the
+ * boundaries, around zero and a random value for an integer argument,
+ * around the boundaries of the exponents for a floating point one. The
+ * random values are a hash of their index rather than rand(), so that
+ * any part of the sequence can be generated on its own, by the worker
+ * that tests it and while it tests it.
+ */
+#define SEQ_FIXED  0   /* the value given with -1, -2 or -3 */
+#define SEQ_FLOAT  1   /* bit representations of floats */
+#define SEQ_ALL    2   /* every value of a small range */
+#define SEQ_SAMPLE 3   /* samples of a large range */
+#define STEP_MAX   12  /* max values in a step */
+
+typedef struct {
+    int kind;
+    int min, max;
+    long long range;     /* steps away from the boundaries */
+    long long steps;     /* number of steps */
+    long long count;     /* number of values */
+    unsigned seed;       /* of the random values */
+    /* SEQ_SAMPLE: the steps i that also test i, and -i */
+    long long pos_lo, pos_hi, neg_lo, neg_hi;
+} argseq_t;
+
+static unsigned long long mix64(unsigned long long z)
+{
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static long long clamp(long long x, long long lo, long long hi)
+{
+    return x < lo ? lo : x > hi ? hi : x;
+}
+
 /* 
- * gen_vals - Generate the integer values we'll use to test a function 
+ * seq_random - Random integer value between min and max for step i
  */
-static int gen_vals(int test_vals[], int min, int max, int test_range, int arg)
+static int seq_random(argseq_t *sq, long long i)
 {
-    int i;
-    int test_count = 0;
+    unsigned long long z = mix64(((unsigned long long) sq->seed << 40) + i);
+    double weight = (z & RAND_MAX) / (double) RAND_MAX;
+    int result = sq->min * (1-weight) + sq->max * weight;
+    return result;
+}
 
-    /* Special case: If the user has specified a specific function
-       argument using the -1, -2, or -3 flags, then simply use this
-       argument and return */
-    if (has_arg[arg]) {
-	test_vals[0] = argval[arg];
-	return 1;
+/*
+ * seq_before - The number of values before step i
+ */
+static long long seq_before(argseq_t *sq, long long i)
+{
+    switch (sq->kind) {
+    case SEQ_FLOAT:
+	return i <= sq->range ? 12 * i : 12 * sq->range + 4;
+    case SEQ_SAMPLE:
+	return 3 * i + clamp(i, sq->pos_lo, sq->pos_hi) - sq->pos_lo
+	    + clamp(i, sq->neg_lo, sq->neg_hi) - sq->neg_lo;
+    default:
+	return i;
     }
+}
 
-    /* 
-     * Special case: Generate test vals for floating point functions
-     * where the input argument is an unsigned bit-level
-     * representation of a float. For this case we want to test the
-     * regions around zero, the smallest normalized and largest
-     * denormalized numbers, one, and the largest normalized number,
-     * as well as inf and nan.
-     */
-    if ((min == 1 && max == 1)) { 
+/*
+ * seq_step - Put the values of step i in vals, return their number
+ */
+static int seq_step(argseq_t *sq, long long i, int vals[])
+{
+    int n = 0;
+
+    switch (sq->kind) {
+    case SEQ_FIXED:
+	vals[n++] = sq->min;
+	break;
+
+    case SEQ_ALL:
+	vals[n++] = sq->min + i;
+	break;
+
+    case SEQ_FLOAT: {
+	/* 
+	 * For floating point functions, where the input argument is an
+	 * unsigned bit-level representation of a float, test the
+	 * regions around zero, the smallest normalized and largest
+	 * denormalized numbers, one, and the largest normalized number,
+	 * as well as inf and nan.
+	 */
 	unsigned smallest_norm = 0x00800000;
 	unsigned one = 0x3f800000;
 	unsigned largest_norm = 0x7f000000;
@@ -147,79 +263,128 @@ static int gen_vals(int test_vals[], int min, int max, int test_range, int arg)
 	unsigned nan =  0x7fc00000;
 	unsigned sign = 0x80000000;
 
-	/* Test range should be at most 1/2 the range of one exponent
-	   value */
-	if (test_range > (1 << 23)) {
-	    test_range = 1 << 23;
+	if (i == sq->range) {
+	    /* special vals */
+	    vals[n++] = inf;        /* inf */
+	    vals[n++] = sign | inf; /* -inf */
+	    vals[n++] = nan;        /* nan */
+	    vals[n++] = sign | nan; /* -nan */
+	    break;
 	}
-	
-	/* Functions where the input argument is an unsigned bit-level
-	   representation of a float. The number of tests generated
-	   inside this loop body is the value k referenced in the
-	   comment for the global variable MAX_TEST_VALS. */
-
-	for (i = 0; i < test_range; i++) {
-	    /* Denorms around zero */
-	    test_vals[test_count++] = i; 
-	    test_vals[test_count++] = sign | i;
+
+	/* Denorms around zero */
+	vals[n++] = i; 
+	vals[n++] = sign | i;
 	    
-	    /* Region around norm to denorm transition */
-	    test_vals[test_count++] = smallest_norm + i;
-	    test_vals[test_count++] = smallest_norm - i;
-	    test_vals[test_count++] = sign | (smallest_norm + i);
-	    test_vals[test_count++] = sign | (smallest_norm - i);
+	/* Region around norm to denorm transition */
+	vals[n++] = smallest_norm + i;
+	vals[n++] = smallest_norm - i;
+	vals[n++] = sign | (smallest_norm + i);
+	vals[n++] = sign | (smallest_norm - i);
 	    
-	    /* Region around one */
-	    test_vals[test_count++] = one + i;
-	    test_vals[test_count++] = one - i;
-	    test_vals[test_count++] = sign | (one + i);
-	    test_vals[test_count++] = sign | (one - i);
+	/* Region around one */
+	vals[n++] = one + i;
+	vals[n++] = one - i;
+	vals[n++] = sign | (one + i);
+	vals[n++] = sign | (one - i);
 	    
-	    /* Region below largest norm */
-	    test_vals[test_count++] = largest_norm - i; 
-	    test_vals[test_count++] = sign | (largest_norm - i); 
-	}
-	
-	/* special vals */
-	test_vals[test_count++] = inf;        /* inf */
-	test_vals[test_count++] = sign | inf; /* -inf */
-	test_vals[test_count++] = nan;        /* nan */
-	test_vals[test_count++] = sign | nan; /* -nan */
+	/* Region below largest norm */
+	vals[n++] = largest_norm - i; 
+	vals[n++] = sign | (largest_norm - i); 
+	break;
+    }
+
+    case SEQ_SAMPLE:
+	/* Test around the boundaries */
+	vals[n++] = sq->min + i;
+	vals[n++] = sq->max - i;
+
+	/* If zero falls between min and max, then also test around zero */
+	if (i >= sq->pos_lo && i < sq->pos_hi)
+	    vals[n++] = i;
+	if (i >= sq->neg_lo && i < sq->neg_hi)
+	    vals[n++] = -i;
 
-	return test_count;
+	/* Random case between min and max */
+	vals[n++] = seq_random(sq, i);
+	break;
     }
+    return n;
+}
 
+/* 
+ * init_seq - Set up the sequence of the integer values we'll use to
+ * test argument arg of a function
+ */
+static void init_seq(argseq_t *sq, int min, int max, int test_range,
+		     int arg, unsigned seed)
+{
+    sq->min = min;
+    sq->max = max;
+    sq->range = test_range;
+    sq->seed = seed;
 
-    /*
-     * Normal case: Generate test vals for integer functions
-     */
+    /* Special case: If the user has specified a specific function
+       argument using the -1, -2, or -3 flags, then simply use this
+       argument */
+    if (has_arg[arg]) {
+	sq->kind = SEQ_FIXED;
+	sq->min = argval[arg];
+	sq->steps = 1;
+    }
+
+    /* Floating point functions. Test range should be at most 1/2 the
+       range of one exponent value */
+    else if (min == 1 && max == 1) { 
+	sq->kind = SEQ_FLOAT;
+	if (sq->range > (1 << 23))
+	    sq->range = 1 << 23;
+	sq->steps = sq->range + 1;
+    }
 
     /* If the range is small enough, then do exhaustively */
-    if (max - MAX_TEST_VALS <= min) {
-	for (i = min; i <= max; i++)
-	    test_vals[test_count++] = i;
-	return test_count;
+    else if (max - MAX_TEST_VALS <= min) {
+	sq->kind = SEQ_ALL;
+	sq->steps = (long long) max - min + 1;
     }
 
     /* Otherwise, need to sample.  Do so near the boundaries, around
        zero, and for some random cases. */
-    for (i = 0; i < test_range; i++) {
-
-	/* Test around the boundaries */
-	test_vals[test_count++] = min + i;
-	test_vals[test_count++] = max - i;
-
-	/* If zero falls between min and max, then also test around zero */
-	if (i >= min && i <= max)
-	    test_vals[test_count++] = i;
-	if (-i >= min && -i <= max)
-	    test_vals[test_count++] = -i;
-
-	/* Random case between min and max */
-	test_vals[test_count++] = random_val(min, max);
+    else {
+	sq->kind = SEQ_SAMPLE;
+	sq->steps = sq->range;
+	sq->pos_lo = clamp(min, 0, sq->range);
+	sq->pos_hi = clamp((long long) max + 1, sq->pos_lo, sq->range);
+	sq->neg_lo = clamp(-(long long) max, 0, sq->range);
+	sq->neg_hi = clamp(1 - (long long) min, sq->neg_lo, sq->range);
+    }
+    sq->count = seq_before(sq, sq->steps);
+}
 
+/*
+ * seq_fill - Put the n values of sq from index k on in vals
+ */
+static void seq_fill(argseq_t *sq, long long k, int vals[], int n)
+{
+    long long lo = 0, hi = sq->steps;
+    int step[STEP_MAX];
+    int off, c;
+
+    /* the step that has value k */
+    while (hi - lo > 1) {
+	long long mid = lo + (hi - lo) / 2;
+	if (seq_before(sq, mid) <= k)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    off = k - seq_before(sq, lo);
+    while (n > 0) {
+	c = seq_step(sq, lo++, step);
+	for (; off < c && n > 0; off++, n--)
+	    *vals++ = step[off];
+	off = 0;
     }
-    return test_count;
 }
 
 /* 
@@ -290,20 +455,26 @@ static int test_3_arg(funct_t f, funct_t ft,
     return error;
 }
 
+/* The tiles of test values of each arg being tested, the first arg's
+   and those of the second and third args. Declared with the static
+   attribute so that the arrays will be allocated in bss rather than the
+   stack */
+static int tile_vals[TILE_VALS];
+static int inner_vals[2][INNER_VALS];
+static long long tile_start[3];
+static int tile_len[3];
+
 /* 
- * test_function - Test a function.  Return number of errors 
+ * init_seqs - Set up the sequence of test values for each argument of
+ * a function (one value for the arguments it does not take). Return
+ * the number of tests.
  */
-static int test_function(test_ptr t) {
-    int test_counts[3];    /* number of test values for each arg */
+static double init_seqs(test_ptr t, argseq_t seqs[])
+{
     int args = t->args;    /* number of function arguments */
     int arg_test_range[3]; /* test range for each argument */
-    int i, a1, a2, a3;        
-    int errors = 0;
-
-    /* These are the test values for each arg. Declared with the
-       static attribute so that the array will be allocated in bss
-       rather than the stack */
-    static int arg_test_vals[3][MAX_TEST_VALS]; 
+    double tests = 1;
+    int i;
 
     /* Sanity check on the number of args */
     if (args < 0 || args > 3) {
@@ -334,15 +505,52 @@ static int test_function(test_ptr t) {
     if (arg_test_range[2] < 1) 
 	arg_test_range[2] = 1;
 
-    /* Create a test set for each argument */
-    for (i = 0; i < args; i++) {
-	test_counts[i] =  gen_vals(arg_test_vals[i], 
-				   t->arg_ranges[i][0], /* min */
-				   t->arg_ranges[i][1], /* max */
-				   arg_test_range[i],   
-				   i);
+    /* Set up a test sequence for each argument */
+    for (i = 0; i < 3; i++) {
+	seqs[i].count = 1;
+	if (i < args)
+	    init_seq(&seqs[i],
+		     t->arg_ranges[i][0], /* min */
+		     t->arg_ranges[i][1], /* max */
+		     arg_test_range[i],
+		     i,
+		     (t - test_set) * 3 + i + 1);
+	tests *= seqs[i].count;
+    }
+    return tests;
+}
+
+/*
+ * get_tile - The tile of test values of the second or third arg from
+ * index k on. It is generated again only when it is not the last one
+ * generated, so an arg with at most INNER_VALS values is generated once
+ * per range.
+ */
+static int *get_tile(argseq_t *sq, int arg, long long k)
+{
+    int n = sq->count - k < INNER_VALS ? sq->count - k : INNER_VALS;
 
+    if (tile_start[arg] != k || tile_len[arg] != n) {
+	seq_fill(sq, k, inner_vals[arg - 1], n);
+	tile_start[arg] = k;
+	tile_len[arg] = n;
     }
+    return inner_vals[arg - 1];
+}
+
+/* 
+ * test_vals_range - Test a function on the values lo to hi-1 of its
+ * first argument, and all the values of the others, in the order of
+ * the sequences. Return number of errors
+ */
+static int test_vals_range(test_ptr t, argseq_t seqs[], 
+			   long long lo, long long hi)
+{
+    int args = t->args;    /* number of function arguments */
+    long long k1, k2, k3;
+    int a1, a2, a3, n1;
+    int *v1, *v2, *v3;
+    int errors = 0;
 
     /* Handle timeouts in the test code */
     if (timeout_limit > 0) {
@@ -367,47 +575,59 @@ static int test_function(test_ptr t) {
     /* 
      * Test function has at least one argument 
      */
+    tile_start[0] = tile_start[1] = tile_start[2] = -1;
       
-    /* Iterate over the values for first argument */
-
-    for (a1 = 0; a1 < test_counts[0]; a1++) {
-	if (args == 1) {
-	    errors += test_1_arg(t->solution_funct, 
-				 t->test_funct,
-				 arg_test_vals[0][a1],
-				 t->name);
-
-	    /* Stop testing if there is an error */
-	    if (errors)
-		return errors;
-	} 
-	else {
+    /* Iterate over the values for first argument, a tile at a time */
+    for (k1 = lo; k1 < hi; k1 += TILE_VALS) {
+	n1 = hi - k1 < TILE_VALS ? hi - k1 : TILE_VALS;
+	v1 = tile_vals;
+	seq_fill(&seqs[0], k1, v1, n1);
+
+	for (a1 = 0; a1 < n1; a1++) {
+	    if (args == 1) {
+		errors += test_1_arg(t->solution_funct, 
+				     t->test_funct,
+				     v1[a1],
+				     t->name);
+
+		/* Stop testing if there is an error */
+		if (errors)
+		    return errors;
+		continue;
+	    } 
+
 	    /* if necessary, iterate over values for second argument */
-	    for (a2 = 0; a2 < test_counts[1]; a2++) {
-		if (args == 2) {
-		    errors += test_2_arg(t->solution_funct, 
-					 t->test_funct,
-					 arg_test_vals[0][a1], 
-					 arg_test_vals[1][a2],
-					 t->name);
-
-		    /* Stop testing if there is an error */
-		    if (errors)
-			return errors;
-		} 
-		else {
-		    /* if necessary, iterate over vals for third arg */
-		    for (a3 = 0; a3 < test_counts[2]; a3++) {
-			errors += test_3_arg(t->solution_funct, 
+	    for (k2 = 0; k2 < seqs[1].count; k2 += INNER_VALS) {
+		v2 = get_tile(&seqs[1], 1, k2);
+		for (a2 = 0; a2 < tile_len[1]; a2++) {
+		    if (args == 2) {
+			errors += test_2_arg(t->solution_funct, 
 					     t->test_funct,
-					     arg_test_vals[0][a1], 
-					     arg_test_vals[1][a2],
-					     arg_test_vals[2][a3],
+					     v1[a1], 
+					     v2[a2],
 					     t->name);
-			
+
 			/* Stop testing if there is an error */
 			if (errors)
 			    return errors;
+			continue;
+		    } 
+
+		    /* if necessary, iterate over vals for third arg */
+		    for (k3 = 0; k3 < seqs[2].count; k3 += INNER_VALS) {
+			v3 = get_tile(&seqs[2], 2, k3);
+			for (a3 = 0; a3 < tile_len[2]; a3++) {
+			    errors += test_3_arg(t->solution_funct, 
+						 t->test_funct,
+						 v1[a1], 
+						 v2[a2],
+						 v3[a3],
+						 t->name);
+			
+			    /* Stop testing if there is an error */
+			    if (errors)
+				return errors;
+			}
 		    } /* a3 */
 		}
 	    } /* a2 */
@@ -418,6 +638,308 @@ static int test_function(test_ptr t) {
     return errors;
 }
 
+/*
+ * is_exhaustive - Is function t tested on all of its arguments?
+ */
+static int is_exhaustive(test_ptr t)
+{
+    return exhaustive && t->args == 1 && !has_arg[0];
+}
+
+/*
+ * all_args_range - The arguments [lo, hi) of a single-argument function
+ * for exhaustive mode: its whole range, or every bit representation
+ * for a floating point puzzle
+ */
+static void all_args_range(test_ptr t, long long *lo, long long *hi)
+{
+    if (t->arg_ranges[0][0] == 1 && t->arg_ranges[0][1] == 1) {
+	*lo = 0;
+	*hi = 1LL << 32;
+    }
+    else {
+	*lo = t->arg_ranges[0][0];
+	*hi = (long long) t->arg_ranges[0][1] + 1;
+    }
+}
+
+/*
+ * test_all_range - Test a single-argument function on every argument
+ * from lo to hi-1, BATCH_SIZE arguments at a time: the function and
+ * the reference are each run over the whole batch, and the results are
+ * compared in one branch free pass that the compiler can vectorize.
+ * Floating point results that are both NaN compare equal. The timeout
+ * applies to each batch. Return number of errors
+ */
+static int test_all_range(test_ptr t, long long lo, long long hi)
+{
+    static unsigned r[BATCH_SIZE], rt[BATCH_SIZE];
+    funct1_t f1 = (funct1_t) t->solution_funct;
+    funct1_t f1t = (funct1_t) t->test_funct;
+    int nan_aware = strcmp(t->ops, "$") == 0;
+    long long base;
+    int k, n;
+
+    /* Handle timeouts in the test code */
+    if (timeout_limit > 0 && sigsetjmp(envbuf, 1)) {
+	printf("ERROR: Test %s failed.\n  Timed out after %d secs (probably infinite loop)\n", t->name, timeout_limit);
+	return 1;
+    }
+
+    for (base = lo; base < hi; base += n) {
+	unsigned bad = 0;
+
+	n = hi - base < BATCH_SIZE ? hi - base : BATCH_SIZE;
+	if (timeout_limit > 0)
+	    alarm(timeout_limit);
+	for (k = 0; k < n; k++)
+	    r[k] = f1((int) (unsigned) (base + k));
+	for (k = 0; k < n; k++)
+	    rt[k] = f1t((int) (unsigned) (base + k));
+
+	if (nan_aware) {
+	    for (k = 0; k < n; k++)
+		bad |= (r[k] != rt[k]) & !(IS_NAN(r[k]) & IS_NAN(rt[k]));
+	}
+	else {
+	    for (k = 0; k < n; k++)
+		bad |= r[k] ^ rt[k];
+	}
+	if (!bad)
+	    continue;
+
+	/* report the first argument of the batch that fails */
+	for (k = 0; r[k] == rt[k] || (nan_aware && IS_NAN(r[k]) && IS_NAN(rt[k])); k++)
+	    ;
+	return test_1_arg(t->solution_funct, t->test_funct,
+			  (int) (unsigned) (base + k), t->name);
+    }
+    return 0;
+}
+
+/* 
+ * test_function - Test a function.  Return number of errors 
+ */
+static int test_function(test_ptr t) {
+    argseq_t seqs[3];      /* test values for each arg */
+    long long lo, hi;
+
+    if (is_exhaustive(t)) {
+	all_args_range(t, &lo, &hi);
+	return test_all_range(t, lo, hi);
+    }
+    init_seqs(t, seqs);
+    return test_vals_range(t, seqs, 0, seqs[0].count);
+}
+
+/*
+ * A shard tests a function on a range of values of its first argument,
+ * in a worker process whose output goes to a temporary file. The
+ * results are reported in the order of test_set, and for each function
+ * only the output of its first failing shard is kept. Each worker
+ * generates the test values of its range as it tests them. They only
+ * depend on their index, so they, and the counterexamples, are the same
+ * as with a single worker.
+ */
+typedef struct {
+    int func;              /* index in test_set */
+    pid_t pid;             /* worker, 0 once it is reaped */
+    FILE *out;             /* what the worker printed */
+    int errors;
+    int killed;            /* a shard before it failed, its result is moot */
+} shard_t;
+
+typedef struct {
+    int first_shard;       /* index of its first shard */
+    int nshards;
+    int done;              /* shards that are reaped */
+} func_result_t;
+
+static shard_t *shards;
+static int nshards = 0;
+static func_result_t *func_results;
+static int next_report = 0;  /* next function of test_set to report */
+
+/* 
+ * score_function - Add up the score of test_set[i] and print its line
+ */
+static void score_function(int i, int terrors, int *errors, 
+			   double *points, double *max_points)
+{
+    int rating = global_rating ? global_rating : test_set[i].rating;
+    double tscore = terrors == 0 ? 1.0 : 0.0;
+    double tpoints = rating * tscore;
+
+    *errors += terrors;
+    *points += tpoints;
+    *max_points += rating;
+    if (grade || terrors < 1)
+	printf(" %.0f\t%d\t%d\t%s\n", 
+	       tpoints, rating, terrors, test_set[i].name);
+}
+
+/*
+ * start_shard - Test function i on values lo to hi-1 of its first
+ * argument in a new worker. In exhaustive mode they are the arguments
+ * themselves, else indexes of the generated test values.
+ */
+static void start_shard(int i, argseq_t seqs[], long long lo, long long hi)
+{
+    shard_t *sh = &shards[nshards++];
+
+    sh->func = i;
+    sh->errors = 0;
+    sh->killed = 0;
+    if (!(sh->out = tmpfile())) {
+	perror("tmpfile");
+	exit(1);
+    }
+    fflush(stdout);
+    if ((sh->pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (sh->pid == 0) {
+	dup2(fileno(sh->out), STDOUT_FILENO);
+	if (is_exhaustive(&test_set[i]))
+	    exit(test_all_range(&test_set[i], lo, hi) ? 1 : 0);
+	exit(test_vals_range(&test_set[i], seqs, lo, hi) ? 1 : 0);
+    }
+    func_results[i].nshards++;
+}
+
+/*
+ * report_results - Print the results of the functions that are done, as
+ * far as all the functions before them are
+ */
+static void report_results(int *errors, double *points, double *max_points)
+{
+    char buf[BUFSIZ];
+    size_t n;
+
+    for (; test_set[next_report].solution_funct; next_report++) {
+	func_result_t *fr = &func_results[next_report];
+	int j, terrors = 0;
+	if (fr->done < fr->nshards)
+	    return;
+	for (j = fr->first_shard; j < fr->first_shard + fr->nshards; j++) {
+	    shard_t *sh = &shards[j];
+	    if (!terrors && sh->errors) {
+		terrors = sh->errors;
+		rewind(sh->out);
+		while ((n = fread(buf, 1, sizeof(buf), sh->out)) > 0)
+		    fwrite(buf, 1, n, stdout);
+	    }
+	    fclose(sh->out);
+	}
+	if (fr->nshards)
+	    score_function(next_report, terrors, errors, points, max_points);
+    }
+}
+
+/*
+ * reap_shard - Wait for a worker to finish and record its result. Once a
+ * shard fails, the later shards of its function cannot change the
+ * result and are killed.
+ */
+static void reap_shard(void)
+{
+    int status, j;
+    pid_t pid;
+
+    while ((pid = wait(&status)) < 0) {
+	if (errno != EINTR) {
+	    perror("wait");
+	    exit(1);
+	}
+    }
+    for (j = 0; j < nshards && shards[j].pid != pid; j++)
+	;
+    if (j == nshards)
+	return;
+    shard_t *sh = &shards[j];
+    sh->pid = 0;
+    func_results[sh->func].done++;
+    if (sh->killed)
+	return;
+
+    if (WIFEXITED(status)) {
+	sh->errors = WEXITSTATUS(status) != 0;
+    } else {
+	/* the solution crashed the worker */
+	sh->errors = 1;
+	fseek(sh->out, 0, SEEK_END);
+	fprintf(sh->out, "ERROR: Test %s failed.\n  Crashed with signal %d\n",
+		test_set[sh->func].name, WTERMSIG(status));
+	fflush(sh->out);
+    }
+    if (sh->errors) {
+	for (j++; j < nshards && shards[j].func == sh->func; j++) {
+	    if (shards[j].pid) {
+		kill(shards[j].pid, SIGKILL);
+		shards[j].killed = 1;
+	    }
+	}
+    }
+}
+
+/*
+ * run_workers - Run the tests of the selected functions in up to
+ * workers processes at once
+ */
+static void run_workers(int *errors, double *points, double *max_points)
+{
+    int nfuncs, i, running = 0;
+
+    for (nfuncs = 0; test_set[nfuncs].solution_funct; nfuncs++)
+	;
+    shards = calloc(nfuncs * workers, sizeof(shard_t));
+    func_results = calloc(nfuncs + 1, sizeof(func_result_t));
+
+    for (i = 0; i < nfuncs; i++) {
+	argseq_t seqs[3];
+	int k, nshard;
+	long long lo = 0, hi;
+
+	func_results[i].first_shard = nshards;
+	if (test_fname && strcmp(test_set[i].name, test_fname) != 0)
+	    continue;
+
+	/* split only functions with many tests, and never more than
+	   there are values of the first argument */
+	if (is_exhaustive(&test_set[i])) {
+	    all_args_range(&test_set[i], &lo, &hi);
+	    nshard = workers;
+	}
+	else {
+	    double tests = init_seqs(&test_set[i], seqs);
+	    nshard = tests >= SHARD_TESTS ? workers : 1;
+	    hi = seqs[0].count;
+	}
+	if (nshard > hi - lo)
+	    nshard = hi - lo;
+	for (k = 0; k < nshard; k++) {
+	    while (running == workers) {
+		reap_shard();
+		running--;
+		report_results(errors, points, max_points);
+	    }
+	    start_shard(i, seqs,
+			lo + (hi - lo) * k / nshard,
+			lo + (hi - lo) * (k + 1) / nshard);
+	    running++;
+	}
+    }
+    while (running) {
+	reap_shard();
+	running--;
+	report_results(errors, points, max_points);
+    }
+    report_results(errors, points, max_points);
+    free(shards);
+    free(func_results);
+}
+
 /* 
  * run_tests - Run series of tests.  Return number of errors 
  */ 
@@ -430,23 +952,14 @@ static int run_tests()
 
     printf("Score\tRating\tErrors\tFunction\n");
 
-    for (i = 0; test_set[i].solution_funct; i++) {
-	int terrors;
-	double tscore;
-	double tpoints;
-	if (!test_fname || strcmp(test_set[i].name,test_fname) == 0) {
-	    int rating = global_rating ? global_rating : test_set[i].rating;
-	    terrors = test_function(&test_set[i]);
-	    errors += terrors;
-	    tscore = terrors == 0 ? 1.0 : 0.0;
-	    tpoints = rating * tscore;
-	    points += tpoints;
-	    max_points += rating;
-
-	    if (grade || terrors < 1)
-		printf(" %.0f\t%d\t%d\t%s\n", 
-		       tpoints, rating, terrors, test_set[i].name);
-
+    if (workers > 1) {
+	run_workers(&errors, &points, &max_points);
+    }
+    else {
+	for (i = 0; test_set[i].solution_funct; i++) {
+	    if (!test_fname || strcmp(test_set[i].name,test_fname) == 0)
+		score_function(i, test_function(&test_set[i]),
+			       &errors, &points, &max_points);
 	}
     }
 
@@ -454,6 +967,201 @@ static int run_tests()
     return errors;
 }
 
+/*
+ * read_tsc - The time stamp counter, or ns where there is none. The TSC
+ * ticks at a fixed rate, the nominal frequency of the CPU, whatever
+ * the frequency the core runs at.
+ */
+static unsigned long long read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The arguments of the timed passes */
+static int bench_vals[3][BENCH_VALS];
+
+/* Results are added up here, so that the calls are not optimized out */
+static volatile int bench_sink;
+
+/* Through a volatile pointer, the baseline is called like a solution */
+static int bench_nop(int x, int y, int z) { return x; }
+static funct3_t volatile bench_nop_ptr = bench_nop;
+
+/*
+ * bench_pass - Call f with args arguments on each of the bench_vals.
+ * Return the ticks taken, and the seconds in *secs.
+ */
+static unsigned long long bench_pass(funct_t f, int args, double *secs)
+{
+    unsigned long long beg;
+    double beg_sec = now_sec();
+    int i, sum = 0;
+
+    beg = read_tsc();
+    switch (args) {
+    case 0:
+	for (i = 0; i < BENCH_VALS; i++)
+	    sum += f();
+	break;
+    case 1:
+	for (i = 0; i < BENCH_VALS; i++)
+	    sum += ((funct1_t) f)(bench_vals[0][i]);
+	break;
+    case 2:
+	for (i = 0; i < BENCH_VALS; i++)
+	    sum += ((funct2_t) f)(bench_vals[0][i], bench_vals[1][i]);
+	break;
+    default:
+	for (i = 0; i < BENCH_VALS; i++)
+	    sum += ((funct3_t) f)(bench_vals[0][i], bench_vals[1][i],
+				  bench_vals[2][i]);
+	break;
+    }
+    beg = read_tsc() - beg;
+    *secs = now_sec() - beg_sec;
+    bench_sink = sum;
+    return beg;
+}
+
+/*
+ * bench_function - Time f with the K-best scheme, after a warmup pass.
+ * Return the ticks per call of the fastest pass, and its calls per
+ * second in *rate.
+ */
+static double bench_function(funct_t f, int args, double *rate)
+{
+    unsigned long long fastest[BENCH_K];
+    double fastest_secs = 0, secs;
+    int passes, k, j;
+
+    bench_pass(f, args, &secs);
+    for (passes = 0; passes < BENCH_MAX_PASSES; passes++) {
+	unsigned long long ticks = bench_pass(f, args, &secs);
+	k = passes < BENCH_K ? passes : BENCH_K;
+	/* keep the K fastest, in order */
+	if (k == BENCH_K && ticks >= fastest[BENCH_K - 1])
+	    continue;
+	if (k == BENCH_K)
+	    k--;
+	for (j = k; j > 0 && fastest[j - 1] > ticks; j--)
+	    fastest[j] = fastest[j - 1];
+	fastest[j] = ticks;
+	if (j == 0)
+	    fastest_secs = secs;
+	if (passes + 1 >= BENCH_K &&
+	    fastest[BENCH_K - 1] <= (1 + BENCH_EPSILON) * fastest[0])
+	    break;
+    }
+    *rate = BENCH_VALS / fastest_secs;
+    return (double) fastest[0] / BENCH_VALS;
+}
+
+/*
+ * gen_bench_vals - Random arguments in the range of each argument of a
+ * function, any bit representation for floating point puzzles
+ */
+static void gen_bench_vals(test_ptr t)
+{
+    int a, i;
+
+    for (a = 0; a < t->args; a++) {
+	int min = t->arg_ranges[a][0], max = t->arg_ranges[a][1];
+	for (i = 0; i < BENCH_VALS; i++) {
+	    if (has_arg[a])
+		bench_vals[a][i] = argval[a];
+	    else if (min == 1 && max == 1)
+		bench_vals[a][i] = ((unsigned) rand() << 16) ^ rand();
+	    else
+		bench_vals[a][i] = random_val(min, max);
+	}
+    }
+}
+
+/*
+ * read_opcounts - Read the operator count of each function from the
+ * output of dlc -e, lines like "dlc:bits.c:143:bitAnd: 4 operators".
+ * Functions it does not list get -1.
+ */
+static void read_opcounts(int opcounts[])
+{
+    char line[MAXLINE_OPS], name[MAXLINE_OPS];
+    int i, ops;
+    FILE *in;
+
+    for (i = 0; test_set[i].solution_funct; i++)
+	opcounts[i] = -1;
+    if (!opcount_fname)
+	return;
+    if (!(in = fopen(opcount_fname, "r"))) {
+	perror(opcount_fname);
+	exit(1);
+    }
+    while (fgets(line, sizeof(line), in)) {
+	if (sscanf(line, "%*[^:]:%*[^:]:%*d:%[^:]: %d operators",
+		   name, &ops) != 2)
+	    continue;
+	for (i = 0; test_set[i].solution_funct; i++)
+	    if (strcmp(test_set[i].name, name) == 0)
+		opcounts[i] = ops;
+    }
+    fclose(in);
+}
+
+/*
+ * run_bench - Time each function. The ticks per call include the
+ * indirect call and the loop, which the baseline line measures.
+ */
+static void run_bench()
+{
+    int opcounts[MAXFUNCS_OPS];
+    double rate, ticks;
+    int i;
+
+    read_opcounts(opcounts);
+    printf("Ops\tMax\tTicks\tNs\tMcalls/s\tFunction\n");
+    ticks = bench_function((funct_t) bench_nop_ptr, 3, &rate);
+    printf("-\t-\t%.2f\t%.2f\t%.1f\t\t(baseline: call and loop)\n",
+	   ticks, 1e9 / rate, rate / 1e6);
+
+    for (i = 0; test_set[i].solution_funct; i++) {
+	test_ptr t = &test_set[i];
+	if (test_fname && strcmp(t->name, test_fname) != 0)
+	    continue;
+
+	/* Handle timeouts in the benchmarked code */
+	if (timeout_limit > 0) {
+	    if (sigsetjmp(envbuf, 1)) {
+		printf("ERROR: Benchmark of %s timed out after %d secs (probably infinite loop)\n", t->name, timeout_limit);
+		continue;
+	    }
+	    alarm(timeout_limit);
+	}
+	gen_bench_vals(t);
+	ticks = bench_function(t->solution_funct, t->args, &rate);
+	alarm(0);
+
+	if (opcounts[i] >= 0)
+	    printf("%d", opcounts[i]);
+	else
+	    printf("-");
+	printf("\t%d\t%.2f\t%.2f\t%.1f\t\t%s\n", t->op_limit, ticks,
+	       1e9 / rate, rate / 1e6, t->name);
+    }
+}
+
 /* 
  * get_num_val - Extract hex/decimal/or float value from string 
  */
@@ -506,15 +1214,20 @@ static int get_num_val(char *sval, unsigned *valp) {
  * usage - Display usage info
  */
 static void usage(char *cmd) {
-    printf("Usage: %s [-hg] [-r <n>] [-f <name> [-1|-2|-3 <val>]*] [-T <time limit>]\n", cmd);
+    printf("Usage: %s [-hgx] [-r <n>] [-f <name> [-1|-2|-3 <val>]*] [-T <time limit>] [-j <workers>]\n", cmd);
+    printf("       %s -b [-f <name> [-1|-2|-3 <val>]*] [-o <dlc -e output>]\n", cmd);
     printf("  -1 <val>  Specify first function argument\n");
     printf("  -2 <val>  Specify second function argument\n");
     printf("  -3 <val>  Specify third function argument\n");
+    printf("  -b        Time the functions (ticks per call) instead of testing them\n");
     printf("  -f <name> Test only the named function\n");
     printf("  -g        Compact output for grading (with no error msgs)\n");
     printf("  -h        Print this message\n");
+    printf("  -j <n>    Run the tests in n worker processes (default: one per CPU)\n");
+    printf("  -o <file> With -b, read the operator counts from the output of dlc -e\n");
     printf("  -r <n>    Give uniform weight of n for all problems\n");
     printf("  -T <lim>  Set timeout limit to lim\n");
+    printf("  -x        Test single-argument functions on all their arguments\n");
     exit(1);
 }
 
@@ -528,8 +1241,10 @@ int main(int argc, char *argv[])
     int errors;
     char c;
 
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+
     /* parse command line args */
-    while ((c = getopt(argc, argv, "hgf:r:T:1:2:3:")) != -1)
+    while ((c = getopt(argc, argv, "hgxbo:f:r:T:j:1:2:3:")) != -1)
         switch (c) {
         case 'h': /* help */
 	    usage(argv[0]);
@@ -537,6 +1252,15 @@ int main(int argc, char *argv[])
 	case 'g': /* grading option for autograder */
 	    grade = 1;
 	    break;
+	case 'x': /* test single-argument functions exhaustively */
+	    exhaustive = 1;
+	    break;
+	case 'b': /* time the functions */
+	    bench = 1;
+	    break;
+	case 'o': /* operator counts for the benchmark */
+	    opcount_fname = strdup(optarg);
+	    break;
 	case 'f': /* test only one function */
 	    test_fname = strdup(optarg);
 	    break;
@@ -569,6 +1293,11 @@ int main(int argc, char *argv[])
 	case 'T': /* Set timeout limit */
 	    timeout_limit = atoi(optarg);
 	    break;
+	case 'j': /* Set number of workers */
+	    workers = atoi(optarg);
+	    if (workers < 1)
+		usage(argv[0]);
+	    break;
 	default:
 	    usage(argv[0]);
 	}
@@ -577,6 +1306,12 @@ int main(int argc, char *argv[])
 	Signal(SIGALRM, timeout_handler);
     }
 
+    /* time each function */
+    if (bench) {
+	run_bench();
+	return 0;
+    }
+
     /* test each function */
     errors = run_tests();
 
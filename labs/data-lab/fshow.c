@@ -2,8 +2,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 float strtof(const char *nptr, char **endptr);
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_X86 0
+#endif
+
 #define FLOAT_SIZE 32
 #define FRAC_SIZE 23
 #define EXP_SIZE 8
@@ -122,10 +135,232 @@ static int get_num_val(char *sval, unsigned *valp) {
   }
 }
 
+/*
+ * Bulk mode: classify every value of a binary file of floats or doubles,
+ * in the byte order of the machine. The file is mapped, and scanned with
+ * AVX2 where the CPU has it: a vector of values is classified at once,
+ * and only the lanes that hold a denormal, an infinity or a NaN (the
+ * anomalies) take the scalar path. The exponents go to 4 histograms,
+ * one per lane modulo 4, so that consecutive increments of the same bin
+ * do not wait on each other, and are added up at the end.
+ */
+#define MAX_EXP 2048             /* exponent values of a double */
+#define DEF_ANOMALIES 10
+
+typedef struct {
+  int is64;                      /* doubles, not floats */
+  unsigned exp_max;              /* exponent of inf and NaN */
+  unsigned long long hist[4][MAX_EXP];
+  size_t zeros, denorms, infs, nans;
+  size_t *anomalies;             /* index of the first ones */
+  size_t nanomalies, max_anomalies;
+} bulk_t;
+
+/* bulk_bits - The bit representation of value i */
+static unsigned long long bulk_bits(const void *data, int is64, size_t i)
+{
+  return is64 ? ((const unsigned long long *)data)[i]
+    : ((const unsigned *)data)[i];
+}
+
+/* Record value i with bits u, a denormal, an infinity or a NaN */
+static void anomaly(bulk_t *b, size_t i, unsigned long long u)
+{
+  int frac_size = b->is64 ? 52 : FRAC_SIZE;
+  unsigned exp = (u >> frac_size) & b->exp_max;
+  unsigned long long frac = u & ((1ULL << frac_size) - 1);
+
+  if (exp == 0)
+    b->denorms++;
+  else if (frac == 0)
+    b->infs++;
+  else
+    b->nans++;
+  if (b->nanomalies < b->max_anomalies)
+    b->anomalies[b->nanomalies++] = i;
+}
+
+/* scan_scalar - Classify values lo to hi-1 */
+static void scan_scalar(const void *data, size_t lo, size_t hi, bulk_t *b)
+{
+  int frac_size = b->is64 ? 52 : FRAC_SIZE;
+  size_t i;
+
+  for (i = lo; i < hi; i++) {
+    unsigned long long u = bulk_bits(data, b->is64, i);
+    unsigned exp = (u >> frac_size) & b->exp_max;
+    unsigned long long frac = u & ((1ULL << frac_size) - 1);
+    b->hist[i & 3][exp]++;
+    if (exp == 0 && frac == 0)
+      b->zeros++;
+    else if (exp == 0 || exp == b->exp_max)
+      anomaly(b, i, u);
+  }
+}
+
+#if HAVE_X86
+/* scan_avx2 - Classify values lo to hi-1, 8 floats or 4 doubles at once */
+__attribute__((target("avx2,popcnt")))
+static size_t scan_avx2(const void *data, size_t lo, size_t hi, bulk_t *b)
+{
+  unsigned e[8];
+  size_t i;
+  int k, m;
+
+  if (!b->is64) {
+    const __m256i emask = _mm256_set1_epi32(EXP_MASK);
+    const __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+    const __m256i zero = _mm256_setzero_si256();
+    for (i = lo; i + 8 <= hi; i += 8) {
+      __m256i u = _mm256_loadu_si256((const __m256i *)((const unsigned *)data + i));
+      __m256i exp = _mm256_and_si256(_mm256_srli_epi32(u, FRAC_SIZE), emask);
+      __m256i is_zero = _mm256_cmpeq_epi32(_mm256_and_si256(u, abs_mask), zero);
+      __m256i odd = _mm256_or_si256(_mm256_andnot_si256(is_zero,
+                                      _mm256_cmpeq_epi32(exp, zero)),
+                                    _mm256_cmpeq_epi32(exp, emask));
+      b->zeros += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(is_zero)));
+      for (m = _mm256_movemask_ps(_mm256_castsi256_ps(odd)); m; m &= m - 1) {
+        k = __builtin_ctz(m);
+        anomaly(b, i + k, ((const unsigned *)data)[i + k]);
+      }
+      _mm256_storeu_si256((__m256i *)e, exp);
+      b->hist[0][e[0]]++; b->hist[1][e[1]]++;
+      b->hist[2][e[2]]++; b->hist[3][e[3]]++;
+      b->hist[0][e[4]]++; b->hist[1][e[5]]++;
+      b->hist[2][e[6]]++; b->hist[3][e[7]]++;
+    }
+  } else {
+    const __m256i emask = _mm256_set1_epi64x(0x7ff);
+    const __m256i abs_mask = _mm256_set1_epi64x(0x7fffffffffffffffLL);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned long long e64[4];
+    for (i = lo; i + 4 <= hi; i += 4) {
+      __m256i u = _mm256_loadu_si256((const __m256i *)((const unsigned long long *)data + i));
+      __m256i exp = _mm256_and_si256(_mm256_srli_epi64(u, 52), emask);
+      __m256i is_zero = _mm256_cmpeq_epi64(_mm256_and_si256(u, abs_mask), zero);
+      __m256i odd = _mm256_or_si256(_mm256_andnot_si256(is_zero,
+                                      _mm256_cmpeq_epi64(exp, zero)),
+                                    _mm256_cmpeq_epi64(exp, emask));
+      b->zeros += _mm_popcnt_u32(_mm256_movemask_pd(_mm256_castsi256_pd(is_zero)));
+      for (m = _mm256_movemask_pd(_mm256_castsi256_pd(odd)); m; m &= m - 1) {
+        k = __builtin_ctz(m);
+        anomaly(b, i + k, ((const unsigned long long *)data)[i + k]);
+      }
+      _mm256_storeu_si256((__m256i *)e64, exp);
+      b->hist[0][e64[0]]++; b->hist[1][e64[1]]++;
+      b->hist[2][e64[2]]++; b->hist[3][e64[3]]++;
+    }
+  }
+  return i;
+}
+#endif
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* show_bulk - Classify the values of file fname, and print the results */
+static void show_bulk(char *fname, int is64, size_t max_anomalies)
+{
+  static bulk_t b;
+  size_t width = is64 ? 8 : 4, n, i, done = 0;
+  int bias = is64 ? 1023 : BIAS;
+  unsigned long long hist[MAX_EXP];
+  const char *how = "scalar";
+  struct stat st;
+  void *data = NULL;
+  double beg, secs;
+  int fd, e, k;
+
+  if ((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(fname);
+    exit(1);
+  }
+  n = st.st_size / width;
+  if (st.st_size % width)
+    printf("%s: ignoring the last %d bytes, not a whole value\n", fname,
+           (int)(st.st_size % width));
+  if (n) {
+    data = mmap(NULL, n * width, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    madvise(data, n * width, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  memset(&b, 0, sizeof(b));
+  b.is64 = is64;
+  b.exp_max = is64 ? 0x7ff : EXP_MASK;
+  b.max_anomalies = max_anomalies;
+  b.anomalies = malloc((max_anomalies + 1) * sizeof(size_t));
+
+  beg = now_sec();
+#if HAVE_X86
+  if (__builtin_cpu_supports("avx2")) {
+    done = scan_avx2(data, 0, n, &b);
+    how = "avx2";
+  }
+#endif
+  scan_scalar(data, done, n, &b);
+  secs = now_sec() - beg;
+
+  printf("%s: %zu %s, %.1f MB in %.3f s (%.2f GB/s, %s)\n", fname, n,
+         is64 ? "doubles" : "floats", n * width / 1e6, secs,
+         secs > 0 ? n * width / secs / 1e9 : 0.0, how);
+  if (!n)
+    return;
+  printf("  %-10s %12zu  %6.2f%%\n", "zero", b.zeros, 100.0 * b.zeros / n);
+  printf("  %-10s %12zu  %6.2f%%\n", "denormal", b.denorms,
+         100.0 * b.denorms / n);
+  i = n - b.zeros - b.denorms - b.infs - b.nans;
+  printf("  %-10s %12zu  %6.2f%%\n", "normal", i, 100.0 * i / n);
+  printf("  %-10s %12zu  %6.2f%%\n", "infinity", b.infs, 100.0 * b.infs / n);
+  printf("  %-10s %12zu  %6.2f%%\n", "NaN", b.nans, 100.0 * b.nans / n);
+
+  printf("Exponent histogram\n");
+  for (e = 0; e <= (int)b.exp_max; e++) {
+    hist[e] = b.hist[0][e] + b.hist[1][e] + b.hist[2][e] + b.hist[3][e];
+    if (!hist[e])
+      continue;
+    if (e == 0)
+      printf("  %-12s", "zero/denorm");
+    else if (e == (int)b.exp_max)
+      printf("  %-12s", "inf/NaN");
+    else
+      printf("  2^%-10d", e - bias);
+    printf(" %12llu  %6.2f%%\n", hist[e], 100.0 * hist[e] / n);
+  }
+
+  if (b.nanomalies) {
+    printf("First %zu anomalies\n", b.nanomalies);
+    for (k = 0; k < (int)b.nanomalies; k++) {
+      size_t j = b.anomalies[k];
+      unsigned long long u = bulk_bits(data, is64, j);
+      double v;
+      if (is64)
+        memcpy(&v, &u, sizeof(v));
+      else
+        v = u2f((unsigned)u);
+      printf("  offset %12zu  index %10zu  0x%0*llx  %.*g\n", j * width, j,
+             is64 ? 16 : 8, u, is64 ? 17 : 9, v);
+    }
+  }
+  munmap(data, n * width);
+  free(b.anomalies);
+}
 
 void usage(char *fname) {
   printf("Usage: %s val1 val2 ...\n", fname);
+  printf("       %s -b [-d] [-n <count>] <file>\n", fname);
   printf("Values may be given as hex patterns or as floating point numbers\n");
+  printf("With -b, classify the floats (-d: doubles) of a binary file, and show\n");
+  printf("its exponent histogram and its first <count> (default %d) denormals,\n", DEF_ANOMALIES);
+  printf("infinities and NaNs\n");
   exit(0);
 }
 
@@ -136,6 +371,25 @@ int main(int argc, char *argv[])
   unsigned uf;
   if (argc < 2)
     usage(argv[0]);
+  if (!strcmp(argv[1], "-b")) {
+    int is64 = 0;
+    long count = DEF_ANOMALIES;
+    char *fname = NULL;
+    for (i = 2; i < argc; i++) {
+      if (!strcmp(argv[i], "-d"))
+        is64 = 1;
+      else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+        count = atol(argv[++i]);
+      else if (!fname)
+        fname = argv[i];
+      else
+        usage(argv[0]);
+    }
+    if (!fname || count < 0)
+      usage(argv[0]);
+    show_bulk(fname, is64, count);
+    return 0;
+  }
   for (i = 1; i < argc; i++) {
     char *sval = argv[i];
     if (get_num_val(sval, &uf)) {
@@ -0,0 +1,409 @@
+/*
+ * CS:APP Data Lab
+ *
+ * softfloat.c - Conversions between integers and IEEE floating point,
+ * and scaling by powers of two, with integer operations only. See
+ * softfloat.h.
+ *
+ * Where float_i2f tests and branches, these functions compute every
+ * case and pick the result with masks: a condition becomes a mask of
+ * all ones or all zeros, and leading zeros are counted by a binary
+ * search of shifts. So each function is a straight line of integer
+ * operations, which the compiler can also vectorize: the batch
+ * versions are the same code in a loop, compiled once for the default
+ * target and once for AVX2, which has per-lane variable shifts.
+ */
+#include "softfloat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#else
+#define HAVE_X86 0
+#endif
+
+/* All ones if c holds, else 0 */
+#define MASK32(c) (-(unsigned) (c))
+#define MASK64(c) (-(unsigned long long) (c))
+
+#define FRAC32 0x007fffffu
+#define FRAC64 0x000fffffffffffffULL
+
+/******************
+ * Helpers
+ ******************/
+
+/* sel32 - a where mask is all ones, b where it is 0 */
+static inline unsigned sel32(unsigned mask, unsigned a, unsigned b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+static inline unsigned long long sel64(unsigned long long mask,
+				       unsigned long long a,
+				       unsigned long long b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+static inline int min32(int a, int b)
+{
+    return b ^ ((a ^ b) & -(a < b));
+}
+
+static inline int max32(int a, int b)
+{
+    return a ^ ((a ^ b) & -(a < b));
+}
+
+static inline int clamp32(int x, int lo, int hi)
+{
+    return min32(max32(x, lo), hi);
+}
+
+/* nlz32 - Number of leading zeros of x, 32 for 0 */
+static inline int nlz32(unsigned x)
+{
+    int n = 0, s;
+
+    s = 16 & -(x <= 0xffffu);     n += s; x <<= s;
+    s = 8 & -(x <= 0xffffffu);    n += s; x <<= s;
+    s = 4 & -(x <= 0xfffffffu);   n += s; x <<= s;
+    s = 2 & -(x <= 0x3fffffffu);  n += s; x <<= s;
+    s = 1 & -(x <= 0x7fffffffu);  n += s; x <<= s;
+    return n + (x == 0);
+}
+
+/* nlz64 - Number of leading zeros of x, 64 for 0 */
+static inline int nlz64(unsigned long long x)
+{
+    int n = 0, s;
+
+    s = 32 & -(x <= 0xffffffffULL);          n += s; x <<= s;
+    s = 16 & -(x <= 0xffffffffffffULL);      n += s; x <<= s;
+    s = 8 & -(x <= 0xffffffffffffffULL);     n += s; x <<= s;
+    s = 4 & -(x <= 0xfffffffffffffffULL);    n += s; x <<= s;
+    s = 2 & -(x <= 0x3fffffffffffffffULL);   n += s; x <<= s;
+    s = 1 & -(x <= 0x7fffffffffffffffULL);   n += s; x <<= s;
+    return n + (x == 0);
+}
+
+/*
+ * The rounding carry, 0 or 1, of a value whose dropped bits are the rs
+ * low ones, rest, low being the mask of them and lsb the lowest bit
+ * kept: rest + half - 1 + lsb carries into bit rs when rest is more
+ * than half, or half and lsb is set. Adding and shifting, rather than
+ * comparing, keeps the batch loops vectorizable.
+ */
+#define ROUND_RNE(rest, low, rs, lsb) \
+    (((rest) + ((low) >> 1) + ((lsb) & (low) & 1)) >> (rs))
+
+/*
+ * round_bias - What to add to the dropped bits, before taking the
+ * carry, to round in mode: a magnitude goes up on more than half, or
+ * half with lsb set, for SF_RNE, on half for SF_RNA, and on anything for
+ * SF_DOWN if negative and SF_UP if positive. neg is all ones for a
+ * negative value.
+ */
+static inline unsigned round_bias32(int mode, unsigned neg, unsigned low,
+				    unsigned lsb)
+{
+    return (((low >> 1) + (lsb & low & 1)) & MASK32(mode == SF_RNE)) |
+	((low - (low >> 1)) & MASK32(mode == SF_RNA)) |
+	(low & neg & MASK32(mode == SF_DOWN)) |
+	(low & ~neg & MASK32(mode == SF_UP));
+}
+
+static inline unsigned long long round_bias64(int mode,
+					      unsigned long long neg,
+					      unsigned long long low,
+					      unsigned long long lsb)
+{
+    return (((low >> 1) + (lsb & low & 1)) & MASK64(mode == SF_RNE)) |
+	((low - (low >> 1)) & MASK64(mode == SF_RNA)) |
+	(low & neg & MASK64(mode == SF_DOWN)) |
+	(low & ~neg & MASK64(mode == SF_UP));
+}
+
+/******************
+ * Integer to float
+ ******************/
+
+/*
+ * u2f - Shift x so its leading one is bit 31, keep 24 bits and round
+ * on the 8 dropped ones. The leading one adds one to the exponent, and
+ * a rounding carry out of the fraction another, as it should.
+ */
+static inline unsigned u2f(unsigned x)
+{
+    int s = nlz32(x);
+    unsigned m = x << (s & 31);
+    unsigned frac = m >> 8, rest = m & 0xff;
+    unsigned up = ROUND_RNE(rest, 0xffu, 8, frac);
+    unsigned exp = 157 - s;      /* 127 + 31 - s, less the leading one */
+
+    return ((exp << 23) + frac + up) & MASK32(x != 0);
+}
+
+static inline unsigned i2f(int x)
+{
+    unsigned neg = MASK32(x < 0);
+    return (neg & 0x80000000u) | u2f(((unsigned) x ^ neg) - neg);
+}
+
+static inline unsigned ul2f(unsigned long long x)
+{
+    int s = nlz64(x);
+    unsigned long long m = x << (s & 63);
+    unsigned frac = m >> 40;
+    unsigned long long rest = m & 0xffffffffffULL;
+    unsigned up = ROUND_RNE(rest, 0xffffffffffULL, 40, frac);
+    unsigned exp = 189 - s;      /* 127 + 63 - s, less the leading one */
+
+    return ((exp << 23) + frac + up) & MASK32(x != 0);
+}
+
+static inline unsigned l2f(long long x)
+{
+    unsigned long long neg = MASK64(x < 0);
+    return ((unsigned) neg & 0x80000000u) |
+	ul2f(((unsigned long long) x ^ neg) - neg);
+}
+
+static inline unsigned long long ul2d(unsigned long long x)
+{
+    int s = nlz64(x);
+    unsigned long long m = x << (s & 63);
+    unsigned long long frac = m >> 11, rest = m & 0x7ff;
+    unsigned long long up = ROUND_RNE(rest, 0x7ffULL, 11, frac);
+    unsigned long long exp = 1085 - s; /* 1023 + 63 - s, less the one */
+
+    return ((exp << 52) + frac + up) & MASK64(x != 0);
+}
+
+static inline unsigned long long l2d(long long x)
+{
+    unsigned long long neg = MASK64(x < 0);
+    return (neg & 0x8000000000000000ULL) |
+	ul2d(((unsigned long long) x ^ neg) - neg);
+}
+
+/******************
+ * Float to integer
+ ******************/
+
+/*
+ * f2i - The value is mant * 2^sh. Its integer part is mant shifted left
+ * by sh or right by -sh, and the bits shifted out decide the rounding.
+ * Shifts left of more than 7 are out of range anyway.
+ */
+static inline int f2i(unsigned uf, int mode)
+{
+    unsigned sign = uf >> 31, exp = (uf >> 23) & 0xff;
+    unsigned mant = (uf & FRAC32) | ((exp != 0) << 23);
+    int sh = (int) (exp + (exp == 0)) - 150;
+    int ls = clamp32(sh, 0, 7), rs = clamp32(-sh, 0, 31);
+    unsigned ip = (mant << ls) >> rs, neg = MASK32(sign);
+    unsigned low = (1u << rs) - 1;
+    unsigned up = ((mant & low) + round_bias32(mode, neg, low, ip)) >> rs;
+    unsigned mag = ip + up;
+    unsigned invalid = (exp == 0xff) | (sh > 7) | (mag > 0x7fffffffu + sign);
+
+    return (int) sel32(MASK32(invalid), 0x80000000u, (mag ^ neg) - neg);
+}
+
+static inline long long d2l(unsigned long long ud, int mode)
+{
+    unsigned sign = ud >> 63, exp = (ud >> 52) & 0x7ff;
+    unsigned long long mant = (ud & FRAC64) |
+	((unsigned long long) (exp != 0) << 52);
+    int sh = (int) (exp + (exp == 0)) - 1075;
+    int ls = clamp32(sh, 0, 10), rs = clamp32(-sh, 0, 63);
+    unsigned long long ip = (mant << ls) >> rs, neg = MASK64(sign);
+    unsigned long long low = (1ULL << rs) - 1;
+    unsigned long long up =
+	((mant & low) + round_bias64(mode, neg, low, ip)) >> rs;
+    unsigned long long mag = ip + up;
+    unsigned invalid = (exp == 0x7ff) | (sh > 10) |
+	(mag > 0x7fffffffffffffffULL + sign);
+
+    return (long long) sel64(MASK64(invalid), 0x8000000000000000ULL,
+			     (mag ^ neg) - neg);
+}
+
+/******************
+ * Scaling
+ ******************/
+
+/*
+ * scalef - Normalize the mantissa of uf, so a denormal has a leading
+ * one too, and add n to the exponent. A result below the normal range
+ * is shifted right by what the exponent lacks, and rounded; with the
+ * exponent field then 0, a carry out of the fraction makes it the
+ * smallest normal. Zeros, infinities and NaNs are returned as they are,
+ * NaNs made quiet.
+ */
+static inline unsigned scalef(unsigned uf, int n)
+{
+    unsigned sign = uf & 0x80000000u, exp = (uf >> 23) & 0xff;
+    unsigned mant = (uf & FRAC32) | ((exp != 0) << 23);
+    int s = nlz32(mant | 1) - 8;
+    int ne = (int) (exp + (exp == 0)) - s + clamp32(n, -400, 400);
+    int eb = max32(ne, 1), rs = min32(eb - ne, 31);
+    unsigned out, low, r;
+
+    mant <<= s;
+    out = mant >> rs;
+    low = (1u << rs) - 1;
+    r = sign | (((unsigned) (eb - 1) << 23) + out +
+		ROUND_RNE(mant & low, low, rs, out));
+    r = sel32(MASK32(ne >= 0xff), sign | 0x7f800000u, r);
+    r = sel32(MASK32((uf & 0x7fffffffu) == 0), uf, r);
+    return sel32(MASK32(exp == 0xff), uf | (((uf & FRAC32) != 0) << 22), r);
+}
+
+static inline unsigned long long scaled(unsigned long long ud, int n)
+{
+    unsigned long long sign = ud & 0x8000000000000000ULL;
+    unsigned exp = (ud >> 52) & 0x7ff;
+    unsigned long long mant = (ud & FRAC64) |
+	((unsigned long long) (exp != 0) << 52);
+    int s = nlz64(mant | 1) - 11;
+    int ne = (int) (exp + (exp == 0)) - s + clamp32(n, -2200, 2200);
+    int eb = max32(ne, 1), rs = min32(eb - ne, 63);
+    unsigned long long out, low, r;
+
+    mant <<= s;
+    out = mant >> rs;
+    low = (1ULL << rs) - 1;
+    r = sign | (((unsigned long long) (eb - 1) << 52) + out +
+		ROUND_RNE(mant & low, low, rs, out));
+    r = sel64(MASK64(ne >= 0x7ff), sign | 0x7ff0000000000000ULL, r);
+    r = sel64(MASK64((ud & 0x7fffffffffffffffULL) == 0), ud, r);
+    return sel64(MASK64(exp == 0x7ff),
+		 ud | ((unsigned long long) ((ud & FRAC64) != 0) << 51), r);
+}
+
+/******************
+ * Scalar functions
+ ******************/
+
+unsigned sf_i2f(int x) { return i2f(x); }
+unsigned sf_u2f(unsigned x) { return u2f(x); }
+unsigned sf_l2f(long long x) { return l2f(x); }
+unsigned sf_ul2f(unsigned long long x) { return ul2f(x); }
+unsigned long long sf_i2d(int x) { return l2d(x); }
+unsigned long long sf_u2d(unsigned x) { return ul2d(x); }
+unsigned long long sf_l2d(long long x) { return l2d(x); }
+unsigned long long sf_ul2d(unsigned long long x) { return ul2d(x); }
+int sf_f2i(unsigned uf, int mode) { return f2i(uf, mode); }
+long long sf_d2l(unsigned long long ud, int mode) { return d2l(ud, mode); }
+unsigned sf_scalbf(unsigned uf, int n) { return scalef(uf, n); }
+unsigned long long sf_scalb(unsigned long long ud, int n)
+{
+    return scaled(ud, n);
+}
+
+/******************
+ * Batch functions
+ ******************/
+
+#define BATCH_FUNCTIONS(isa, attr)					\
+    attr static void i2f_##isa(const int *x, unsigned *out, size_t n)	\
+    {									\
+	size_t i;							\
+	for (i = 0; i < n; i++)						\
+	    out[i] = i2f(x[i]);						\
+    }									\
+    attr static void u2f_##isa(const unsigned *x, unsigned *out,	\
+			       size_t n)				\
+    {									\
+	size_t i;							\
+	for (i = 0; i < n; i++)						\
+	    out[i] = u2f(x[i]);						\
+    }									\
+    attr static void f2i_##isa(const unsigned *uf, int *out, size_t n,	\
+			       int mode)				\
+    {									\
+	size_t i;							\
+	for (i = 0; i < n; i++)						\
+	    out[i] = f2i(uf[i], mode);					\
+    }									\
+    attr static void scalbf_##isa(const unsigned *uf, unsigned *out,	\
+				  size_t n, int e)			\
+    {									\
+	size_t i;							\
+	for (i = 0; i < n; i++)						\
+	    out[i] = scalef(uf[i], e);					\
+    }
+
+BATCH_FUNCTIONS(default, )
+#if HAVE_X86
+BATCH_FUNCTIONS(avx2, __attribute__((target("avx2"))))
+#endif
+
+typedef struct {
+    const char *name;
+    void (*i2f)(const int *, unsigned *, size_t);
+    void (*u2f)(const unsigned *, unsigned *, size_t);
+    void (*f2i)(const unsigned *, int *, size_t, int);
+    void (*scalbf)(const unsigned *, unsigned *, size_t, int);
+} batch_t;
+
+static const batch_t batches[] = {
+    { "default", i2f_default, u2f_default, f2i_default, scalbf_default },
+#if HAVE_X86
+    { "avx2", i2f_avx2, u2f_avx2, f2i_avx2, scalbf_avx2 },
+#endif
+};
+
+static const batch_t *use = NULL;
+
+int sf_batch_select(int isa)
+{
+    int best = SF_BATCH_DEFAULT;
+
+#if HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	best = SF_BATCH_AVX2;
+#endif
+    if (isa < 0 || isa > best)
+	isa = best;
+    use = &batches[isa];
+    return isa;
+}
+
+const char *sf_batch_name(int isa)
+{
+    if (isa < 0 || isa >= (int) (sizeof(batches) / sizeof(batches[0])))
+	return "none";
+    return batches[isa].name;
+}
+
+void sf_i2f_batch(const int *x, unsigned *out, size_t n)
+{
+    if (!use)
+	sf_batch_select(-1);
+    use->i2f(x, out, n);
+}
+
+void sf_u2f_batch(const unsigned *x, unsigned *out, size_t n)
+{
+    if (!use)
+	sf_batch_select(-1);
+    use->u2f(x, out, n);
+}
+
+void sf_f2i_batch(const unsigned *uf, int *out, size_t n, int mode)
+{
+    if (!use)
+	sf_batch_select(-1);
+    use->f2i(uf, out, n, mode);
+}
+
+void sf_scalbf_batch(const unsigned *uf, unsigned *out, size_t n, int e)
+{
+    if (!use)
+	sf_batch_select(-1);
+    use->scalbf(uf, out, n, e);
+}
@@ -0,0 +1,73 @@
+/*
+ * CS:APP Data Lab
+ *
+ * softfloat.h - Conversions between integers and IEEE floating point,
+ * and scaling by powers of two, with integer operations only.
+ *
+ * This is the float_i2f and float_twice puzzles grown into a library.
+ * Floats and doubles are passed as their bit representations, unsigned
+ * and unsigned long long. The functions have no branches on their
+ * arguments, so they take the same time whatever the values, and give
+ * the same results whatever the FPU and its rounding mode. The
+ * conversions to floating point round to nearest even, as C does.
+ * Signaling NaNs come out quiet, as from the hardware.
+ *
+ * The batch versions of the 32-bit functions apply them to n values at
+ * a time, with AVX2 where the CPU has it.
+ */
+#ifndef __SOFTFLOAT_H__
+#define __SOFTFLOAT_H__
+
+#include <stddef.h>
+
+/* Rounding modes of the conversions to integers */
+#define SF_RNE  0    /* to nearest, ties to even (rint) */
+#define SF_RNA  1    /* to nearest, ties away from zero (round) */
+#define SF_RTZ  2    /* toward zero (trunc, a C cast) */
+#define SF_DOWN 3    /* toward -infinity (floor) */
+#define SF_UP   4    /* toward +infinity (ceil) */
+
+/* Value of the conversions to integers of NaNs and out of range values,
+   as the x86 conversion instructions return */
+#define SF_INT_INVALID  ((int) 0x80000000)
+#define SF_LONG_INVALID ((long long) 0x8000000000000000ULL)
+
+/* (float) x, and (double) x */
+unsigned sf_i2f(int x);
+unsigned sf_u2f(unsigned x);
+unsigned sf_l2f(long long x);
+unsigned sf_ul2f(unsigned long long x);
+unsigned long long sf_i2d(int x);
+unsigned long long sf_u2d(unsigned x);
+unsigned long long sf_l2d(long long x);
+unsigned long long sf_ul2d(unsigned long long x);
+
+/* Float uf, and double ud, rounded to an integer with mode */
+int sf_f2i(unsigned uf, int mode);
+long long sf_d2l(unsigned long long ud, int mode);
+
+/* uf * 2^n and ud * 2^n, as ldexpf and ldexp */
+unsigned sf_scalbf(unsigned uf, int n);
+unsigned long long sf_scalb(unsigned long long ud, int n);
+
+/* Instruction sets of the batch functions */
+#define SF_BATCH_DEFAULT 0   /* what the compiler targets by default */
+#define SF_BATCH_AVX2    1
+
+/* out[i] = sf_i2f(x[i]), sf_u2f(x[i]), ... */
+void sf_i2f_batch(const int *x, unsigned *out, size_t n);
+void sf_u2f_batch(const unsigned *x, unsigned *out, size_t n);
+void sf_f2i_batch(const unsigned *uf, int *out, size_t n, int mode);
+void sf_scalbf_batch(const unsigned *uf, unsigned *out, size_t n, int e);
+
+/*
+ * sf_batch_select - Use the batch functions for instruction set isa, or
+ * the best one the CPU supports if isa is -1 or not supported. Return
+ * the instruction set in use.
+ */
+int sf_batch_select(int isa);
+
+/* sf_batch_name - The name of an instruction set */
+const char *sf_batch_name(int isa);
+
+#endif /* __SOFTFLOAT_H__ */
@@ -0,0 +1,514 @@
+/*
+ * CS:APP Data Lab
+ *
+ * softfloat_bench.c - Check the softfloat.c functions against the
+ * hardware, and time them.
+ *
+ * Build: gcc -O3 -Wall -o softfloat_bench softfloat_bench.c softfloat.c -lm
+ *
+ * usage: softfloat_bench [-x] [-n <values>] [-r <repetitions>]
+ * Every function is first compared with the conversions of the FPU, in
+ * every rounding mode for the conversions to integers, on edge cases
+ * and random values of all magnitudes (2^24 of them), and with -x on
+ * all 2^32 values for the functions of a 32-bit value (a few minutes
+ * per CPU). Scaling is compared with the conversion of the exact
+ * product in double for floats, and with ldexp for doubles. The batch
+ * functions are compared with the scalar ones for every instruction
+ * set. Then the time per value is reported, best of <repetitions> runs
+ * over arrays of <values> values (default 2^20), for the hardware, the
+ * scalar function and the batch function for each instruction set.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <fenv.h>
+#include <time.h>
+#include "softfloat.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#else
+#define HAVE_X86 0
+#endif
+
+#define NRANDOM (1 << 24)
+
+static const char *mode_names[] = { "rne", "rna", "rtz", "down", "up" };
+static const int fe_modes[] = {
+    FE_TONEAREST, FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD
+};
+
+/* The scales tried on every float with -x */
+static const int scales[] = {
+    -300, -150, -149, -126, -24, -1, 0, 1, 24, 127, 254
+};
+#define NSCALES (int) (sizeof(scales) / sizeof(scales[0]))
+
+static int exhaustive = 0;
+static size_t n = 1 << 20;
+static int reps = 5;
+static int failed = 0;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long mix64(unsigned long long z)
+{
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* random64 - The i-th random value, of a random magnitude */
+static unsigned long long random64(unsigned long long i)
+{
+    unsigned long long r = mix64(i);
+    return r >> (mix64(~i) % 64);
+}
+
+static unsigned f2u(float f) { unsigned u; memcpy(&u, &f, 4); return u; }
+static float u2f(unsigned u) { float f; memcpy(&f, &u, 4); return f; }
+static unsigned long long d2u(double d)
+{
+    unsigned long long u;
+    memcpy(&u, &d, 8);
+    return u;
+}
+static double u2d(unsigned long long u) { double d; memcpy(&d, &u, 8); return d; }
+
+/*
+ * Conversions to integers by the hardware, in the rounding mode set
+ * with fesetround. The FPU has no mode for ties away from zero, so
+ * that one uses round.
+ */
+static int hw_f2i(float f, int mode)
+{
+    double r;
+#if HAVE_X86
+    if (mode != SF_RNA)
+	return _mm_cvtss_si32(_mm_set_ss(f));
+#endif
+    r = mode == SF_RNA ? round(f) : rint(f);
+    return r >= -2147483648.0 && r < 2147483648.0 ? (int) r : SF_INT_INVALID;
+}
+
+static long long hw_d2l(double d, int mode)
+{
+    double r;
+#if HAVE_X86
+    if (mode != SF_RNA)
+	return _mm_cvtsd_si64(_mm_set_sd(d));
+#endif
+    r = mode == SF_RNA ? round(d) : rint(d);
+    return r >= -9223372036854775808.0 && r < 9223372036854775808.0
+	? (long long) r : SF_LONG_INVALID;
+}
+
+/* hw_scalbf - The product is exact in double, and rounded once */
+static unsigned hw_scalbf(unsigned uf, int e)
+{
+    return f2u((float) ((double) u2f(uf) * ldexp(1.0, e)));
+}
+
+/* The mismatches of the function being checked */
+static const char *check_name;
+static unsigned long long mismatches;
+
+static void mismatch(unsigned long long arg, int e, unsigned long long got,
+		     unsigned long long want)
+{
+    if (!mismatches++)
+	printf("  %s(0x%llx, %d) = 0x%llx, should be 0x%llx\n", check_name,
+	       arg, e, got, want);
+}
+
+static void start_check(const char *name)
+{
+    check_name = name;
+    mismatches = 0;
+}
+
+static void end_check(const char *what)
+{
+    printf("%-16s %s, %s\n", check_name, mismatches ? "WRONG" : "ok", what);
+    if (mismatches) {
+	printf("  %llu values differ\n", mismatches);
+	failed = 1;
+    }
+    fflush(stdout);
+}
+
+/* The 32-bit arguments to check: all of them, or the edges and random ones */
+static unsigned long long count32(void)
+{
+    return exhaustive ? 1ULL << 32 : NRANDOM;
+}
+
+static unsigned arg32(unsigned long long i)
+{
+    static const unsigned edges[] = {
+	0, 1, 0x7fffffff, 0x80000000, 0x80000001, 0xffffffff, 0x00ffffff,
+	0x01000001, 0x01000003, 0x7fffff80, 0x7fffffc0, 0x00800000,
+	0x007fffff, 0x7f7fffff, 0x7f800000, 0xff800000, 0x7f800001,
+	0x7fc00000, 0x3f000000, 0x3fc00000, 0xbfc00000, 0x4f000000,
+	0xcf000000, 0x4effffff, 0xcf000001,
+    };
+    size_t nedges = sizeof(edges) / sizeof(edges[0]);
+
+    if (exhaustive)
+	return (unsigned) i;
+    return i < nedges ? edges[i] : (unsigned) random64(i);
+}
+
+static unsigned long long arg64(unsigned long long i)
+{
+    static const unsigned long long edges[] = {
+	0, 1, 0x7fffffffffffffffULL, 0x8000000000000000ULL,
+	0xffffffffffffffffULL, 0x0020000000000001ULL, 0x0020000000000003ULL,
+	0x43e0000000000000ULL, 0xc3e0000000000000ULL, 0x43dfffffffffffffULL,
+	0x3fe0000000000000ULL, 0x3ff8000000000000ULL, 0xbff8000000000000ULL,
+	0x7ff0000000000000ULL, 0x7ff0000000000001ULL, 0x0000000000000001ULL,
+	0x000fffffffffffffULL, 0x0010000000000000ULL,
+    };
+    size_t nedges = sizeof(edges) / sizeof(edges[0]);
+    unsigned long long r = random64(i);
+
+    if (i < nedges)
+	return edges[i];
+    /* doubles of all exponents, but mostly near the integers */
+    if (i & 1)
+	r = (r & 0x800fffffffffffffULL) |
+	    ((0x3ff + mix64(i) % 70 - 5) << 52);
+    return r;
+}
+
+static void check_int_to_float(void)
+{
+    unsigned long long i, count = count32();
+    char what[64];
+
+    snprintf(what, sizeof(what), exhaustive ? "all 2^32 values"
+	     : "%llu values", count);
+    start_check("i2f");
+    for (i = 0; i < count; i++) {
+	int x = (int) arg32(i);
+	unsigned want = f2u((float) x), got = sf_i2f(x);
+	if (got != want)
+	    mismatch((unsigned) x, 0, got, want);
+    }
+    end_check(what);
+    start_check("u2f");
+    for (i = 0; i < count; i++) {
+	unsigned x = arg32(i);
+	unsigned want = f2u((float) x), got = sf_u2f(x);
+	if (got != want)
+	    mismatch(x, 0, got, want);
+    }
+    end_check(what);
+    start_check("i2d, u2d");
+    for (i = 0; i < count; i++) {
+	unsigned x = arg32(i);
+	if (sf_i2d((int) x) != d2u((double) (int) x))
+	    mismatch(x, 0, sf_i2d((int) x), d2u((double) (int) x));
+	if (sf_u2d(x) != d2u((double) x))
+	    mismatch(x, 1, sf_u2d(x), d2u((double) x));
+    }
+    end_check(what);
+
+    snprintf(what, sizeof(what), "%d values", NRANDOM);
+    start_check("l2f, ul2f");
+    for (i = 0; i < NRANDOM; i++) {
+	unsigned long long x = arg64(i);
+	if (sf_l2f((long long) x) != f2u((float) (long long) x))
+	    mismatch(x, 0, sf_l2f((long long) x), f2u((float) (long long) x));
+	if (sf_ul2f(x) != f2u((float) x))
+	    mismatch(x, 1, sf_ul2f(x), f2u((float) x));
+    }
+    end_check(what);
+    start_check("l2d, ul2d");
+    for (i = 0; i < NRANDOM; i++) {
+	unsigned long long x = arg64(i);
+	if (sf_l2d((long long) x) != d2u((double) (long long) x))
+	    mismatch(x, 0, sf_l2d((long long) x), d2u((double) (long long) x));
+	if (sf_ul2d(x) != d2u((double) x))
+	    mismatch(x, 1, sf_ul2d(x), d2u((double) x));
+    }
+    end_check(what);
+}
+
+static void check_float_to_int(void)
+{
+    unsigned long long i, count = count32();
+    char name[32], what[64];
+    int mode;
+
+    for (mode = SF_RNE; mode <= SF_UP; mode++) {
+	fesetround(fe_modes[mode]);
+	snprintf(name, sizeof(name), "f2i %s", mode_names[mode]);
+	snprintf(what, sizeof(what), exhaustive ? "all 2^32 values"
+		 : "%llu values", count);
+	start_check(name);
+	for (i = 0; i < count; i++) {
+	    unsigned uf = arg32(i);
+	    int want = hw_f2i(u2f(uf), mode), got = sf_f2i(uf, mode);
+	    if (got != want)
+		mismatch(uf, mode, (unsigned) got, (unsigned) want);
+	}
+	end_check(what);
+
+	snprintf(name, sizeof(name), "d2l %s", mode_names[mode]);
+	snprintf(what, sizeof(what), "%d values", NRANDOM);
+	start_check(name);
+	for (i = 0; i < NRANDOM; i++) {
+	    unsigned long long ud = arg64(i);
+	    long long want = hw_d2l(u2d(ud), mode), got = sf_d2l(ud, mode);
+	    if (got != want)
+		mismatch(ud, mode, got, want);
+	}
+	end_check(what);
+    }
+    fesetround(FE_TONEAREST);
+}
+
+static void check_scale(void)
+{
+    unsigned long long i, count = count32();
+    char what[64];
+    int k;
+
+    start_check("scalbf");
+    if (exhaustive) {
+	for (k = 0; k < NSCALES; k++)
+	    for (i = 0; i < count; i++) {
+		unsigned uf = (unsigned) i;
+		unsigned got = sf_scalbf(uf, scales[k]);
+		unsigned want = hw_scalbf(uf, scales[k]);
+		if (got != want)
+		    mismatch(uf, scales[k], got, want);
+	    }
+	snprintf(what, sizeof(what), "all 2^32 values, %d scales", NSCALES);
+    } else {
+	for (i = 0; i < count; i++) {
+	    unsigned uf = arg32(i);
+	    int e = (int) (mix64(~i) % 641) - 320;
+	    unsigned got = sf_scalbf(uf, e), want = hw_scalbf(uf, e);
+	    if (got != want)
+		mismatch(uf, e, got, want);
+	}
+	snprintf(what, sizeof(what), "%llu values", count);
+    }
+    end_check(what);
+
+    start_check("scalb");
+    for (i = 0; i < NRANDOM; i++) {
+	unsigned long long ud = arg64(i) ^ (mix64(i + 1) & 0x7ff0000000000000ULL);
+	int e = (int) (mix64(~i) % 4401) - 2200;
+	unsigned long long got = sf_scalb(ud, e);
+	unsigned long long want = d2u(ldexp(u2d(ud), e));
+	if (got != want)
+	    mismatch(ud, e, got, want);
+    }
+    snprintf(what, sizeof(what), "%d values", NRANDOM);
+    end_check(what);
+}
+
+/* The arrays of the batch checks and of the timings */
+static int *xs;
+static unsigned *ufs, *out;
+
+/* check_batch - Compare the batch functions with the scalar ones */
+static void check_batch(int best)
+{
+    char name[32];
+    size_t i;
+    int isa, mode;
+
+    for (isa = 0; isa <= best; isa++) {
+	sf_batch_select(isa);
+	snprintf(name, sizeof(name), "batch %s", sf_batch_name(isa));
+	start_check(name);
+	sf_i2f_batch(xs, out, n);
+	for (i = 0; i < n; i++)
+	    if (out[i] != sf_i2f(xs[i]))
+		mismatch(xs[i], 0, out[i], sf_i2f(xs[i]));
+	sf_u2f_batch((unsigned *) xs, out, n);
+	for (i = 0; i < n; i++)
+	    if (out[i] != sf_u2f(xs[i]))
+		mismatch(xs[i], 1, out[i], sf_u2f(xs[i]));
+	for (mode = SF_RNE; mode <= SF_UP; mode++) {
+	    sf_f2i_batch(ufs, (int *) out, n, mode);
+	    for (i = 0; i < n; i++)
+		if ((int) out[i] != sf_f2i(ufs[i], mode))
+		    mismatch(ufs[i], mode, out[i], sf_f2i(ufs[i], mode));
+	}
+	sf_scalbf_batch(ufs, out, n, -130);
+	for (i = 0; i < n; i++)
+	    if (out[i] != sf_scalbf(ufs[i], -130))
+		mismatch(ufs[i], -130, out[i], sf_scalbf(ufs[i], -130));
+	end_check("i2f, u2f, f2i, scalbf");
+    }
+}
+
+/*
+ * The loops timed: the hardware, the scalar function and the batch
+ * function for each conversion
+ */
+static void i2f_hw(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = f2u((float) xs[i]);
+}
+static void i2f_sf(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = sf_i2f(xs[i]);
+}
+static void i2f_bat(void) { sf_i2f_batch(xs, out, n); }
+
+static void u2f_hw(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = f2u((float) (unsigned) xs[i]);
+}
+static void u2f_sf(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = sf_u2f(xs[i]);
+}
+static void u2f_bat(void) { sf_u2f_batch((unsigned *) xs, out, n); }
+
+static void f2i_hw(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = hw_f2i(u2f(ufs[i]), SF_RNE);
+}
+static void f2i_sf(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = sf_f2i(ufs[i], SF_RNE);
+}
+static void f2i_bat(void) { sf_f2i_batch(ufs, (int *) out, n, SF_RNE); }
+
+static void scalbf_hw(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = f2u(ldexpf(u2f(ufs[i]), -130));
+}
+static void scalbf_sf(void)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+	out[i] = sf_scalbf(ufs[i], -130);
+}
+static void scalbf_bat(void) { sf_scalbf_batch(ufs, out, n, -130); }
+
+typedef struct {
+    const char *name;
+    void (*hw)(void);
+    const char *hw_name;
+    void (*sf)(void);
+    void (*batch)(void);
+} timed_t;
+
+static const timed_t timed[] = {
+    { "i2f", i2f_hw, "cast", i2f_sf, i2f_bat },
+    { "u2f", u2f_hw, "cast", u2f_sf, u2f_bat },
+    { "f2i rne", f2i_hw, "cvtss2si", f2i_sf, f2i_bat },
+    { "scalbf -130", scalbf_hw, "ldexpf", scalbf_sf, scalbf_bat },
+};
+#define NTIMED (int) (sizeof(timed) / sizeof(timed[0]))
+
+/* time_ns - Best time per value of f, in ns */
+static double time_ns(void (*f)(void))
+{
+    double best = 0;
+    int r;
+
+    for (r = 0; r < reps; r++) {
+	double beg = now_sec(), t;
+	f();
+	t = now_sec() - beg;
+	if (!best || t < best)
+	    best = t;
+    }
+    return best * 1e9 / n;
+}
+
+int main(int argc, char *argv[])
+{
+    int c, i, isa, best;
+    size_t j;
+
+    while ((c = getopt(argc, argv, "xn:r:")) != -1) {
+	switch (c) {
+	case 'x':
+	    exhaustive = 1;
+	    break;
+	case 'n':
+	    n = strtoul(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    reps = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-x] [-n <values>] [-r <repetitions>]\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+    if (n < 64 || reps < 1) {
+	fprintf(stderr, "%s: need at least 64 values and 1 repetition\n",
+		argv[0]);
+	exit(1);
+    }
+
+    xs = malloc(n * sizeof(int));
+    ufs = malloc(n * sizeof(unsigned));
+    out = malloc(n * sizeof(unsigned));
+    if (!xs || !ufs || !out) {
+	perror("malloc");
+	exit(1);
+    }
+    for (j = 0; j < n; j++) {
+	xs[j] = (int) random64(j);
+	ufs[j] = arg32(j);
+    }
+    best = sf_batch_select(-1);
+
+    check_int_to_float();
+    check_float_to_int();
+    check_scale();
+    check_batch(best);
+
+    printf("\n%zu values, ns per value (best of %d)\n", n, reps);
+    printf("%-12s %10s %8s", "function", "hardware", "scalar");
+    for (isa = 0; isa <= best; isa++)
+	printf(" %8s", sf_batch_name(isa));
+    printf("\n");
+    for (i = 0; i < NTIMED; i++) {
+	const timed_t *t = &timed[i];
+	printf("%-12s %10.3f %8.3f", t->name, time_ns(t->hw), time_ns(t->sf));
+	for (isa = 0; isa <= best; isa++) {
+	    sf_batch_select(isa);
+	    printf(" %8.3f", time_ns(t->batch));
+	}
+	printf("   (hardware: %s)\n", t->hw_name);
+    }
+    return failed;
+}
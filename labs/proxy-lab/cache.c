@@ -0,0 +1,277 @@
+#include "xnix_helper.h"
+#include "cache.h"
+#include "lz.h"
+#include <time.h>
+
+#define CACHE_BUCKETS 1024
+
+static void LRUUnlink(CacheEntry *entry) {
+  entry->lru_prev->lru_next = entry->lru_next;
+  entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void LRUPushFront(CacheShard *shard, CacheEntry *entry) {
+  entry->lru_prev = &shard->lru;
+  entry->lru_next = shard->lru.lru_next;
+  shard->lru.lru_next->lru_prev = entry;
+  shard->lru.lru_next = entry;
+}
+
+static void HashUnlink(CacheShard *shard, CacheEntry *entry) {
+  CacheEntry **pp = &shard->buckets[entry->hash % shard->nbuckets];
+  while (*pp != entry) {
+    pp = &(*pp)->hash_next;
+  }
+  *pp = entry->hash_next;
+}
+
+static void FreeEntry(CacheEntry *entry) {
+  while (entry->segments) {
+    CacheSegment *seg = entry->segments;
+    entry->segments = seg->next;
+    Free(seg->data);
+    Free(seg);
+  }
+  Free(entry->content_type);
+  Free(entry->key);
+  Free(entry->data);
+  Free(entry);
+}
+
+static void Evict(CacheShard *shard, CacheEntry *entry) {
+  LRUUnlink(entry);
+  HashUnlink(shard, entry);
+  shard->size -= entry->size;
+  shard->raw_size -= entry->raw_size;
+  --shard->count;
+  FreeEntry(entry);
+}
+
+static CacheEntry *FindEntry(CacheShard *shard, const char *key,
+                             uint32_t hash) {
+  CacheEntry *entry = shard->buckets[hash % shard->nbuckets];
+  for (; entry; entry = entry->hash_next) {
+    if (entry->hash == hash && !strcmp(entry->key, key)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Evict from the LRU tail until size more bytes fit, never evicting keep
+static void MakeRoom(CacheShard *shard, size_t size, CacheEntry *keep) {
+  while (shard->size + size > shard->capacity &&
+         shard->lru.lru_prev != &shard->lru &&
+         shard->lru.lru_prev != keep) {
+    Evict(shard, shard->lru.lru_prev);
+  }
+}
+
+static CacheEntry *NewEntry(CacheShard *shard, const char *key,
+                            uint32_t hash) {
+  CacheEntry *entry = Calloc(1, sizeof(CacheEntry));
+  entry->key = strdup(key);
+  entry->hash = hash;
+  CacheEntry **bucket = &shard->buckets[hash % shard->nbuckets];
+  entry->hash_next = *bucket;
+  *bucket = entry;
+  LRUPushFront(shard, entry);
+  ++shard->count;
+  return entry;
+}
+
+// FNV-1a
+uint32_t CacheHash(const char *key) {
+  uint32_t hash = 2166136261u;
+  for (; *key; ++key) {
+    hash ^= (unsigned char)*key;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void CacheShardInit(CacheShard *shard, size_t capacity) {
+  shard->nbuckets = CACHE_BUCKETS;
+  shard->buckets = Calloc(shard->nbuckets, sizeof(CacheEntry *));
+  shard->count = 0;
+  shard->size = 0;
+  shard->capacity = capacity;
+  shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+  shard->scratch = Malloc(LZ_BOUND(MAX_OBJECT_SIZE));
+  shard->raw_size = 0;
+  shard->hits = 0;
+  shard->misses = 0;
+  shard->compressed_hits = 0;
+  shard->decompress_ns = 0;
+}
+
+void CacheShardFree(CacheShard *shard) {
+  while (shard->lru.lru_next != &shard->lru) {
+    Evict(shard, shard->lru.lru_next);
+  }
+  Free(shard->buckets);
+  Free(shard->scratch);
+  shard->buckets = NULL;
+  shard->scratch = NULL;
+}
+
+const CacheEntry *CacheShardLookup(CacheShard *shard, const char *key,
+                                   uint32_t hash) {
+  CacheEntry *entry = FindEntry(shard, key, hash);
+  if (entry) {
+    LRUUnlink(entry);
+    LRUPushFront(shard, entry);
+    ++shard->hits;
+    return entry;
+  }
+  ++shard->misses;
+  return NULL;
+}
+
+static long NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+const char *CacheShardData(CacheShard *shard, const CacheEntry *entry) {
+  if (!entry->compressed) {
+    return entry->data;
+  }
+  long beg = NowNs();
+  ssize_t n = LZDecompress(entry->data, entry->size, shard->scratch,
+                           MAX_OBJECT_SIZE);
+  shard->decompress_ns += NowNs() - beg;
+  ++shard->compressed_hits;
+  return n == (ssize_t)entry->raw_size ? shard->scratch : NULL;
+}
+
+int CacheShardInsert(CacheShard *shard, const char *key, uint32_t hash,
+                     const char *data, size_t size, int compressible) {
+  if (size > MAX_OBJECT_SIZE) {
+    return 0;
+  }
+
+  size_t raw_size = size;
+  int compressed = 0;
+  if (compressible) {
+    // the scratch buffer holds LZ_BOUND(MAX_OBJECT_SIZE) bytes
+    size_t n = LZCompress(data, size, shard->scratch, size - size / 8);
+    if (n) {
+      data = shard->scratch;
+      size = n;
+      compressed = 1;
+    }
+  }
+  if (size > shard->capacity) {
+    return 0;
+  }
+
+  // replace an older copy of the same object
+  CacheEntry *entry = FindEntry(shard, key, hash);
+  if (entry) {
+    Evict(shard, entry);
+  }
+  MakeRoom(shard, size, NULL);
+
+  entry = NewEntry(shard, key, hash);
+  entry->data = Malloc(size);
+  memcpy(entry->data, data, size);
+  entry->size = size;
+  entry->raw_size = raw_size;
+  entry->compressed = compressed;
+  shard->size += size;
+  shard->raw_size += raw_size;
+  return 1;
+}
+
+int CacheShardInsertSegment(CacheShard *shard, const char *key, uint32_t hash,
+                            const char *content_type, size_t total_size,
+                            size_t offset, const char *data, size_t size) {
+  if (!size || size > MAX_OBJECT_SIZE || size > shard->capacity ||
+      offset + size > total_size) {
+    return 0;
+  }
+
+  CacheEntry *entry = FindEntry(shard, key, hash);
+  if (entry && !entry->sparse) {
+    return 0;
+  }
+  if (entry && entry->total_size != total_size) { // the object changed
+    Evict(shard, entry);
+    entry = NULL;
+  }
+  if (entry) {
+    LRUUnlink(entry);
+    LRUPushFront(shard, entry);
+  }
+  MakeRoom(shard, size, entry);
+  if (entry && shard->size + size > shard->capacity) {
+    Evict(shard, entry); // only this object is left and it is too big
+    entry = NULL;
+  }
+  if (!entry) {
+    entry = NewEntry(shard, key, hash);
+    entry->sparse = 1;
+    entry->total_size = total_size;
+    entry->content_type = strdup(content_type ? content_type : "");
+  }
+
+  // the new segment absorbs every segment it overlaps or touches
+  size_t beg = offset, end = offset + size, merged_size = 0;
+  CacheSegment **pp = &entry->segments;
+  while (*pp && (*pp)->offset + (*pp)->size < beg) {
+    pp = &(*pp)->next;
+  }
+  CacheSegment *first = *pp, *last = NULL, *seg;
+  for (seg = first; seg && seg->offset <= end; seg = seg->next) {
+    if (seg->offset < beg) beg = seg->offset;
+    if (seg->offset + seg->size > end) end = seg->offset + seg->size;
+    merged_size += seg->size;
+    last = seg;
+  }
+
+  CacheSegment *new_seg = Malloc(sizeof(CacheSegment));
+  new_seg->offset = beg;
+  new_seg->size = end - beg;
+  new_seg->data = Malloc(end - beg);
+  new_seg->next = last ? last->next : first;
+  for (seg = first; last && seg != last->next; ) {
+    CacheSegment *next = seg->next;
+    memcpy(new_seg->data + (seg->offset - beg), seg->data, seg->size);
+    Free(seg->data);
+    Free(seg);
+    seg = next;
+  }
+  memcpy(new_seg->data + (offset - beg), data, size);
+  *pp = new_seg;
+
+  entry->size += new_seg->size - merged_size;
+  entry->raw_size = entry->size;
+  shard->size += new_seg->size - merged_size;
+  shard->raw_size += new_seg->size - merged_size;
+  return 1;
+}
+
+const char *CacheEntryRange(const CacheEntry *entry, size_t offset,
+                            size_t size) {
+  const CacheSegment *seg = entry->segments;
+  for (; seg && seg->offset <= offset; seg = seg->next) {
+    if (offset + size <= seg->offset + seg->size) {
+      return seg->data + (offset - seg->offset);
+    }
+  }
+  return NULL;
+}
+
+void CacheShardReport(CacheShard *shard, FILE *out, int id) {
+  size_t lookups = shard->hits + shard->misses;
+  fprintf(out, "cache shard %d: %zu objects, %zu/%zu bytes stored, "
+          "%zu bytes raw (capacity x%.2f), hits %zu/%zu, "
+          "decompress %.1f us per compressed hit\n",
+          id, shard->count, shard->size, shard->capacity, shard->raw_size,
+          shard->size ? (double)shard->raw_size / shard->size : 1.0,
+          shard->hits, lookups,
+          shard->compressed_hits ?
+            shard->decompress_ns / 1000.0 / shard->compressed_hits : 0.0);
+}
@@ -0,0 +1,109 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// Recommended max cache and object sizes
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+// A cached web object. Entries are chained in their hash bucket and in the
+// LRU list of the shard that owns them.
+// Compressible objects are stored LZ compressed (see lz.h), size is then the
+// compressed size and raw_size the size of the object itself.
+// Partially cached objects (filled by range requests) are sparse entries:
+// data is NULL and the known byte ranges of the body are kept as a sorted list
+// of non-adjacent segments. size is then the sum of the segment sizes.
+typedef struct CacheSegment {
+  size_t offset;
+  size_t size;
+  char *data;
+  struct CacheSegment *next;
+} CacheSegment;
+
+typedef struct CacheEntry {
+  char *key;
+  char *data;
+  size_t size;
+  size_t raw_size;
+  int compressed;
+  int sparse;
+  size_t total_size;         // sparse: length of the whole body
+  char *content_type;        // sparse: Content-Type of the body
+  CacheSegment *segments;    // sparse: known parts of the body
+  uint32_t hash;
+  struct CacheEntry *hash_next;
+  struct CacheEntry *lru_prev;
+  struct CacheEntry *lru_next;
+} CacheEntry;
+
+// One shard of the proxy cache.
+// A shard is owned by exactly one worker thread and is never touched by any
+// other thread, so it needs no lock. Requests for keys owned by another
+// shard are passed to the owning worker instead (see proxy.c).
+typedef struct {
+  CacheEntry **buckets;
+  size_t nbuckets;
+  size_t count;
+  size_t size;      // bytes of cached data
+  size_t capacity;  // max bytes of cached data
+  CacheEntry lru;   // sentinel, lru.lru_next is the most recently used
+  char *scratch;    // LZ_BOUND(MAX_OBJECT_SIZE) bytes to (de)compress in
+  size_t raw_size;  // bytes of cached objects before compression
+  size_t hits;
+  size_t misses;
+  size_t compressed_hits;
+  long decompress_ns;
+} CacheShard;
+
+// Hash of a cache key, also used to pick the owning shard
+uint32_t CacheHash(const char *key);
+
+// Init a shard that holds at most capacity bytes of data
+void CacheShardInit(CacheShard *shard, size_t capacity);
+void CacheShardFree(CacheShard *shard);
+
+// Find key in the shard and mark it as most recently used
+// 1. Output:
+//  <1> ret : entry if found else NULL. The entry stays valid until the next
+//      CacheShardInsert on the same shard
+const CacheEntry *CacheShardLookup(CacheShard *shard, const char *key,
+                                   uint32_t hash);
+
+// Get the object of an entry, entry->raw_size bytes
+// 1. Output:
+//  <1> ret : the stored data, or for a compressed entry the shard's scratch
+//      buffer, valid until the next call on the same shard. NULL if the
+//      stored data is corrupt
+const char *CacheShardData(CacheShard *shard, const CacheEntry *entry);
+
+// Copy data into the shard, evicting least recently used entries as needed
+// 1. Input:
+//  <1> compressible : try to store the object compressed. It is kept
+//      compressed only if that saves at least 1/8 of its size
+// 2. Output:
+//  <1> ret : 1 if cached, 0 if the object is larger than MAX_OBJECT_SIZE or
+//      than the shard itself
+int CacheShardInsert(CacheShard *shard, const char *key, uint32_t hash,
+                     const char *data, size_t size, int compressible);
+
+// Add bytes [offset, offset + size) of an object's body as a sparse entry.
+// The segment is merged with the ones that overlap or touch it. An existing
+// sparse entry with a different total_size is dropped first.
+// 1. Output:
+//  <1> ret : 1 if cached, 0 if the object is already fully cached or the
+//      segment does not fit
+int CacheShardInsertSegment(CacheShard *shard, const char *key, uint32_t hash,
+                            const char *content_type, size_t total_size,
+                            size_t offset, const char *data, size_t size);
+
+// Find body bytes [offset, offset + size) of a sparse entry
+// 1. Output:
+//  <1> ret : pointer to the bytes, NULL if they are not all cached
+const char *CacheEntryRange(const CacheEntry *entry, size_t offset, size_t size);
+
+// Print the shard's hit rate, the capacity gained by compression and the
+// average time spent decompressing a hit
+void CacheShardReport(CacheShard *shard, FILE *out, int id);
+#endif
@@ -650,31 +650,106 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - robustly read a text line (buffered)
+ *    Searches the internal buffer with memchr() and copies the line
+ *    in chunks rather than one rio_read() call per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, cnt;
+    char *eol, *bufp = usrbuf;
+
+    while (n + 1 < maxlen) { 
+	while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
+	    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+			       sizeof(rp->rio_buf));
+	    if (rp->rio_cnt < 0) {
+		if (errno != EINTR) /* interrupted by sig handler return */
+		    return -1;	    /* error */
+	    }
+	    else if (rp->rio_cnt == 0)  /* EOF */
+		goto done;
+	    else 
+		rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
+	}
+
+	/* Copy up to and including the next newline */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((eol = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = eol - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
+	if (eol)
+	    break;
     }
-    *bufp = 0;
+ done:
+    if (maxlen)
+	*bufp = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/* 
+ * rio_readlinep - read a text line without copying it (buffered)
+ *    On return *linep points at the line inside rp->rio_buf. The line
+ *    is not null terminated and is only valid until the next read on
+ *    rp. Bytes are moved only when a line straddles the end of the
+ *    buffer. Returns the line length including '\n', 0 on EOF and -1
+ *    on error.
+ */
+/* $begin rio_readlinep */
+ssize_t rio_readlinep(rio_t *rp, char **linep) 
+{
+    size_t cnt, scanned = 0; /* bytes already searched for '\n' */
+    ssize_t len, nread;
+    char *eol;
+
+    for (;;) {
+	cnt = rp->rio_cnt > 0 ? rp->rio_cnt : 0;
+	eol = NULL;
+	if (cnt > scanned)
+	    eol = memchr(rp->rio_bufptr + scanned, '\n', cnt - scanned);
+	if (eol) {
+	    len = eol - rp->rio_bufptr + 1;
+	    break;
+	}
+	scanned = cnt;
+	if (scanned == sizeof(rp->rio_buf)) { /* line fills the buffer */
+	    len = scanned;
+	    break;
+	}
+
+	/* Shift the partial line to the front and refill behind it */
+	if (rp->rio_bufptr != rp->rio_buf && scanned > 0)
+	    memmove(rp->rio_buf, rp->rio_bufptr, scanned);
+	rp->rio_bufptr = rp->rio_buf;
+	rp->rio_cnt = scanned;
+	nread = read(rp->rio_fd, rp->rio_buf + scanned, 
+		     sizeof(rp->rio_buf) - scanned);
+	if (nread < 0) {
+	    if (errno != EINTR) /* interrupted by sig handler return */
+		return -1;
+	}
+	else if (nread == 0) {  /* EOF, return the unterminated tail */
+	    len = scanned;
+	    break;
+	}
+	else
+	    rp->rio_cnt += nread;
+    }
+
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += len;
+    rp->rio_cnt -= len;
+    return len;
+}
+/* $end rio_readlinep */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -716,6 +791,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readlinep(rio_t *rp, char **linep) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlinep(rp, linep)) < 0)
+	unix_error("Rio_readlinep error");
+    return rc;
+} 
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -0,0 +1,133 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // the tail is always emitted as literals
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t Read32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t Hash32(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write the extra bytes of a length that did not fit in its nibble
+static char *PutLength(char *op, char *oend, size_t len) {
+  for (; len >= 255; len -= 255) {
+    if (op >= oend) return NULL;
+    *op++ = (char)255;
+  }
+  if (op >= oend) return NULL;
+  *op++ = (char)len;
+  return op;
+}
+
+// Emit one sequence. match_len == 0 emits the final literals only.
+static char *PutSequence(char *op, char *oend, const char *lit, size_t lit_len,
+                         size_t offset, size_t match_len) {
+  if (op >= oend) return NULL;
+  char *token = op++;
+  size_t ml = match_len ? match_len - MIN_MATCH : 0;
+  *token = (char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+
+  if (lit_len >= 15 && !(op = PutLength(op, oend, lit_len - 15))) return NULL;
+  if ((size_t)(oend - op) < lit_len) return NULL;
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (!match_len) return op;
+
+  if (oend - op < 2) return NULL;
+  *op++ = (char)(offset & 0xff);
+  *op++ = (char)(offset >> 8);
+  if (ml >= 15 && !(op = PutLength(op, oend, ml - 15))) return NULL;
+  return op;
+}
+
+size_t LZCompress(const char *src, size_t n, char *dst, size_t cap) {
+  uint32_t table[1 << HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  char *op = dst, *oend = dst + cap;
+  size_t ip = 0, anchor = 0;
+  size_t limit = n > MIN_MATCH + LAST_LITERALS ? n - MIN_MATCH - LAST_LITERALS : 0;
+
+  while (ip < limit) {
+    uint32_t seq = Read32(src + ip);
+    uint32_t h = Hash32(seq);
+    size_t ref = table[h];
+    table[h] = ip;
+    if (ref >= ip || ip - ref > MAX_OFFSET || Read32(src + ref) != seq) {
+      ++ip;
+      continue;
+    }
+
+    size_t match_len = MIN_MATCH;
+    while (ip + match_len < n - LAST_LITERALS &&
+           src[ref + match_len] == src[ip + match_len]) {
+      ++match_len;
+    }
+    op = PutSequence(op, oend, src + anchor, ip - anchor, ip - ref, match_len);
+    if (!op) return 0;
+    ip += match_len;
+    anchor = ip;
+  }
+
+  op = PutSequence(op, oend, src + anchor, n - anchor, 0, 0);
+  return op ? op - dst : 0;
+}
+
+// Read the extra bytes of a length whose nibble was 15
+static const char *GetLength(const char *ip, const char *iend, size_t *len) {
+  unsigned char b;
+  do {
+    if (ip >= iend) return NULL;
+    b = (unsigned char)*ip++;
+    *len += b;
+  } while (b == 255);
+  return ip;
+}
+
+ssize_t LZDecompress(const char *src, size_t n, char *dst, size_t cap) {
+  const char *ip = src, *iend = src + n;
+  char *op = dst, *oend = dst + cap;
+
+  while (ip < iend) {
+    unsigned char token = (unsigned char)*ip++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !(ip = GetLength(ip, iend, &lit_len))) return -1;
+    if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len) {
+      return -1;
+    }
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == iend) break;  // final literals
+
+    if (iend - ip < 2) return -1;
+    size_t offset = (unsigned char)ip[0] | ((unsigned char)ip[1] << 8);
+    ip += 2;
+    size_t match_len = token & 0xf;
+    if (match_len == 15 && !(ip = GetLength(ip, iend, &match_len))) return -1;
+    match_len += MIN_MATCH;
+    if (!offset || offset > (size_t)(op - dst) ||
+        (size_t)(oend - op) < match_len) {
+      return -1;
+    }
+
+    // the match may overlap the bytes it produces
+    const char *ref = op - offset;
+    if (offset >= match_len) {
+      memcpy(op, ref, match_len);
+      op += match_len;
+    } else {
+      while (match_len--) *op++ = *ref++;
+    }
+  }
+  return op - dst;
+}
@@ -0,0 +1,30 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+#include <stddef.h>
+#include <sys/types.h>
+
+// A small LZ77 block codec in the style of LZ4, used to keep text objects
+// compressed inside the proxy cache.
+// Block format, a list of sequences:
+//  <1> token : high nibble literal length, low nibble match length - 4.
+//      A nibble of 15 is followed by extra length bytes, each added to the
+//      length, until a byte < 255
+//  <2> literals
+//  <3> offset : 2 bytes little endian, distance back to the match
+//  <4> extra match length bytes
+// The last sequence has literals only and ends at the end of the block.
+
+// Worst case compressed size of n bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress n bytes of src into dst
+// 1. Output:
+//  <1> ret : compressed size, 0 if the result does not fit into cap bytes
+size_t LZCompress(const char *src, size_t n, char *dst, size_t cap);
+
+// Decompress a block of n bytes into dst
+// 1. Output:
+//  <1> ret : decompressed size, -1 if the block is corrupt or the output
+//      does not fit into cap bytes
+ssize_t LZDecompress(const char *src, size_t n, char *dst, size_t cap);
+#endif
@@ -15,9 +15,33 @@
             (1) Parse Response and get the necessary info for logging
  */
 #include "xnix_helper.h"
+#include "cache.h"
 #include <stdarg.h>
 #include <assert.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #define MAXLINE 8192
+#define MAX_WORKERS 64
+#define KEEPALIVE_MS 3000  // close idle browser connections after this
+#define MAX_REQUEST_SIZE (64 * 1024)
+#define REQUEST_TIMEOUT_MS 3000  // a browser stalling mid-request is dropped
+
+// Flow control of a response streamed from the origin to the browser. The
+// origin is not read while more than RELAY_HIGH_WATER bytes wait for the
+// browser, and reading resumes once they drained to RELAY_LOW_WATER.
+#define RELAY_HIGH_WATER (64 * 1024)
+#define RELAY_LOW_WATER (16 * 1024)
+#define RELAY_READ_SIZE (16 * 1024)
+#define RELAY_BUFFER_SIZE (RELAY_HIGH_WATER + RELAY_READ_SIZE)
+#define RELAY_TIMEOUT_MS 30000  // a response making no progress is dropped
+// A relay holds its outbound buffer and the copy of the object for the cache
+#define RELAY_RESERVE (RELAY_BUFFER_SIZE + MAX_OBJECT_SIZE + 1)
+
+// Bytes all connections together may hold (messages, requests, relays).
+// New connections and cache misses wait up to BUDGET_WAIT_MS for memory,
+// then they are shed with a 503.
+#define MEMORY_BUDGET (16 << 20)
+#define BUDGET_WAIT_MS 1000
 void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size);
 typedef struct {
   char *path;
@@ -40,83 +64,1036 @@ void DispHTTPRequestStruct(const HTTPRequest *request);
 void InitHTTPResponse(HTTPResponse *ptr);
 void FreeHTTPREsponse(HTTPResponse *ptr);
 
-char *GetBroswerRequest(int sock_fd, size_t *rec_size, HTTPRequest *request);
 int ForwardBroswerRequest(int sock_fd, const char *request, size_t size);
-char *GetHostResponse(int sock_fd, size_t *rec_size, HTTPResponse *response);
-int ForwardHostResponse(int sock_fd, const char *response, size_t size);
 
 void ClientError(void);
-int IsTransferEnd(const char *ptr_beg, const char *ptr_end);
+int HexToNum(char ch);
+
+// Incremental parser of a chunked body, fed as the bytes arrive
+typedef enum {
+  CHUNK_SIZE = 0,      // hex size, then extensions up to the line end
+  CHUNK_DATA = 1,
+  CHUNK_DATA_END = 2,  // CRLF after the data
+  CHUNK_TRAILER = 3,   // trailer lines up to an empty line
+  CHUNK_DONE = 4
+}ChunkState;
+
+typedef struct {
+  ChunkState state;
+  size_t left;         // CHUNK_SIZE: size so far, CHUNK_DATA: bytes left
+  int in_extension;
+  size_t line_len;     // CHUNK_TRAILER: length of the current line
+}ChunkParser;
+
+size_t ChunkParse(ChunkParser *parser, const char *data, size_t size);
+
+// How the end of a response body is found
+typedef enum {
+  BODY_NONE = 0,         // 1xx, 204, 304
+  BODY_LENGTH = 1,       // Content-Length
+  BODY_CHUNKED = 2,
+  BODY_UNTIL_CLOSE = 3
+}BodyFraming;
+
+// A response being streamed from the origin to the browser, see RelayStep
+typedef struct {
+  int host_fd;
+  char *key;             // the object's cache key, owned, and its hash
+  uint32_t hash;
+  HTTPResponse response;
+  char *buf;             // buf[sent, filled) waits for the browser
+  size_t sent;
+  size_t filled;
+  char *cache_buf;       // copy of the response for the cache
+  size_t cache_size;
+  int cacheable;
+  size_t header_size;    // 0 until the header is complete
+  BodyFraming framing;
+  size_t body_left;
+  ChunkParser chunks;
+  int origin_done;
+  int paused;
+}Relay;
+
+typedef enum {
+  RELAY_RUNNING = 0,
+  RELAY_DONE = 1,        // the whole response went out to the browser
+  RELAY_FAILED = 2
+}RelayState;
+
+Relay *RelayStart(int host_fd, char *key, uint32_t hash);
+void RelayEvents(const Relay *relay, short *host_events, short *broswer_events);
+RelayState RelayStep(Relay *relay, int broswer_fd, short host_revents,
+                     short broswer_revents);
+
+// Memory accounting shared by all threads, see MEMORY_BUDGET
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+  size_t used;
+  size_t peak;
+  size_t shed;    // connections and requests refused for lack of memory
+}MemoryBudget;
+
+int BudgetAcquire(size_t size, size_t headroom, int timeout_ms);
+void BudgetCharge(size_t size);
+void BudgetRelease(size_t size);
+void BudgetShed(int sock_fd);
+
+// One "first-last" part of a Range: bytes= header, both ends inclusive
+#define MAX_RANGES 16
+typedef struct {
+  long long first;  // -1 for a suffix range "-n", last is then n
+  long long last;   // -1 for an open range "n-"
+}ByteRange;
+
+int GetHeaderValue(const char *message, const char *name, char *value,
+                   size_t size);
+int ParseRangeHeader(const char *request, ByteRange *ranges, int max);
+int ResolveRanges(ByteRange *ranges, int n, size_t total);
+void CacheRangeResponse(CacheShard *cache, const char *key, uint32_t hash,
+                        const char *response, size_t size);
+
+/*
+    Threading and cache layout
+    Every worker thread is pinned to one cpu and owns one cache shard. A
+    request is served by the worker owning the shard of its key, so a shard
+    is only ever touched by one thread and needs no lock:
+        1. main thread accepts a connection and posts it to a worker
+        2. that worker reads one request and hashes its key
+            (1) key owned by this worker: serve it from the local shard
+            (2) otherwise: post the request to the owner's mailbox
+        3. after serving, the owner keeps the connection for the next
+           request (keep-alive) and repeats step 2
+    The mailboxes are the only state shared between workers. A worker waits
+    in one poll on its connections and on the eventfd its mailbox signals
+    when a message is posted. It never blocks on a browser: requests are
+    read as their bytes arrive, responses the browser does not take at once
+    are queued, and a relay from the origin moves one step per poll event.
+    So a slow browser holds up its own connection, never the shard.
+ */
+typedef struct Message {
+  int fd;                // browser connection, non-blocking
+  rio_t rio;             // its read buffer, kept across keep-alive requests
+  char *request_buf;     // the request so far, whole once request_done is set
+  size_t request_size;
+  size_t request_cap;    // bytes allocated, and charged to the budget
+  int request_done;
+  HTTPRequest request;
+  char *key;
+  uint32_t hash;
+  Relay *relay;          // response streaming from the origin, or NULL
+  char *out;             // response bytes the browser did not take yet
+  size_t out_sent;
+  size_t out_size;
+  int keep_alive;        // reuse the connection once the response is out
+  long deadline;         // ms, a connection making no progress is closed then
+  short revents;         // of the last poll, on fd and on the relay's origin
+  short host_revents;
+  struct Message *next;
+}Message;
+
+// A message with this fd asks the worker to print its cache statistics
+#define REPORT_FD -1
+
+typedef struct {
+  pthread_mutex_t lock;
+  int ready_fd;          // eventfd, readable while messages were posted
+  Message *head;
+  Message *tail;
+}Mailbox;
+
+// Aligned so that no two workers share a cache line
+typedef struct {
+  pthread_t tid;
+  int cpu;
+  Mailbox box;
+  CacheShard cache;
+  Message **conns;       // connections between two poll events
+  int nconns;
+  int conn_cap;
+  struct pollfd *pfds;   // the mailbox, then the browser and origin of each
+} __attribute__((aligned(64))) Worker;
+
+static Worker workers[MAX_WORKERS];
+static int nworkers;
+
+void MailboxInit(Mailbox *box);
+void MailboxPush(Mailbox *box, Message *msg);
+Message *MailboxPop(Mailbox *box);
+void *WorkerThread(void *arg);
+void WorkerHandle(Worker *self, Message *msg);
+void WorkerStep(Worker *self, Message *msg);
+void WorkerPark(Worker *self, Message *msg);
+void WorkerPoll(Worker *self);
+int ReadRequest(Message *msg);
+int GetBroswerRequest(Message *msg);
+int ServeRequest(Worker *self, Message *msg);
+void FinishResponse(Worker *self, Message *msg);
+void RelayFinish(Worker *self, Message *msg, RelayState state);
+int SendToBroswer(Message *conn, const char *data, size_t size);
+int FlushToBroswer(Message *conn);
+void DropOutput(Message *conn);
+void ResetMessage(Message *msg);
+void CloseConnection(Message *msg);
+int ServeRanges(Message *conn, const char *content_type, size_t total,
+                ByteRange *ranges, int n, const char **parts);
+int ServeRangesFromBody(Message *conn, const char *response, size_t size,
+                        ByteRange *ranges, int n);
+int ServeRangesFromSegments(Message *conn, const CacheEntry *entry,
+                            ByteRange *ranges, int n);
+long NowMs(void);
+int IsCompressible(const char *response);
+void ReportHandler(int sig);
+
+static volatile sig_atomic_t report_requested = 0;
+
+static MemoryBudget budget = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0
+};
+
 int main(int argc, char **argv) {
   /* Check arguments */
   if (argc != 2) {
     fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
 	exit(0);
   }
+  // a browser closing early must not kill every worker
+  signal(SIGPIPE, SIG_IGN);
+
+  // kill -USR1 prints the cache statistics of every shard. Only the main
+  // thread takes the signal, workers inherit the blocked mask
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = ReportHandler;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL); // no SA_RESTART, wake up Accept
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
   int server_fd = CreateServerSocket(argv[1], AF_INET, 10);
   if (server_fd == -1) {
     exit(0);
   }
+
+  // one worker per cpu we are allowed to run on
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+    unix_error("sched_getaffinity");
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE && nworkers < MAX_WORKERS; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus)) {
+      workers[nworkers].cpu = cpu;
+      MailboxInit(&workers[nworkers].box);
+      ++nworkers;
+    }
+  }
+  for (int i = 0; i < nworkers; ++i) {
+    int ret = pthread_create(&workers[i].tid, NULL, WorkerThread, &workers[i]);
+    if (ret) {
+      posix_error(ret, "pthread_create");
+    }
+  }
+  DebugStr("Started %d workers\n", nworkers);
+  pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+
   char client_addr[120];
+  int next_worker = 0;
   while (1) {
     DebugStr("Waiting for broswer connection...\n");
     int broswer_fd = Accept(server_fd, -1, 0, client_addr);
-    int broswer_close_con = 0;
-    while (!broswer_close_con) {
-
-      DebugStr("Waiting for broswer request...\n");
-      HTTPRequest request;
-      size_t request_size = 0;
-      char *request_buf = GetBroswerRequest(broswer_fd, &request_size, &request);
-      if (!request_buf) {
-        FreeHTTPRequest(&request);
-        broswer_close_con = 1;
-        continue;
+    if (report_requested) {
+      report_requested = 0;
+      pthread_mutex_lock(&budget.lock);
+      fprintf(stderr, "memory budget: %zu/%d bytes used, peak %zu, shed %zu\n",
+              budget.used, MEMORY_BUDGET, budget.peak, budget.shed);
+      pthread_mutex_unlock(&budget.lock);
+      for (int i = 0; i < nworkers; ++i) {
+        Message *msg = Calloc(1, sizeof(Message));
+        msg->fd = REPORT_FD;
+        MailboxPush(&workers[i].box, msg);
       }
+    }
+    if (broswer_fd <= 0) {
+      continue;
+    }
+    // while memory is short new connections wait in the listen queue, the
+    // ones that waited too long are refused. Leave room for one relay so
+    // the connections already admitted can make progress
+    if (!BudgetAcquire(sizeof(Message), RELAY_RESERVE + MAX_REQUEST_SIZE,
+                       BUDGET_WAIT_MS)) {
+      BudgetShed(broswer_fd);
+      Close(broswer_fd);
+      continue;
+    }
+    // a worker must never wait for one browser
+    SetSockNonBlocking(broswer_fd);
+    Message *msg = Calloc(1, sizeof(Message));
+    msg->fd = broswer_fd;
+    rio_readinitb(&msg->rio, broswer_fd);
+    ResetMessage(msg);
+    msg->deadline = NowMs() + KEEPALIVE_MS;
+    MailboxPush(&workers[next_worker].box, msg);
+    next_worker = (next_worker + 1) % nworkers;
+  }
+  exit(0);
+}
+
+void *WorkerThread(void *arg) {
+  Worker *self = arg;
 
-      DebugStr("Received Broswer Request:\n");
-      DispHTTPRequestStruct(&request);
+  cpu_set_t cpu;
+  CPU_ZERO(&cpu);
+  CPU_SET(self->cpu, &cpu);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+  if (ret) {
+    posix_error(ret, "pthread_setaffinity_np");
+  }
+  // allocate the shard after pinning so its memory is local to this cpu
+  CacheShardInit(&self->cache, MAX_CACHE_SIZE / nworkers);
+  self->pfds = Malloc(sizeof(struct pollfd));
 
-      DebugStr("Trying to connect to host...\n");
-      int host_fd = ConnectTo(request.host, request.port, -1, 0);
-      FreeHTTPRequest(&request);
-      if (host_fd < 0) {
-        ClientError();
-        continue;
+  while (1) {
+    Message *msg;
+    while ((msg = MailboxPop(&self->box))) {
+      if (msg->fd != REPORT_FD && !msg->request_done) {
+        WorkerPark(self, msg); // a new connection, wait for its request
+      } else {
+        WorkerHandle(self, msg);
       }
+    }
+    WorkerPoll(self);
+  }
+  return NULL;
+}
+
+// A whole line of the next request is in the read buffer, poll would not
+// report it. A partial one waits for the rest to arrive
+static int LineBuffered(const Message *msg) {
+  return msg->rio.rio_cnt > 0 &&
+         memchr(msg->rio.rio_bufptr, '\n', msg->rio.rio_cnt);
+}
+
+// Act on a message posted to self, or on a connection waiting for a request
+// that became readable: read the request and serve it, or pass it to the
+// owner
+void WorkerHandle(Worker *self, Message *msg) {
+  if (msg->fd == REPORT_FD) {
+    CacheShardReport(&self->cache, stderr, self->cpu);
+    Free(msg);
+    return;
+  }
+  if (!msg->request_done) {
+    int ret = ReadRequest(msg);
+    if (ret < 0) {
+      WorkerPark(self, msg); // the rest of the request is still to come
+      return;
+    }
+    if (!ret) {
+      CloseConnection(msg);
+      return;
+    }
+    Worker *owner = &workers[msg->hash % nworkers];
+    if (owner != self) {
+      MailboxPush(&owner->box, msg);
+      return;
+    }
+  }
+
+  msg->keep_alive = ServeRequest(self, msg);
+  ResetMessage(msg);
+  FinishResponse(self, msg);
+}
+
+// Act on a connection taken out of the poll set: move its relay or its
+// queued response on, or read its next request. Close it if it made no
+// progress before its deadline
+void WorkerStep(Worker *self, Message *msg) {
+  long now = NowMs();
+  int waiting = !msg->relay && !msg->out;
+  if (!msg->revents && !msg->host_revents && now >= msg->deadline &&
+      !(waiting && LineBuffered(msg))) {
+    if (msg->relay) {
+      DebugStr("WorkerStep: relay timeout\n");
+      RelayFinish(self, msg, RELAY_FAILED);
+    }
+    CloseConnection(msg);
+    return;
+  }
+
+  if (msg->relay) {
+    RelayState state = RelayStep(msg->relay, msg->fd, msg->host_revents,
+                                 msg->revents);
+    if (state == RELAY_RUNNING) {
+      msg->deadline = now + RELAY_TIMEOUT_MS;
+      WorkerPark(self, msg);
+    } else {
+      RelayFinish(self, msg, state);
+      FinishResponse(self, msg);
+    }
+  } else if (msg->out) {
+    if ((msg->revents & (POLLERR | POLLHUP | POLLNVAL)) ||
+        !FlushToBroswer(msg)) {
+      CloseConnection(msg);
+    } else {
+      FinishResponse(self, msg);
+    }
+  } else {
+    WorkerHandle(self, msg);
+  }
+}
+
+// Keep a connection in the set self polls
+void WorkerPark(Worker *self, Message *msg) {
+  if (self->nconns == self->conn_cap) {
+    self->conn_cap = self->conn_cap ? 2 * self->conn_cap : 16;
+    self->conns = Realloc(self->conns, self->conn_cap * sizeof(Message *));
+    self->pfds = Realloc(self->pfds,
+                         (2 * self->conn_cap + 1) * sizeof(struct pollfd));
+  }
+  self->conns[self->nconns++] = msg;
+}
 
-      DebugStr("Trying to forward broswer request...\n");
-      if (!ForwardBroswerRequest(host_fd, request_buf, request_size)) {
-        DebugStr("Forward broswer error...\n");
-        Close(host_fd);
-        ClientError();
-        Free(request_buf);
-        continue;
+// Wait until a message is posted, a connection can make progress, or the
+// first deadline passes. Connection i polls its browser at pfds[2i + 1]
+// and the origin of its relay, if any, at pfds[2i + 2]
+void WorkerPoll(Worker *self) {
+  long now = NowMs();
+  int timeout = -1;
+  self->pfds[0] = (struct pollfd){self->box.ready_fd, POLLIN, 0};
+  for (int i = 0; i < self->nconns; ++i) {
+    Message *msg = self->conns[i];
+    struct pollfd *pfd = &self->pfds[2 * i + 1];
+    pfd[0] = (struct pollfd){msg->fd, 0, 0};
+    pfd[1] = (struct pollfd){-1, 0, 0};
+    if (msg->relay) {
+      RelayEvents(msg->relay, &pfd[1].events, &pfd[0].events);
+      pfd[1].fd = msg->relay->host_fd;
+    } else if (msg->out) {
+      pfd[0].events = POLLOUT;
+    } else {
+      pfd[0].events = POLLIN;
+    }
+    long left = msg->deadline - now;
+    // a request pipelined behind the last one is already buffered
+    if (left < 0 || (pfd[0].events == POLLIN && LineBuffered(msg))) {
+      left = 0;
+    }
+    if (timeout < 0 || left < timeout) timeout = left;
+  }
+  if (poll(self->pfds, 2 * self->nconns + 1, timeout) < 0 && errno != EINTR) {
+    unix_error("WorkerPoll: poll");
+  }
+
+  // take the connections with something to do out of the set, then act on
+  // them, as that may park them again
+  Message *ready = NULL, **tail = &ready;
+  now = NowMs();
+  int left = 0;
+  for (int i = 0; i < self->nconns; ++i) {
+    Message *msg = self->conns[i];
+    struct pollfd *pfd = &self->pfds[2 * i + 1];
+    msg->revents = pfd[0].revents;
+    msg->host_revents = pfd[1].revents;
+    if (msg->revents || msg->host_revents || now >= msg->deadline ||
+        (pfd[0].events == POLLIN && LineBuffered(msg))) {
+      *tail = msg;
+      tail = &msg->next;
+    } else {
+      self->conns[left++] = msg;
+    }
+  }
+  self->nconns = left;
+  *tail = NULL;
+  while (ready) {
+    Message *msg = ready;
+    ready = msg->next;
+    WorkerStep(self, msg);
+  }
+}
+
+// Read as much of the next request of a connection as arrived, and compute
+// its cache key once it is complete
+// 1. Output:
+//  <1> ret : 1 if the request is complete, -1 if the rest is still to come,
+//      0 if the browser closed the connection or sent a bad request
+int ReadRequest(Message *msg) {
+  if (!msg->request_size) {
+    DebugStr("Waiting for broswer request...\n");
+    msg->deadline = NowMs() + REQUEST_TIMEOUT_MS;
+  }
+  int ret = GetBroswerRequest(msg);
+  if (ret <= 0) {
+    return ret;
+  }
+  DebugStr("Received Broswer Request:\n");
+  DispHTTPRequestStruct(&msg->request);
+
+  size_t key_size = strlen(msg->request.host) + strlen(msg->request.port) +
+                    strlen(msg->request.path) + 2;
+  msg->key = Malloc(key_size);
+  snprintf(msg->key, key_size, "%s:%s%s", msg->request.host,
+           msg->request.port, msg->request.path);
+  msg->hash = CacheHash(msg->key);
+  return 1;
+}
+
+// Serve a request whose key belongs to self's shard. A hit is sent, or
+// queued on msg; a miss starts msg->relay, which the worker moves on
+// 1. Output:
+//  <1> ret : 1 if the browser connection can be reused, 0 otherwise
+int ServeRequest(Worker *self, Message *msg) {
+  ByteRange ranges[MAX_RANGES];
+  int nranges = ParseRangeHeader(msg->request_buf, ranges, MAX_RANGES);
+  const CacheEntry *entry = CacheShardLookup(&self->cache, msg->key, msg->hash);
+  if (entry && entry->sparse) {
+    // a partially cached object can serve ranges it fully covers
+    if (nranges) {
+      int ret = ServeRangesFromSegments(msg, entry, ranges, nranges);
+      if (ret >= 0) {
+        DebugStr("Cache range hit on cpu %d: %s\n", self->cpu, msg->key);
+        return ret;
       }
-      Free(request_buf);
-
-      HTTPResponse response;
-      size_t response_size = 0;
-      char *response_buf = GetHostResponse(host_fd, &response_size, &response);
-      if (!response_buf) {
-        ClientError();
-        Close(host_fd);
-        FreeHTTPREsponse(&response);
-        continue;
+    }
+  } else if (entry) {
+    const char *data = CacheShardData(&self->cache, entry);
+    if (data) {
+      DebugStr("Cache hit on cpu %d: %s\n", self->cpu, msg->key);
+      if (nranges) {
+        return ServeRangesFromBody(msg, data, entry->raw_size,
+                                   ranges, nranges);
       }
-      FreeHTTPREsponse(&response);
+      return SendToBroswer(msg, data, entry->raw_size);
+    }
+  }
 
-      if (!ForwardHostResponse(broswer_fd, response_buf, response_size)) {
-        DebugStr("Forward Host response error...\n");
-        Free(response_buf);
-        break;
+  if (!BudgetAcquire(RELAY_RESERVE, 0, BUDGET_WAIT_MS)) {
+    DebugStr("Memory budget exhausted, shedding %s\n", msg->key);
+    BudgetShed(msg->fd);
+    return 0;
+  }
+
+  DebugStr("Trying to connect to host...\n");
+  int host_fd = ConnectTo(msg->request.host, msg->request.port, -1, 0);
+  if (host_fd < 0) {
+    BudgetRelease(RELAY_RESERVE);
+    ClientError();
+    return 1;
+  }
+
+  DebugStr("Trying to forward broswer request...\n");
+  if (!ForwardBroswerRequest(host_fd, msg->request_buf, msg->request_size)) {
+    DebugStr("Forward broswer error...\n");
+    Close(host_fd);
+    BudgetRelease(RELAY_RESERVE);
+    ClientError();
+    return 1;
+  }
+
+  msg->relay = RelayStart(host_fd, msg->key, msg->hash);
+  msg->key = NULL; // the relay caches the response under it
+  return 1;
+}
+
+// Park a connection whose response is still going out, or that waits for
+// its next request, close it otherwise
+void FinishResponse(Worker *self, Message *msg) {
+  if (msg->relay || msg->out) {
+    msg->deadline = NowMs() + RELAY_TIMEOUT_MS;
+    WorkerPark(self, msg);
+  } else if (msg->keep_alive) {
+    msg->deadline = NowMs() + KEEPALIVE_MS;
+    WorkerPark(self, msg);
+  } else {
+    CloseConnection(msg);
+  }
+}
+
+// Close the origin side of a finished relay and cache what it fetched
+void RelayFinish(Worker *self, Message *msg, RelayState state) {
+  Relay *relay = msg->relay;
+  int ok = state == RELAY_DONE;
+  Close(relay->host_fd);
+  if (!ok) {
+    DebugStr("Relay Host response error...\n");
+  }
+  const char *status = relay->response.status;
+  if (ok && relay->cacheable && status) {
+    relay->cache_buf[relay->cache_size] = '\0';
+    if (strstr(status, " 200 ")) {
+      CacheShardInsert(&self->cache, relay->key, relay->hash, relay->cache_buf,
+                       relay->cache_size, IsCompressible(relay->cache_buf));
+    } else if (strstr(status, " 206 ")) {
+      CacheRangeResponse(&self->cache, relay->key, relay->hash,
+                         relay->cache_buf, relay->cache_size);
+    }
+  }
+  // without a length the browser can only find the end when we close
+  msg->keep_alive = ok && relay->framing != BODY_UNTIL_CLOSE;
+
+  Free(relay->buf);
+  Free(relay->cache_buf);
+  Free(relay->key);
+  FreeHTTPREsponse(&relay->response);
+  Free(relay);
+  msg->relay = NULL;
+  BudgetRelease(RELAY_RESERVE);
+}
+
+// Send a response to the browser without blocking. What the browser does
+// not take now is queued on the connection, the worker sends it as the
+// browser drains
+// 1. Output:
+//  <1> ret : 1 if sent or queued, 0 if the browser closed the connection
+int SendToBroswer(Message *conn, const char *data, size_t size) {
+  if (!conn->out) {
+    ssize_t n = send(conn->fd, data, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return 0;
       }
-      Free(response_buf);
-      Close(host_fd);
+      n = 0;
+    }
+    data += n;
+    size -= n;
+    if (!size) {
+      return 1;
     }
-    Close(broswer_fd);
   }
-  exit(0);
+  BudgetCharge(size);
+  conn->out = Realloc(conn->out, conn->out_size + size);
+  memcpy(conn->out + conn->out_size, data, size);
+  conn->out_size += size;
+  return 1;
+}
+
+// Send more of the queued response, drop the queue once it is all out
+// 1. Output:
+//  <1> ret : 1 if success, 0 if the browser closed the connection
+int FlushToBroswer(Message *conn) {
+  ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                   conn->out_size - conn->out_sent, MSG_NOSIGNAL);
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+  conn->out_sent += n;
+  if (conn->out_sent == conn->out_size) {
+    DropOutput(conn);
+  }
+  return 1;
+}
+
+void DropOutput(Message *conn) {
+  if (conn->out) {
+    Free(conn->out);
+    BudgetRelease(conn->out_size);
+  }
+  conn->out = NULL;
+  conn->out_sent = 0;
+  conn->out_size = 0;
+}
+
+// Drop the request part of a message, keep the connection
+void ResetMessage(Message *msg) {
+  if (msg->request_buf) {
+    BudgetRelease(msg->request_cap);
+    Free(msg->request_buf);
+    FreeHTTPRequest(&msg->request);
+  }
+  if (msg->key) {
+    Free(msg->key);
+  }
+  msg->request_buf = NULL;
+  msg->request_size = 0;
+  msg->request_cap = 0;
+  msg->request_done = 0;
+  InitHTTPRequest(&msg->request);
+  msg->key = NULL;
+  msg->hash = 0;
+  msg->next = NULL;
+}
+
+// Close a connection that has no relay running
+void CloseConnection(Message *msg) {
+  ResetMessage(msg);
+  DropOutput(msg);
+  Close(msg->fd);
+  Free(msg);
+  BudgetRelease(sizeof(Message));
+}
+
+// Wait until size bytes fit in the budget with headroom bytes to spare, then
+// charge them
+// 1. Output:
+//  <1> ret : 1 if charged, 0 if the memory was not freed within timeout_ms
+int BudgetAcquire(size_t size, size_t headroom, int timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    ++deadline.tv_sec;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  int ok = 1;
+  pthread_mutex_lock(&budget.lock);
+  while (budget.used + size + headroom > MEMORY_BUDGET) {
+    if (pthread_cond_timedwait(&budget.freed, &budget.lock, &deadline)) {
+      ok = budget.used + size + headroom <= MEMORY_BUDGET;
+      break;
+    }
+  }
+  if (ok) {
+    budget.used += size;
+    if (budget.used > budget.peak) budget.peak = budget.used;
+  } else {
+    ++budget.shed;
+  }
+  pthread_mutex_unlock(&budget.lock);
+  return ok;
+}
+
+// Charge memory that is already in use, the budget may go over its limit
+void BudgetCharge(size_t size) {
+  pthread_mutex_lock(&budget.lock);
+  budget.used += size;
+  if (budget.used > budget.peak) budget.peak = budget.used;
+  pthread_mutex_unlock(&budget.lock);
+}
+
+void BudgetRelease(size_t size) {
+  pthread_mutex_lock(&budget.lock);
+  budget.used -= size;
+  pthread_cond_broadcast(&budget.freed);
+  pthread_mutex_unlock(&budget.lock);
+}
+
+// Tell the browser to come back later, never blocks
+void BudgetShed(int sock_fd) {
+  static const char response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+  send(sock_fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void MailboxInit(Mailbox *box) {
+  pthread_mutex_init(&box->lock, NULL);
+  box->ready_fd = eventfd(0, EFD_NONBLOCK);
+  if (box->ready_fd < 0) {
+    unix_error("eventfd");
+  }
+  box->head = box->tail = NULL;
+}
+
+void MailboxPush(Mailbox *box, Message *msg) {
+  msg->next = NULL;
+  pthread_mutex_lock(&box->lock);
+  if (box->tail) {
+    box->tail->next = msg;
+  } else {
+    box->head = msg;
+  }
+  box->tail = msg;
+  pthread_mutex_unlock(&box->lock);
+  uint64_t one = 1;
+  if (write(box->ready_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    unix_error("MailboxPush: write");
+  }
+}
+
+// Take the oldest message, never blocks
+// 1. Output:
+//  <1> ret : the message, NULL if the mailbox is empty
+Message *MailboxPop(Mailbox *box) {
+  pthread_mutex_lock(&box->lock);
+  Message *msg = box->head;
+  if (msg) {
+    box->head = msg->next;
+    if (!box->head) {
+      box->tail = NULL;
+    }
+  } else {
+    uint64_t count;  // empty, let the next poll wait for a push
+    if (read(box->ready_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      unix_error("MailboxPop: read");
+    }
+  }
+  pthread_mutex_unlock(&box->lock);
+  return msg;
+}
+
+// Copy the value of header name from the header block of message
+// 1. Output:
+//  <1> ret : 1 if found, else 0
+int GetHeaderValue(const char *message, const char *name, char *value,
+                   size_t size) {
+  const char *header_end = strstr(message, "\r\n\r\n");
+  size_t name_len = strlen(name);
+  const char *line = strstr(message, "\r\n");
+  while (line && line != header_end) {
+    line += 2;
+    if (!strncasecmp(line, name, name_len) && line[name_len] == ':') {
+      const char *beg = line + name_len + 1;
+      while (*beg == ' ') ++beg;
+      const char *end = strpbrk(beg, "\r\n");
+      size_t len = end ? (size_t)(end - beg) : strlen(beg);
+      if (len >= size) len = size - 1;
+      memcpy(value, beg, len);
+      value[len] = '\0';
+      return 1;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return 0;
+}
+
+// Parse "Range: bytes=0-99,200-,-50" from a request
+// 1. Output:
+//  <1> ret : number of ranges, 0 if there is no Range header or it is not
+//      a valid byte range set (the header is then ignored, as RFC 7233 says)
+int ParseRangeHeader(const char *request, ByteRange *ranges, int max) {
+  char value[MAXLINE];
+  if (!GetHeaderValue(request, "Range", value, sizeof(value)) ||
+      strncmp(value, "bytes=", 6)) {
+    return 0;
+  }
+
+  int n = 0;
+  char *save = NULL;
+  for (char *spec = strtok_r(value + 6, ",", &save); spec;
+       spec = strtok_r(NULL, ",", &save)) {
+    while (*spec == ' ') ++spec;
+    char *dash = strchr(spec, '-');
+    if (!dash || n == max) return 0;
+    char *end;
+    if (dash == spec) { // suffix range
+      ranges[n].first = -1;
+      ranges[n].last = strtoll(dash + 1, &end, 10);
+    } else {
+      ranges[n].first = strtoll(spec, &end, 10);
+      if (end != dash) return 0;
+      ranges[n].last = dash[1] && dash[1] != ' ' ?
+                       strtoll(dash + 1, &end, 10) : -1;
+      if (ranges[n].last == -1) end = dash + 1;
+    }
+    while (*end == ' ') ++end;
+    if (*end || ranges[n].first < -1 || ranges[n].last < -1 ||
+        (ranges[n].first >= 0 && ranges[n].last >= 0 &&
+         ranges[n].last < ranges[n].first)) {
+      return 0;
+    }
+    ++n;
+  }
+  return n;
+}
+
+// Clamp ranges to a body of total bytes and drop the unsatisfiable ones
+// 1. Output:
+//  <1> ret : number of ranges left
+int ResolveRanges(ByteRange *ranges, int n, size_t total) {
+  int left = 0;
+  for (int i = 0; i < n; ++i) {
+    long long first = ranges[i].first, last = ranges[i].last;
+    if (first == -1) {  // last n bytes
+      if (last == 0) continue;
+      first = (size_t)last < total ? (long long)total - last : 0;
+      last = (long long)total - 1;
+    } else if (last == -1 || (size_t)last >= total) {
+      last = (long long)total - 1;
+    }
+    if ((size_t)first >= total) continue;
+    ranges[left].first = first;
+    ranges[left].last = last;
+    ++left;
+  }
+  return left;
+}
+
+// Send a 206 response, multipart/byteranges when there is more than one
+// range, or 416 if n is 0. parts[i] holds the bytes of ranges[i]
+// 1. Output:
+//  <1> ret : 1 if sent or queued, 0 if the browser closed the connection
+int ServeRanges(Message *conn, const char *content_type, size_t total,
+                ByteRange *ranges, int n, const char **parts) {
+  const char *boundary = "PROXY_BYTERANGES";
+  // the Content-Type comes from the origin and may be up to MAXLINE long,
+  // size the headers after it so snprintf never truncates them
+  size_t header_max = strlen(content_type) + strlen(boundary) + 256;
+  char *header = Malloc(header_max * (n + 1));
+  int len, ok;
+  if (!n) {
+    len = snprintf(header, header_max,
+                   "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                   "Content-Range: bytes */%zu\r\n"
+                   "Content-Length: 0\r\n\r\n", total);
+    ok = SendToBroswer(conn, header, len);
+    Free(header);
+    return ok;
+  }
+  if (n == 1) {
+    size_t size = ranges[0].last - ranges[0].first + 1;
+    len = snprintf(header, header_max,
+                   "HTTP/1.1 206 Partial Content\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Range: bytes %lld-%lld/%zu\r\n"
+                   "Content-Length: %zu\r\n\r\n",
+                   content_type, ranges[0].first, ranges[0].last, total, size);
+    ok = SendToBroswer(conn, header, len) &&
+         SendToBroswer(conn, parts[0], size);
+    Free(header);
+    return ok;
+  }
+
+  // every part is "\r\n--boundary\r\n<part header>\r\n\r\n<bytes>", part i's
+  // header is at header + (i + 1) * header_max
+  int part_len[MAX_RANGES];
+  size_t content_len = 0;
+  for (int i = 0; i < n; ++i) {
+    part_len[i] = snprintf(header + (i + 1) * header_max, header_max,
+                           "\r\n--%s\r\nContent-Type: %s\r\n"
+                           "Content-Range: bytes %lld-%lld/%zu\r\n\r\n",
+                           boundary, content_type, ranges[i].first,
+                           ranges[i].last, total);
+    content_len += part_len[i] + ranges[i].last - ranges[i].first + 1;
+  }
+  char trailer[64];
+  int trailer_len = snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n",
+                             boundary);
+  content_len += trailer_len;
+
+  len = snprintf(header, header_max,
+                 "HTTP/1.1 206 Partial Content\r\n"
+                 "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                 "Content-Length: %zu\r\n\r\n", boundary, content_len);
+  ok = SendToBroswer(conn, header, len);
+  for (int i = 0; ok && i < n; ++i) {
+    ok = SendToBroswer(conn, header + (i + 1) * header_max,
+                       part_len[i]) &&
+         SendToBroswer(conn, parts[i], ranges[i].last - ranges[i].first + 1);
+  }
+  ok = ok && SendToBroswer(conn, trailer, trailer_len);
+  Free(header);
+  return ok;
+}
+
+// Serve ranges out of a fully cached 200 response. Only a body framed by
+// Content-Length is the object's bytes as they are, any other response (a
+// chunked one) is sent whole, which a client asking for ranges accepts
+int ServeRangesFromBody(Message *conn, const char *response, size_t size,
+                        ByteRange *ranges, int n) {
+  const char *end = memmem(response, size, "\r\n\r\n", 4);
+  if (!end) {
+    return SendToBroswer(conn, response, size);
+  }
+  size_t header_size = end + 4 - response;
+  const char *body = response + header_size;
+  size_t body_size = size - header_size;
+
+  // cached objects are not null terminated, look at a copy of the header
+  char *header = Malloc(header_size + 1);
+  memcpy(header, response, header_size);
+  header[header_size] = '\0';
+  char value[MAXLINE], content_type[MAXLINE];
+  int framed = !GetHeaderValue(header, "Transfer-Encoding", value,
+                               sizeof(value)) &&
+               GetHeaderValue(header, "Content-Length", value,
+                              sizeof(value)) &&
+               strtoull(value, NULL, 10) == body_size;
+  if (!GetHeaderValue(header, "Content-Type", content_type,
+                      sizeof(content_type))) {
+    strcpy(content_type, "application/octet-stream");
+  }
+  Free(header);
+  if (!framed) {
+    return SendToBroswer(conn, response, size);
+  }
+
+  const char *parts[MAX_RANGES];
+  n = ResolveRanges(ranges, n, body_size);
+  for (int i = 0; i < n; ++i) {
+    parts[i] = body + ranges[i].first;
+  }
+  return ServeRanges(conn, content_type, body_size, ranges, n, parts);
+}
+
+// Serve ranges out of the segments of a sparse entry
+// 1. Output:
+//  <1> ret : -1 if some range is not cached, else as ServeRanges
+int ServeRangesFromSegments(Message *conn, const CacheEntry *entry,
+                            ByteRange *ranges, int n) {
+  const char *parts[MAX_RANGES];
+  n = ResolveRanges(ranges, n, entry->total_size);
+  if (!n) {
+    return -1; // let the origin answer, the object may have grown
+  }
+  for (int i = 0; i < n; ++i) {
+    parts[i] = CacheEntryRange(entry, ranges[i].first,
+                               ranges[i].last - ranges[i].first + 1);
+    if (!parts[i]) {
+      return -1;
+    }
+  }
+  return ServeRanges(conn, entry->content_type, entry->total_size,
+                     ranges, n, parts);
+}
+
+// Keep the body of a single part 206 response from the origin as a segment
+void CacheRangeResponse(CacheShard *cache, const char *key, uint32_t hash,
+                        const char *response, size_t size) {
+  char content_range[MAXLINE], content_type[MAXLINE];
+  unsigned long long first, last, total;
+  if (!GetHeaderValue(response, "Content-Range", content_range,
+                      sizeof(content_range)) ||
+      sscanf(content_range, "bytes %llu-%llu/%llu", &first, &last,
+             &total) != 3) {
+    return; // multipart, or unknown total length
+  }
+  if (!GetHeaderValue(response, "Content-Type", content_type,
+                      sizeof(content_type))) {
+    strcpy(content_type, "application/octet-stream");
+  }
+  const char *body = strstr(response, "\r\n\r\n");
+  if (!body || last < first) {
+    return;
+  }
+  body += 4;
+  size_t body_size = size - (body - response);
+  if (body_size != last - first + 1) {
+    return;
+  }
+  CacheShardInsertSegment(cache, key, hash, content_type, total,
+                          first, body, body_size);
+}
+
+void ReportHandler(int sig) {
+  report_requested = 1;
+}
+
+// Text objects (html, css, js, json, xml, svg) are worth compressing
+int IsCompressible(const char *response) {
+  const char *header_end = strstr(response, "\r\n\r\n");
+  const char *type = strcasestr(response, "Content-Type: ");
+  if (!type || (header_end && type > header_end)) {
+    return 0;
+  }
+  type += 14;
+  return !strncmp(type, "text/", 5) ||
+         !strncmp(type, "application/json", 16) ||
+         !strncmp(type, "application/javascript", 22) ||
+         !strncmp(type, "application/xml", 15) ||
+         !strncmp(type, "image/svg+xml", 13);
+}
+
+long NowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*
@@ -198,7 +1175,7 @@ int HTTPRequestParser(const char *buffer, HTTPRequest *request) {
   }
 
   const char *port_start = host_end + 1;
-  const char *port_end = strchr(port_start, '\n');
+  const char *port_end = strpbrk(port_start, "\r\n");
   if (!port_end) {
     app_error("Parse port error\n");
     ClientError();
@@ -231,42 +1208,53 @@ void InitHTTPRequest(HTTPRequest *ptr) {
   ptr->connection = NULL;
 }
 
-char *GetBroswerRequest(int sock_fd, size_t *rec_size, HTTPRequest *request) {
-  InitHTTPRequest(request);
-
-  size_t req_buf_size = 1000;
-  char *request_buf = Malloc(req_buf_size);
-  char *read_buf = Malloc(1000);
-  *rec_size = 0;
-  int finish = 0;
-  while (!finish) {
-    size_t size = 1000;
-    if (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 3000, 0) == -1) {
+// Read the request line and the headers up to the empty line, as far as
+// they arrived. The lines are taken from the connection's read buffer
+// without an intermediate copy, and bytes the browser pipelined after the
+// request stay there for the next one
+// 1. Output:
+//  <1> ret : 1 if the request is complete and parsed, -1 if the rest has not
+//      arrived yet, 0 if the browser closed the connection or it is bad
+int GetBroswerRequest(Message *msg) {
+  while (1) {
+    char *line;
+    ssize_t len = rio_readlinep(&msg->rio, &line);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return -1; // a partial line stays in the read buffer
+    }
+    if (len <= 0) {
       DebugStr("GetBroswerRequest: broswer closed socket.\n");
-      Free(read_buf);
-      Free(request_buf);
-      return NULL;
+      return 0;
+    }
+    int empty = (len == 2 && line[0] == '\r') || (len == 1 && line[0] == '\n');
+    if (empty && !msg->request_size) {
+      continue; // a CRLF left over between keep-alive requests
     }
-    if (*rec_size + size >= req_buf_size) {
-      req_buf_size = *rec_size + size + 1000;
-      request_buf = Realloc(request_buf, req_buf_size);
+    if (msg->request_size + len > MAX_REQUEST_SIZE) {
+      DebugStr("GetBroswerRequest: request too large.\n");
+      return 0;
     }
-    strncpy(request_buf + *rec_size, read_buf, size);
-    *rec_size += size;
-    if (strstr(request_buf, "\r\n\r\n")) { // end of request
-      request_buf[*rec_size] = '\0';
-      Free(read_buf);
-      finish = 1;
+    if (msg->request_size + len >= msg->request_cap) {
+      size_t cap = 2 * (msg->request_size + len);
+      cap = cap < 1024 ? 1024 : cap;
+      BudgetCharge(cap - msg->request_cap);
+      msg->request_buf = Realloc(msg->request_buf, cap);
+      msg->request_cap = cap;
+    }
+    memcpy(msg->request_buf + msg->request_size, line, len);
+    msg->request_size += len;
+    if (empty) { // end of request
+      break;
     }
   }
+  msg->request_buf[msg->request_size] = '\0';
 
-  if (!HTTPRequestParser(request_buf, request)) {
+  if (!HTTPRequestParser(msg->request_buf, &msg->request)) {
     app_error("Parse HTTP Request Error.\n");
-    Free(request_buf);
-    return NULL;
+    return 0;
   }
-
-  return request_buf;
+  msg->request_done = 1;
+  return 1;
 }
 
 int ForwardBroswerRequest(int sock_fd, const char *request, size_t size) {
@@ -282,166 +1270,188 @@ void InitHTTPResponse(HTTPResponse *response) {
   response->size = NULL;
 }
 
-char *GetHostResponse(int sock_fd, size_t *rec_size, HTTPResponse *response) {
-  InitHTTPResponse(response);
-
-  size_t response_buf_size = 5000;
-  char *response_buf = Malloc(response_buf_size);
-  char *read_buf = Malloc(1000);
-  *rec_size = 0;
-
-  typedef enum {
-    WAIT_FOR_HEADER = 0,
-    PROCESS_HEADER = 1,
-    KNOW_CONTENT_LENGTH = 2,
-    CHUNKED_TRANS = 3
-  }State;
-
-  State state = WAIT_FOR_HEADER;
-  const char *header_tail = NULL;
-  size_t header_size = 0;
-  size_t content_size = 0;
-  size_t total_size = 0;
-  int finish = 0;
-  while (!finish) {
-    if (state == WAIT_FOR_HEADER) {
-      size_t size = 1000;
-      switch (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 30000, 0)) {
-        case 0:
-          DebugStr("GetHostResponse: Wait for header timeout\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-
-        case -1:
-          DebugStr("GetHostResponse: Host close socket\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-      }
-
-      if (*rec_size + size >= response_buf_size) {
-        response_buf_size = *rec_size + size + 1000;
-        response_buf = Realloc(response_buf, response_buf_size);
-      }
-      // Copy the newly received data
-      strncpy(response_buf + *rec_size, read_buf, size);
-      *rec_size += size;
-      response_buf[*rec_size] = '\0';
-      if ((header_tail = strstr(response_buf, "\r\n\r\n"))) {
-        header_tail += 2;
-        header_size = header_tail - response_buf;
-        state = PROCESS_HEADER;
-      }
-    } else if (state == PROCESS_HEADER) {
-      const char *content_size_b = strstr(response_buf, "Content-Length: ");
-      const char *trans_encoding_b = strstr(response_buf, "Transfer-Encoding: ");
-      if (!trans_encoding_b && !content_size_b) {
-        DebugStr("GetHostResponse: No Content-Length and Transfer-Encoding\n");
-        Free(read_buf);
-        Free(response_buf);
-        ClientError();
-        return NULL;
-      }
-      if (trans_encoding_b) {
-        state = CHUNKED_TRANS;
-      } else {
-        state = KNOW_CONTENT_LENGTH;
-        const char *content_size_e = strpbrk(content_size_b, "\r\n\0");
-        size_t content_size_sz = content_size_e - content_size_b;
-        strncpy(response->size = Malloc(content_size_sz + 1),
-                content_size_b, content_size_sz);
-        content_size = strtoul(response->size, NULL, 10);
-        total_size = header_size + 2 + content_size;
-      }
-    } else if (state == KNOW_CONTENT_LENGTH) {
-      size_t left = total_size - *rec_size;
-      if (!left) {
-        finish = 1;
-        continue;
-      }
-      size_t size = left > 1000 ? 1000 : left;
-      switch (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 3000, 0)) {
-        case 0:
-          DebugStr("GetHostResponse: Wait for content timeout\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-        case -1:
-          DebugStr("GetHostResponse: Host close socket.\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-      }
-      if (*rec_size + size >= response_buf_size) {
-        response_buf_size = *rec_size + size + 1000;
-        response_buf = Realloc(response_buf, response_buf_size);
-      }
-      strncpy(response_buf + *rec_size, read_buf, size);
-      *rec_size += size;
-    } else if (state == CHUNKED_TRANS) {
-
-      // Need a parser
-      if (IsTransferEnd(header_tail + 2, response_buf + *rec_size)) {
-        finish = 1;
-        continue;
-      }
-      size_t size = 1000;
-      switch (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 3000, 0)) {
-        case 0:
-          DebugStr("GetHostResponse: Wait for content timeout\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-        case -1:
-          DebugStr("GetHostResponse: Host close socket.\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-      }
-      if (*rec_size + size >= response_buf_size) {
-        response_buf_size = *rec_size + size + 1000;
-        response_buf = Realloc(response_buf, response_buf_size);
-      }
-      strncpy(response_buf + *rec_size, read_buf, size);
-      *rec_size += size;
-    }
-  }
-
-  // Get status
-  const char *status_end = strpbrk(response_buf, "\r\n\0");
-  size_t status_line_len = status_end - (const char*)response_buf;
+// Parse the header of a response, header_size bytes ending with the empty line
+static BodyFraming ParseResponseHeader(const char *header, size_t header_size,
+                                       HTTPResponse *response,
+                                       size_t *content_size) {
+  const char *status_end = memchr(header, '\r', header_size);
+  size_t status_line_len = status_end - header;
   strncpy(response->status = Malloc(status_line_len + 1),
-          response_buf, status_line_len);
+          header, status_line_len);
   response->status[status_line_len] = '\0';
 
-  // Get Date
-  const char *date_start = strstr(response_buf, "Date: ");
-  if (date_start) {
-    date_start += 6;
-    const char *date_end = strpbrk(date_start, "\r\n\0");
-    size_t date_size = date_end - date_start;
-    strncpy(response->date = Malloc(date_size + 1), date_start, date_size);
-    response->date[date_size] = '\0';
+  char value[MAXLINE];
+  if (GetHeaderValue(header, "Date", value, sizeof(value))) {
+    response->date = strdup(value);
+  }
+
+  const char *code = strchr(response->status, ' ');
+  int status = code ? atoi(code + 1) : 0;
+  if (status / 100 == 1 || status == 204 || status == 304) {
+    return BODY_NONE;
+  }
+  if (GetHeaderValue(header, "Transfer-Encoding", value, sizeof(value)) &&
+      strcasestr(value, "chunked")) {
+    return BODY_CHUNKED;
+  }
+  if (GetHeaderValue(header, "Content-Length", value, sizeof(value))) {
+    response->size = strdup(value);
+    *content_size = strtoul(value, NULL, 10);
+    return BODY_LENGTH;
   }
+  return BODY_UNTIL_CLOSE;
+}
+
+/*
+    Stream the response of the origin to the browser while it arrives
+        1. read the origin into the outbound buffer, at most
+           RELAY_BUFFER_SIZE bytes, until the header is complete
+        2. send the buffer to the browser and keep reading the origin
+            (1) stop reading when RELAY_HIGH_WATER bytes wait for the browser,
+                a slow browser then slows the origin down through TCP
+            (2) resume when they drained to RELAY_LOW_WATER
+        3. keep a copy of the response for the cache as long as it fits in
+           MAX_OBJECT_SIZE
+    So a relay never holds more than RELAY_RESERVE bytes, however large the
+    object and however slow the browser. It never blocks either: the worker
+    polls the two sockets for what RelayEvents asks and calls RelayStep
+    with the events it got, until the relay is done or failed.
+ */
+Relay *RelayStart(int host_fd, char *key, uint32_t hash) {
+  Relay *relay = Calloc(1, sizeof(Relay));
+  relay->host_fd = host_fd;
+  relay->key = key;
+  relay->hash = hash;
+  InitHTTPResponse(&relay->response);
+  relay->buf = Malloc(RELAY_BUFFER_SIZE);
+  relay->cache_buf = Malloc(MAX_OBJECT_SIZE + 1);
+  relay->cacheable = 1;
+  relay->framing = BODY_NONE;
+  relay->chunks = (ChunkParser){CHUNK_SIZE, 0, 0, 0};
+  return relay;
+}
 
-  Free(read_buf);
-  return response_buf;
+void RelayEvents(const Relay *relay, short *host_events, short *broswer_events) {
+  *host_events = !relay->origin_done && !relay->paused ? POLLIN : 0;
+  *broswer_events = relay->header_size && relay->filled > relay->sent ?
+                    POLLOUT : 0;
 }
 
-int ForwardHostResponse(int sock_fd, const char *response, size_t size) {
-  if (SocketSend(sock_fd, response, &size, -1, 0) <= 0) {
+// Read what the origin has into the outbound buffer
+// 1. Output:
+//  <1> ret : 1 if success, 0 if the origin failed
+static int RelayRead(Relay *relay) {
+  if (relay->header_size &&
+      relay->filled + RELAY_READ_SIZE > RELAY_BUFFER_SIZE) {
+    memmove(relay->buf, relay->buf + relay->sent, relay->filled - relay->sent);
+    relay->filled -= relay->sent;
+    relay->sent = 0;
+  }
+  size_t space = RELAY_BUFFER_SIZE - relay->filled;
+  if (!space) {
+    DebugStr("RelayRead: header too large.\n");
     return 0;
   }
+  ssize_t n = read(relay->host_fd, relay->buf + relay->filled,
+                   relay->header_size && space > RELAY_READ_SIZE ?
+                   RELAY_READ_SIZE : space);
+  if (n < 0) {
+    if (errno == EINTR || errno == EAGAIN) return 1;
+    DebugStr("RelayRead: read from host failed.\n");
+    return 0;
+  }
+  if (n == 0) {
+    if (relay->header_size && relay->framing == BODY_UNTIL_CLOSE) {
+      relay->origin_done = 1;
+      return 1;
+    }
+    DebugStr("RelayRead: Host close socket.\n");
+    return 0;
+  }
+
+  char *buf = relay->buf;
+  size_t old = relay->filled, body = relay->filled;
+  relay->filled += n;
+  if (!relay->header_size) {
+    size_t from = old > 3 ? old - 3 : 0;
+    const char *end = memmem(buf + from, relay->filled - from, "\r\n\r\n", 4);
+    if (!end) {
+      return 1;
+    }
+    size_t header_size = relay->header_size = end + 4 - buf;
+    char saved = buf[header_size - 1];
+    buf[header_size - 1] = '\0';  // GetHeaderValue wants a string
+    relay->framing = ParseResponseHeader(buf, header_size, &relay->response,
+                                         &relay->body_left);
+    buf[header_size - 1] = saved;
+    body = header_size;
+    if (relay->framing == BODY_NONE ||
+        (relay->framing == BODY_LENGTH && !relay->body_left)) {
+      relay->origin_done = 1;
+    }
+  }
+
+  // drop whatever the origin sent past the end of the body
+  if (relay->framing == BODY_NONE) {
+    relay->filled = relay->header_size;
+  } else if (relay->framing == BODY_LENGTH && !relay->origin_done) {
+    size_t size = relay->filled - body;
+    if (size >= relay->body_left) {
+      relay->filled = body + relay->body_left;
+      relay->origin_done = 1;
+    }
+    relay->body_left -= relay->filled - body;
+  } else if (relay->framing == BODY_CHUNKED && !relay->origin_done) {
+    relay->filled = body + ChunkParse(&relay->chunks, buf + body,
+                                      relay->filled - body);
+    relay->origin_done = relay->chunks.state == CHUNK_DONE;
+  }
+
+  size_t added = relay->filled - old;
+  if (relay->cacheable && relay->cache_size + added <= MAX_OBJECT_SIZE) {
+    memcpy(relay->cache_buf + relay->cache_size, buf + old, added);
+    relay->cache_size += added;
+  } else {
+    relay->cacheable = 0;
+  }
   return 1;
 }
 
+RelayState RelayStep(Relay *relay, int broswer_fd, short host_revents,
+                     short broswer_revents) {
+  if (broswer_revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    DebugStr("RelayStep: broswer closed socket.\n");
+    return RELAY_FAILED;
+  }
+  if ((host_revents & (POLLIN | POLLHUP | POLLERR)) && !RelayRead(relay)) {
+    return RELAY_FAILED;
+  }
+
+  // the browser is non-blocking, offer it what is there without waiting
+  // for POLLOUT
+  size_t pending = relay->filled - relay->sent;
+  if (relay->header_size && pending) {
+    ssize_t n = send(broswer_fd, relay->buf + relay->sent, pending,
+                     MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      DebugStr("RelayStep: send to broswer failed.\n");
+      return RELAY_FAILED;
+    }
+    if (n > 0) relay->sent += n;
+    if (relay->sent == relay->filled) relay->sent = relay->filled = 0;
+    pending = relay->filled - relay->sent;
+  }
+  if (relay->origin_done && !pending) {
+    return RELAY_DONE;
+  }
+  if (relay->paused && pending <= RELAY_LOW_WATER) {
+    relay->paused = 0;
+  } else if (!relay->paused && pending >= RELAY_HIGH_WATER) {
+    relay->paused = 1;
+  }
+  return RELAY_RUNNING;
+}
+
 void ClientError(void) {
   assert(NULL);
 }
@@ -450,27 +1460,65 @@ int HexToNum(char ch) {
   if (ch >= '0' && ch <= '9') {
     return ch - '0';
   }
-  return ch - 'A' + 10;
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  if (ch >= 'A' && ch <= 'F') {
+    return ch - 'A' + 10;
+  }
+  return -1;
 }
-// ptr_beg is the begin pointer of content
-// ptr_end is the end pointer of buffer
-int IsTransferEnd(const char *ptr_beg, const char *ptr_end) {
-  while (ptr_beg < ptr_end) {
-    const char *line_end = strstr(ptr_beg, "\r\n");
-    if (!line_end) {
-      break;
-    }
-    size_t sz_size = line_end - ptr_beg;
-    size_t chunk_size = 0;
-    for (int i = 0; i < sz_size; ++i) {
-      chunk_size = chunk_size * 16 + HexToNum(*(ptr_beg + i));
-    }
-    if (chunk_size == 0) {
-      return 1;
+
+// Feed size more bytes of a chunked body to the parser
+// 1. Output:
+//  <1> ret : bytes that belong to the body, less than size only if the body
+//      ended (parser->state is then CHUNK_DONE)
+size_t ChunkParse(ChunkParser *parser, const char *data, size_t size) {
+  size_t i = 0;
+  while (i < size && parser->state != CHUNK_DONE) {
+    char ch = data[i];
+    switch (parser->state) {
+      case CHUNK_SIZE:
+        ++i;
+        if (ch == '\n') {
+          parser->state = parser->left ? CHUNK_DATA : CHUNK_TRAILER;
+          parser->in_extension = 0;
+          parser->line_len = 0;
+        } else if (!parser->in_extension && HexToNum(ch) >= 0) {
+          parser->left = parser->left * 16 + HexToNum(ch);
+        } else if (ch != '\r') {
+          parser->in_extension = 1;
+        }
+        break;
+
+      case CHUNK_DATA: {
+        size_t n = size - i < parser->left ? size - i : parser->left;
+        i += n;
+        parser->left -= n;
+        if (!parser->left) parser->state = CHUNK_DATA_END;
+        break;
+      }
+
+      case CHUNK_DATA_END:
+        ++i;
+        if (ch == '\n') parser->state = CHUNK_SIZE;
+        break;
+
+      case CHUNK_TRAILER:
+        ++i;
+        if (ch == '\n') {
+          if (!parser->line_len) parser->state = CHUNK_DONE;
+          parser->line_len = 0;
+        } else if (ch != '\r') {
+          ++parser->line_len;
+        }
+        break;
+
+      case CHUNK_DONE:
+        break;
     }
-    ptr_beg += chunk_size;
   }
-  return 0;
+  return i;
 }
 
 void FreeHTTPREsponse(HTTPResponse *ptr) {
@@ -0,0 +1,138 @@
+/*
+ * riobench - Measure header line parsing throughput of the RIO layer
+ *
+ * A block of typical HTTP request headers is repeated into a temporary
+ * file, which is then read back line by line with
+ *   1. bytewise    : the old rio_readlineb loop, one 1-byte read per char
+ *   2. readlineb   : memchr based rio_readlineb, copies into a user buffer
+ *   3. readlinep   : zero copy rio_readlinep, returns a slice of rio_buf
+ *
+ * usage: riobench [MB of headers, default 64]
+ */
+#include "xnix_helper.h"
+#include <time.h>
+
+#define MAXLINE 8192
+
+static const char *header_block =
+  "GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\n"
+  "Host: www.cmu.edu\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-us,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Connection: keep-alive\r\n"
+  "Cookie: __utma=1.1234567890.1234567890.1234567890.1234567890.1; __utmz=1.1234567890.1.1.utmcsr=(direct)\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "\r\n";
+
+// The line reader before the memchr rewrite, built on the 1-byte rio_readnb
+static ssize_t rio_readlineb_bytewise(rio_t *rp, void *usrbuf, size_t maxlen) {
+  int n, rc;
+  char c, *bufp = usrbuf;
+  for (n = 1; n < maxlen; ++n) {
+    if ((rc = rio_readnb(rp, &c, 1)) == 1) {
+      *bufp++ = c;
+      if (c == '\n') {
+        break;
+      }
+    } else if (rc == 0) {
+      if (n == 1) return 0;
+      else break;
+    } else {
+      return -1;
+    }
+  }
+  *bufp = '\0';
+  return n;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef enum {
+  BYTEWISE = 0,
+  READLINEB = 1,
+  READLINEP = 2
+}Reader;
+
+// Read the whole file once, return the number of lines. *sum folds the
+// first byte of every line so the work cannot be optimized away.
+static size_t read_all(int fd, Reader reader, unsigned *sum) {
+  static rio_t rio;
+  char line[MAXLINE];
+  char *linep;
+  size_t lines = 0;
+  ssize_t n;
+
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    unix_error("lseek");
+  }
+  rio_readinitb(&rio, fd);
+  for (;;) {
+    if (reader == BYTEWISE) {
+      n = rio_readlineb_bytewise(&rio, line, MAXLINE);
+      linep = line;
+    } else if (reader == READLINEB) {
+      n = rio_readlineb(&rio, line, MAXLINE);
+      linep = line;
+    } else {
+      n = rio_readlinep(&rio, &linep);
+    }
+    if (n <= 0) break;
+    *sum += (unsigned char)linep[0];
+    ++lines;
+  }
+  return lines;
+}
+
+int main(int argc, char **argv) {
+  size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+  size_t total = mb << 20;
+  size_t block_len = strlen(header_block);
+
+  char path[] = "/tmp/riobenchXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    unix_error("mkstemp");
+  }
+  unlink(path);
+
+  size_t written = 0;
+  char *chunk = Malloc(1 << 20);
+  size_t chunk_len = 0;
+  while (chunk_len + block_len <= (1 << 20)) {
+    memcpy(chunk + chunk_len, header_block, block_len);
+    chunk_len += block_len;
+  }
+  while (written < total) {
+    if (rio_writen(fd, chunk, chunk_len) < 0) {
+      unix_error("write");
+    }
+    written += chunk_len;
+  }
+  Free(chunk);
+
+  const char *names[] = {"bytewise", "readlineb", "readlinep"};
+  printf("%-10s %10s %10s %12s\n", "reader", "MB/s", "Mlines/s", "lines");
+  unsigned sum = 0;
+  read_all(fd, READLINEP, &sum); // warm the page cache
+  for (int r = BYTEWISE; r <= READLINEP; ++r) {
+    double best = 0;
+    size_t lines = 0;
+    for (int rep = 0; rep < 3; ++rep) {
+      double beg = now_sec();
+      lines = read_all(fd, r, &sum);
+      double t = now_sec() - beg;
+      if (!best || t < best) best = t;
+    }
+    printf("%-10s %10.1f %10.2f %12zu\n", names[r],
+           written / best / (1 << 20), lines / best / 1e6, lines);
+  }
+  fprintf(stderr, "checksum %u\n", sum);
+  Close(fd);
+  return 0;
+}
@@ -43,6 +43,14 @@ void *Realloc(void *ptr, size_t size) {
   return p;
 }
 
+void *Calloc(size_t nmemb, size_t size) {
+  void *p;
+  if ((p = calloc(nmemb, size)) == NULL) {
+    unix_error("Calloc error");
+  }
+  return p;
+}
+
 void Free(void *ptr) {
   free(ptr);
 }
@@ -96,10 +104,10 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
   return n;
 }
 
+// Refill the internal buffer if it is empty
 // return value:
-// on success return the actaully bytes read, otherwise return -1
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-  int cnt;
+// on success return the unread bytes in the buffer, 0 on EOF, -1 on error
+static ssize_t rio_fill(rio_t *rp) {
   while (rp->rio_cnt <= 0) { // Refill if the buf is empty
     rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFFER);
 
@@ -111,6 +119,17 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
       rp->rio_bufptr = rp->rio_buf;
     }
   }
+  return rp->rio_cnt;
+}
+
+// return value:
+// on success return the actaully bytes read, otherwise return -1
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+  int cnt;
+  ssize_t rc;
+  if ((rc = rio_fill(rp)) <= 0) {
+    return rc;
+  }
 
   // copy data from internal buffer to user buffer
   cnt = n < rp->rio_cnt ? n : rp->rio_cnt;
@@ -120,27 +139,89 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
   return cnt;
 }
 
+void rio_readinitb(rio_t *rp, int fd) {
+  rp->rio_fd = fd;
+  rp->rio_cnt = 0;
+  rp->rio_bufptr = rp->rio_buf;
+}
+
+// Search the internal buffer with memchr and copy the line in chunks instead
+// of calling rio_read once per byte
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-  int n, rc;
-  char c, *bufp = usrbuf;
+  size_t n = 0;
+  ssize_t rc;
+  char *bufp = usrbuf;
   // copy at most maxlen - 1 bytes, the left 1 byte for null terminate ch
-  for (n = 1; n < maxlen; ++n) {
-    if ((rc = rio_read(rp, &c, 1)) == 1) {
-      *bufp++ = c;
-      if (c == '\n') {
-        break;
-      }
-    } else if (rc == 0) {
-      if (n == 1) return 0; // EOF, no data read
-      else break;
-    } else {
+  while (n + 1 < maxlen) {
+    if ((rc = rio_fill(rp)) < 0) {
       return -1;
+    } else if (rc == 0) { // EOF
+      break;
     }
+
+    size_t cnt = maxlen - 1 - n;
+    if (cnt > rp->rio_cnt) cnt = rp->rio_cnt;
+    char *eol = memchr(rp->rio_bufptr, '\n', cnt);
+    if (eol) cnt = eol - rp->rio_bufptr + 1;
+
+    memcpy(bufp, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    bufp += cnt;
+    n += cnt;
+    if (eol) break;
   }
-  *bufp = '\0';
+  if (maxlen) *bufp = '\0';
   return n;
 }
 
+// The line stays in the internal buffer. Bytes are only moved when a line
+// crosses the end of the buffer: the partial line is shifted to the front
+// and the refill is appended behind it.
+ssize_t rio_readlinep(rio_t *rp, char **linep) {
+  size_t scanned = 0; // bytes already searched for '\n'
+  ssize_t len;
+  for (;;) {
+    size_t cnt = rp->rio_cnt > 0 ? rp->rio_cnt : 0;
+    char *eol = NULL;
+    if (cnt > scanned) {
+      eol = memchr(rp->rio_bufptr + scanned, '\n', cnt - scanned);
+    }
+    if (eol) {
+      len = eol - rp->rio_bufptr + 1;
+      break;
+    }
+    scanned = cnt;
+
+    if (scanned == RIO_BUFFER) { // line is longer than the whole buffer
+      len = scanned;
+      break;
+    }
+
+    // move the partial line to the front, then refill behind it
+    if (rp->rio_bufptr != rp->rio_buf && scanned > 0) {
+      memmove(rp->rio_buf, rp->rio_bufptr, scanned);
+    }
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_cnt = scanned;
+
+    ssize_t nread = read(rp->rio_fd, rp->rio_buf + scanned, RIO_BUFFER - scanned);
+    if (nread < 0) {
+      if (errno != EINTR) return -1;
+    } else if (nread == 0) { // EOF, return the last unterminated line
+      len = scanned;
+      break;
+    } else {
+      rp->rio_cnt += nread;
+    }
+  }
+
+  *linep = rp->rio_bufptr;
+  rp->rio_bufptr += len;
+  rp->rio_cnt -= len;
+  return len;
+}
+
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
   size_t nleft = n;
   ssize_t nread;
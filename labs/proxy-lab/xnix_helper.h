@@ -1,5 +1,11 @@
 #ifndef __XNIX_HELPER_H__
 #define __XNIX_HELPER_H__
+// getaddrinfo, strdup and the pthread/sched affinity calls are not part of
+// strict C99
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -106,8 +112,17 @@ typedef struct {
 
 // init the buffer
 void rio_readinitb(rio_t *rp, int fd);
-// read a line per call
+// read a line per call, copy at most maxlen - 1 bytes into usrbuf
+// return value:
+// on success return the bytes copied (0 on EOF), otherwise return -1
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+// read a line per call without copying it out of the internal buffer
+// 1. Output:
+//  <1> linep : points to the line inside rp->rio_buf. The line is NOT null
+//      terminated and is only valid until the next read on rp
+//  <2> ret : line length including '\n', 0 on EOF, -1 on error. A line
+//      longer than RIO_BUFFER is returned in RIO_BUFFER sized pieces
+ssize_t rio_readlinep(rio_t *rp, char **linep);
 // read n bytes per call
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 
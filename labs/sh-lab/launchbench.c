@@ -0,0 +1,264 @@
+/*
+ * launchbench.c - Processes launched per second by the tiny shell
+ *
+ * usage: launchbench [-l | -P] [-n <commands>] [-b <batch>] [-s <shell>]
+ *                    [-c <command>]
+ * Feeds the shell (default ./tsh) a script of <commands> lines of
+ * <command> (default /bin/true) and times it until the shell exits, with
+ * the default posix_spawn launch path, with -F (fork + execve) and with
+ * -Z (zygotes). The script runs foreground commands, or with -b batches
+ * of <batch> background commands, each batch followed by a foreground
+ * one. Every run is repeated 3 times and the best is reported.
+ *
+ * With -l the command (default ./zygprobe) is run in the foreground and
+ * must print the times its main started and ended, as zygprobe does. The
+ * launch latency of a command is then the time from the end of the one
+ * before to its start, and its percentiles are reported.
+ *
+ * With -P the shell also runs with -T, and prints when it read each
+ * command line, started and reaped the command, and was ready for the
+ * next line. Together with the times the command printed, this breaks
+ * the latency of each command down into phases:
+ *
+ *   parse   line read -> parsed, about to start the command
+ *   spawn   -> the shell is done starting it (posix_spawn returns only
+ *              after the exec, fork right after the fork)
+ *   exec    -> the first instruction of the command's main
+ *   run     -> the command is about to exit
+ *   reap    -> the shell has reaped it
+ *   prompt  -> the shell is ready for the next line
+ *
+ * The phases add up to the total. exec is negative when the command
+ * starts running before the shell is done starting it, as it often does
+ * from a zygote.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define NPATHS 3
+#define NPHASES 7
+
+static const char *phase_names[NPHASES] = {
+    "parse", "spawn", "exec", "run", "reap", "prompt", "total"
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run shell with the script on stdin and its output going to out (or
+ * /dev/null if out < 0), and return the wall time. The shell sends its
+ * stderr to its stdout.
+ */
+static double run_shell(const char *shell, const char *flags, int script,
+			int out)
+{
+    pid_t pid;
+    int status;
+    double beg = now_sec();
+
+    lseek(script, 0, SEEK_SET);
+    if ((pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0) {
+	int null = open("/dev/null", O_WRONLY);
+	dup2(script, 0);
+	dup2(out >= 0 ? out : null, 1);
+	execl(shell, shell, flags, (char *)NULL);
+	perror(shell);
+	exit(1);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	WEXITSTATUS(status)) {
+	fprintf(stderr, "%s %s did not exit cleanly\n", shell, flags);
+	exit(1);
+    }
+    return now_sec() - beg;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Read the start and end times the commands printed into out, and print
+ * the percentiles of the gaps between them in us
+ */
+static void report_latency(const char *name, int out, int n)
+{
+    FILE *in = fdopen(dup(out), "r");
+    long *gaps = malloc(n * sizeof(long));
+    long start, end, prev_end = 0;
+    int ngaps = 0;
+
+    lseek(out, 0, SEEK_SET);
+    while (fscanf(in, "%ld %ld", &start, &end) == 2) {
+	if (prev_end && ngaps < n)
+	    gaps[ngaps++] = start - prev_end;
+	prev_end = end;
+    }
+    fclose(in);
+    if (!ngaps) {
+	fprintf(stderr, "%s: the command printed no times\n", name);
+	exit(1);
+    }
+    qsort(gaps, ngaps, sizeof(long), cmp_long);
+    printf("%-12s %8.1f %8.1f %8.1f %8.1f %8.1f\n", name,
+	   gaps[ngaps / 2] / 1e3, gaps[ngaps * 9 / 10] / 1e3,
+	   gaps[ngaps * 99 / 100] / 1e3, gaps[ngaps - 1] / 1e3,
+	   gaps[0] / 1e3);
+    free(gaps);
+}
+
+/*
+ * Read the times the commands and the shell (with -T) printed into out,
+ * and print the percentiles of each phase in us
+ */
+static void report_phases(const char *name, int out, int n)
+{
+    FILE *in = fdopen(dup(out), "r");
+    long *phases[NPHASES];
+    long start = 0, end = 0, t[5];
+    char line[256];
+    int count = 0, i;
+
+    for (i = 0; i < NPHASES; i++)
+	phases[i] = malloc(n * sizeof(long));
+    lseek(out, 0, SEEK_SET);
+    while (fgets(line, sizeof(line), in)) {
+	if (sscanf(line, "phases %ld %ld %ld %ld %ld",
+		   &t[0], &t[1], &t[2], &t[3], &t[4]) == 5) {
+	    /* read, parsed, launched, reaped, prompt */
+	    if (!start || count == n)
+		continue;
+	    phases[0][count] = t[1] - t[0];
+	    phases[1][count] = t[2] - t[1];
+	    phases[2][count] = start - t[2];
+	    phases[3][count] = end - start;
+	    phases[4][count] = t[3] - end;
+	    phases[5][count] = t[4] - t[3];
+	    phases[6][count] = t[4] - t[0];
+	    count++;
+	    start = 0;
+	} else if (sscanf(line, "%ld %ld", &start, &end) != 2) {
+	    start = 0;
+	}
+    }
+    fclose(in);
+    if (!count) {
+	fprintf(stderr, "%s: no phases, the shell needs -T and the command "
+		"must print its times\n", name);
+	exit(1);
+    }
+
+    printf("%s, %d commands\n", name, count);
+    for (i = 0; i < NPHASES; i++) {
+	long *v = phases[i];
+	qsort(v, count, sizeof(long), cmp_long);
+	printf("  %-10s %8.1f %8.1f %8.1f %8.1f\n", phase_names[i],
+	       v[count / 2] / 1e3, v[count * 9 / 10] / 1e3,
+	       v[count * 99 / 100] / 1e3, v[count - 1] / 1e3);
+	free(v);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int n = 5000, batch = 0, latency = 0, breakdown = 0, c, i;
+    const char *shell = "./tsh", *command = NULL;
+
+    while ((c = getopt(argc, argv, "lPn:b:s:c:")) != EOF) {
+	switch (c) {
+	case 'l': latency = 1; break;
+	case 'P': breakdown = 1; break;
+	case 'n': n = atoi(optarg); break;
+	case 'b': batch = atoi(optarg); break;
+	case 's': shell = optarg; break;
+	case 'c': command = optarg; break;
+	default:
+	    fprintf(stderr, "Usage: %s [-l | -P] [-n <commands>] [-b <batch>] "
+		    "[-s <shell>] [-c <command>]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    if (!command)
+	command = latency || breakdown ? "./zygprobe" : "/bin/true";
+    if (latency || breakdown)
+	batch = 0;
+
+    char path[] = "/tmp/launchbenchXXXXXX";
+    int script = mkstemp(path);
+    if (script < 0) {
+	perror("mkstemp");
+	exit(1);
+    }
+    unlink(path);
+    FILE *out = fdopen(dup(script), "w");
+    for (i = 1; i <= n; i++) {
+	int bg = batch && i % (batch + 1);
+	fprintf(out, "%s%s\n", command, bg ? " &" : "");
+    }
+    fclose(out);
+
+    const char *names[NPATHS] = {"posix_spawn", "fork", "zygote"};
+    const char *flags[NPATHS] = {"-p", "-pF", "-pZ"};
+    if (latency || breakdown) {
+	if (latency) {
+	    printf("%d launches of %s, launch latency in us\n", n, command);
+	    printf("%-12s %8s %8s %8s %8s %8s\n", "path", "p50", "p90",
+		   "p99", "max", "min");
+	} else {
+	    printf("%d launches of %s, phase latency in us\n", n, command);
+	    printf("  %-10s %8s %8s %8s %8s\n", "phase", "p50", "p90", "p99",
+		   "max");
+	}
+	for (i = 0; i < NPATHS; i++) {
+	    char out_path[] = "/tmp/launchbenchXXXXXX";
+	    char shell_flags[16];
+	    int out = mkstemp(out_path);
+	    if (out < 0) {
+		perror("mkstemp");
+		exit(1);
+	    }
+	    unlink(out_path);
+	    snprintf(shell_flags, sizeof(shell_flags), "%s%s", flags[i],
+		     breakdown ? "T" : "");
+	    run_shell(shell, shell_flags, script, out);
+	    if (breakdown)
+		report_phases(names[i], out, n);
+	    else
+		report_latency(names[i], out, n);
+	    close(out);
+	}
+	close(script);
+	exit(0);
+    }
+
+    printf("%d launches of %s, %s\n", n, command,
+	   batch ? "background batches" : "foreground");
+    printf("%-12s %10s %12s\n", "path", "secs", "launches/s");
+    for (i = 0; i < NPATHS; i++) {
+	double best = 0;
+	int rep;
+	for (rep = 0; rep < 3; rep++) {
+	    double t = run_shell(shell, flags[i], script, -1);
+	    if (!best || t < best) best = t;
+	}
+	printf("%-12s %10.3f %12.0f\n", names[i], best, n / best);
+    }
+    close(script);
+    exit(0);
+}
@@ -3,15 +3,30 @@
  *
  * <Put your name and login ID here>
  */
+#define _GNU_SOURCE  /* pipe2, tee, splice and memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <sched.h>
+#include <dirent.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include "zygote.h"
 
 // #define LOG_DEBUG_STR
 
@@ -24,8 +39,15 @@
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
-#define MAXJID    1<<16   /* max job ID */
+#define MAXSTAGES (MAXARGS/2) /* max commands in a pipeline */
+#define TEE_CHUNK  65536  /* bytes moved at a time by the tee builtin */
+#define MINJOBS      16   /* initial size of the job table */
+#define MAXJID    (1<<16) /* max job ID, a multiple of 64*64 up to 64*64*64 */
+#if MAXJID % (64 * 64) || MAXJID > 64 * 64 * 64
+#error "MAXJID does not fit the free jid bitmap"
+#endif
+#define PATHBUCKETS  64   /* buckets of the command hash table */
+#define DEFPATH "/usr/local/bin:/usr/bin:/bin" /* PATH if it is unset */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -47,17 +69,228 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
-int fg_job_stopped_or_finished;
+
+/*
+ * SIGCHLD, SIGINT and SIGTSTP stay blocked in the shell and are read from
+ * sigfd instead. The shell polls sigfd while it waits for input or for
+ * the foreground job, so a child that exits or stops wakes it up at once,
+ * and reaping, forwarding and printing all run outside of signal context.
+ */
+int sigfd;                  /* signalfd of the blocked signals */
+sigset_t shell_mask;        /* the blocked signals */
+sigset_t child_mask;        /* signal mask the shell started with */
+
+/*
+ * Commands are started with posix_spawn, which glibc implements with a
+ * vfork-style clone: the child borrows the shell's memory until it execs
+ * instead of copying the shell's page tables. The child joins a new
+ * process group and gets child_mask before the exec, as in the fork path.
+ */
+int use_fork = 0;           /* if true, start commands with fork + execve */
+posix_spawnattr_t spawn_attr;
+
+/*
+ * With -Z, a command started often gets a zygote (see zygote.h), and is
+ * started from it from then on.
+ */
+#define MAXZYGOTES    8   /* commands that can have a zygote */
+#define ZYGOTE_USES   2   /* starts of a command before it gets one */
+
+struct zygote_t {
+  char *path;             /* the command */
+  int uses;               /* times it was started */
+  pid_t pid;              /* the zygote, 0 if it is not running */
+  int fd;                 /* its request socket */
+  int cooperative;        /* the binary is its own zygote */
+  ino_t ino;              /* the binary the zygote was started for */
+  struct timespec mtime;
+};
+int use_zygotes = 0;        /* if true, start commands from zygotes */
+struct zygote_t zygotes[MAXZYGOTES];
+int nzygotes;
+
+/*
+ * A job can be started with, or later given, a CPU affinity, a nice level
+ * and a scheduling class, see do_sched. They apply to every process of
+ * its group.
+ */
+struct sched_t {            /* Scheduling of a job */
+  int hascpus;            /* if true, run on cpus only */
+  cpu_set_t cpus;
+  int hasnice;            /* if true, run at nice level nice */
+  int nice;
+  int haspolicy;          /* if true, run in scheduling class policy */
+  int policy;
+  int priority;           /* static priority for SCHED_FIFO and SCHED_RR */
+  int spread;             /* if true, cpus are still to be picked */
+};
+int spread = 0;             /* if true, spread background jobs over CPUs */
+
+/*
+ * With -T, the shell prints the times at which it went through the
+ * phases of a foreground job, in ns on CLOCK_MONOTONIC, as a line
+ * "phases <read> <parsed> <launched> <reaped> <prompt>" after the job.
+ * launchbench -P breaks launch latency down with them.
+ */
+#define PH_READ      0  /* the command line is read */
+#define PH_PARSED    1  /* it is parsed, its first process is to start */
+#define PH_LAUNCHED  2  /* its last process is started */
+#define PH_REAPED    3  /* its last process is reaped */
+#define PH_PROMPT    4  /* the shell is ready for the next line */
+#define NPHASES      5
+int use_phases = 0;         /* if true, print the phases of each job */
+long phases[NPHASES];
+
+/*
+ * A job runs a pipeline, one process per stage, all of them in the
+ * process group of the first one. Its pid is that of the group leader.
+ */
+struct proc_t {             /* A process of a job */
+  pid_t pid;
+  int reaped;
+  struct job_t *job;
+  struct proc_t *pid_next;  /* next process in the same pid hash bucket */
+};
 
 struct job_t {              /* The job struct */
-  pid_t pid;              /* job PID */
+  pid_t pid;              /* job PID, also its process group ID */
   int jid;                /* job ID [1, 2, ...] */
   int state;              /* UNDEF, BG, FG, or ST */
   char cmdline[MAXLINE];  /* command line */
+  int nprocs;             /* processes of the job */
+  int nlive;              /* processes not reaped yet */
+  int termsig;            /* signal that killed the last stage, or 0 */
+  struct proc_t *procs;   /* the nprocs processes, in pipeline order */
+  struct parallel_t *parallel; /* the run of a parallel job, else NULL */
+  int timed;              /* if true, report usage when it is done */
+  struct timespec start;  /* when the job was started */
+  struct rusage usage;    /* summed over its reaped processes */
+  struct sched_t sched;   /* what it was started with or last given */
+};
+
+struct output_t {           /* Output of one input of a parallel run */
+  char *buf;              /* kept until the inputs before are written */
+  size_t len;
+  int done;               /* the command has finished */
+};
+
+struct parallel_t {         /* A parallel run, see do_parallel */
+  char **argv;            /* the command, {} stands for the input */
+  char **inputs;          /* the arguments after ::: */
+  int ninputs;
+  int next;               /* next input to start */
+  int flushed;            /* inputs whose output is written out */
+  int cancelled;          /* if true, start no more inputs */
+  struct output_t *outputs;
+  int *slotinput;         /* input run by each process slot */
+  int *slotfd;            /* memfd the command of each slot writes to */
+  int in, out;            /* stdin of the commands, where outputs go */
+};
+
+struct stage_t {            /* A command of a pipeline */
+  char **argv;            /* its argument list, NULL terminated */
+  char *infile;           /* < infile, NULL if none */
+  char *outfile;          /* > outfile or >> outfile, NULL if none */
+  int append;             /* outfile was given with >> */
+};
+
+/*
+ * The job list grows with the number of jobs. Jobs are found by jid
+ * through byjid and by the pid of any of their processes through a
+ * chained hash table, and the foreground job is cached, so no lookup
+ * scans the list.
+ */
+struct joblist_t {
+  struct job_t **byjid;   /* byjid[jid], NULL if jid is free */
+  int jidcap;             /* size of byjid */
+  int maxjid;             /* largest jid in use, 0 if none */
+  /*
+   * The free jids, a bitmap in three levels: bit j-1 of freejids is set
+   * if jid j is free, bit w of freewords if word w of freejids has a bit
+   * set, and bit k of freegroups if word k of freewords has one. The
+   * lowest free jid is found with one count of trailing zeros per level.
+   */
+  uint64_t freejids[MAXJID / 64];
+  uint64_t freewords[MAXJID / 64 / 64];
+  uint64_t freegroups;
+  struct proc_t **bypid;  /* pid hash buckets, a power of 2 of them */
+  int pidcap;             /* number of buckets */
+  int count;              /* number of jobs */
+  int nprocs;             /* number of processes not reaped yet */
+  struct job_t *fg;       /* the FG job, NULL if none */
+};
+struct joblist_t jobs;      /* The job list */
+
+/*
+ * Commands without a '/' are looked up in PATH. Where a command was found
+ * is kept in a hash table, like the hash builtin of bash, so that it is
+ * not searched for again. Entries are checked against the mtime of the
+ * PATH directories, which changes whenever a file is added to or removed
+ * from them.
+ */
+#define DIR_UNSEEN  0       /* not checked yet */
+#define DIR_SEEN    1       /* ino and mtime are known */
+#define DIR_MISSING 2       /* could not be read when last checked */
+
+struct pathdir_t {          /* A directory of PATH */
+  char *name;
+  int seen;               /* DIR_UNSEEN, DIR_SEEN or DIR_MISSING */
+  ino_t ino;
+  struct timespec mtime;  /* mtime of the directory when last checked */
+};
+
+struct pathent_t {          /* A hashed command */
+  char *name;             /* command name */
+  char *path;             /* path it resolved to */
+  int dir;                /* index of its directory in PATH */
+  int hits;               /* times it was looked up */
+  struct pathent_t *next; /* next entry in the same bucket */
+};
+
+struct pathcache_t {
+  char *path;             /* the value of PATH the table was built for */
+  struct pathdir_t *dirs;
+  int ndirs;
+  struct pathent_t *buckets[PATHBUCKETS];
+  int count;              /* number of hashed commands */
+};
+struct pathcache_t pathcache; /* The command hash table */
+
+/*
+ * With -f, tsh runs a trace file by itself instead of under sdriver.pl.
+ * The file is mapped and split into lines up front. Its directives
+ * (SLEEP, TSTP, INT, ...) are played on the driver's timeline while the
+ * shell works through the commands: the driver hands the shell every
+ * command up to the next SLEEP, and the shell waits on sigfd, with the
+ * end of the SLEEP as its timeout.
+ */
+#define SC_COMMENT 0  /* echoed */
+#define SC_COMMAND 1  /* a command line for the shell */
+#define SC_SLEEP   2  /* the driver pauses for arg ms */
+#define SC_SIGNAL  3  /* the driver sends signal arg to the shell */
+#define SC_CLOSE   4  /* the driver closes the shell's input */
+
+struct scriptline_t {
+  int kind;
+  const char *text;       /* the line in the mapped file, no '\n' */
+  int len;
+  int arg;
+};
+
+struct script_t {
+  const char *text;       /* the mapped file */
+  size_t size;
+  struct scriptline_t *lines;
+  int nlines;
+  int next;               /* next line for the driver */
+  long wake;              /* the driver sleeps until then, in ms */
+  int done;               /* the driver closed the input */
+  int *queue;             /* commands the driver has handed over */
+  int head, tail;
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct script_t script;     /* The -f script */
+int use_script = 0;         /* if true, commands come from the script */
 /* End global variables */
 
 
@@ -67,27 +300,68 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
-void waitfg(pid_t pid);
-
-void sigchld_handler(int sig);
-void sigtstp_handler(int sig);
-void sigint_handler(int sig);
+void waitfg(int jid);
+int parsepipeline(char **argv, char **args, struct stage_t *stages);
+int openredirects(struct stage_t *stages, int nstages, int redirects[][2]);
+pid_t launch(char **argv, int in, int out, pid_t pgid,
+             const struct sched_t *sched);
+pid_t zygotelaunch(const char *path, char **argv, int in, int out,
+                   pid_t pgid);
+int builtin_tee(char **argv);
+struct job_t *do_parallel(char **argv, int bg, char *cmdline, int in,
+                          int out, struct sched_t *sched);
+struct job_t *runpipeline(struct stage_t *stages, int nstages,
+                          int redirects[][2], int bg, char *cmdline,
+                          struct sched_t *sched);
+void do_times(void);
+int parsesched(char **argv, struct sched_t *sched);
+int do_sched(char **argv, struct sched_t *sched);
+void placejob(struct sched_t *sched, int nprocs);
+int applysched(pid_t tid, const struct sched_t *sched);
+int stepparallel(struct job_t *job);
+void reapparallel(struct job_t *job, pid_t pid, int status);
+void freeparallel(struct parallel_t *run);
+ssize_t writeall(int fd, const char *buf, size_t n);
+
+int readcmdline(char *cmdline, int size);
+void loadscript(const char *path);
+void advancescript(void);
+int scripttimeout(void);
+int readscript(char *cmdline, int size);
+void dispatch_signals(void);
+void reap_children(void);
+void forward_signal(int sig);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs);
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid);
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid);
+void initjobs(struct joblist_t *jobs);
+int maxjid(struct joblist_t *jobs);
+int addjob(struct joblist_t *jobs, pid_t *pids, int npids, int state,
+           char *cmdline);
+struct job_t *newjob(struct joblist_t *jobs, pid_t pgid, int nslots,
+                     int state, char *cmdline);
+void addproc(struct joblist_t *jobs, struct job_t *job, int slot, pid_t pid);
+int reapproc(struct joblist_t *jobs, pid_t pid);
+int reapslot(struct joblist_t *jobs, pid_t pid);
+int deletejob(struct joblist_t *jobs, pid_t pid);
+void removejob(struct joblist_t *jobs, struct job_t *job);
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state);
+pid_t fgpid(struct joblist_t *jobs);
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct joblist_t *jobs, int jid);
 int pid2jid(pid_t pid);
-void listjobs(struct job_t *jobs);
+void listjobs(struct joblist_t *jobs, int details);
+void addusage(struct rusage *sum, const struct rusage *usage);
+void printusage(struct job_t *job);
 
+const char *findcmd(struct pathcache_t *cache, const char *name);
+void hashclear(struct pathcache_t *cache);
+void do_hash(char **argv);
+
+void phase(int which);
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
@@ -115,8 +389,32 @@ void Setpgid(pid_t pid, pid_t gid) {
   }
 }
 
+void *Malloc(size_t size) {
+  void *p;
+  if (!(p = malloc(size))) {
+    unix_error("Malloc error");
+  }
+  return p;
+}
+
+void *Calloc(size_t nmemb, size_t size) {
+  void *p;
+  if (!(p = calloc(nmemb, size))) {
+    unix_error("Calloc error");
+  }
+  return p;
+}
+
+void *Realloc(void *ptr, size_t size) {
+  void *p;
+  if (!(p = realloc(ptr, size))) {
+    unix_error("Realloc error");
+  }
+  return p;
+}
+
 void VerboseCurrentBackgroundJob(pid_t pid) {
-  struct job_t* job = getjobpid(jobs, pid);
+  struct job_t* job = getjobpid(&jobs, pid);
   if (!job) return;
   printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
 }
@@ -142,7 +440,7 @@ int main(int argc, char **argv) {
   dup2(1, 2);
 
   /* Parse the command line */
-  while ((c = getopt(argc, argv, "hvp")) != EOF) {
+  while ((c = getopt(argc, argv, "hvpFZTf:")) != EOF) {
     switch (c) {
       case 'h':             /* print help message */
       usage();
@@ -156,23 +454,55 @@ int main(int argc, char **argv) {
       emit_prompt = 0;  /* handy for automatic testing */
     break;
 
+      case 'F':             /* start commands with fork + execve */
+      use_fork = 1;
+    break;
+
+      case 'Z':             /* start frequent commands from zygotes */
+      use_zygotes = 1;
+    break;
+
+      case 'T':             /* print the phases of each job */
+      use_phases = 1;
+    break;
+
+      case 'f':             /* run a trace file */
+      loadscript(optarg);
+      use_script = 1;
+      emit_prompt = 0;
+    break;
+
     default:
       usage();
     }
   }
 
-  /* Install the signal handlers */
-
-  /* These are the ones you will need to implement */
-  Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-  Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-  Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+  /* Route ctrl-c, ctrl-z and terminated or stopped children to sigfd */
+  sigemptyset(&shell_mask);
+  sigaddset(&shell_mask, SIGINT);
+  sigaddset(&shell_mask, SIGTSTP);
+  sigaddset(&shell_mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &shell_mask, &child_mask) < 0)
+    unix_error("sigprocmask error");
+  if ((sigfd = signalfd(-1, &shell_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+    unix_error("signalfd error");
+
+  if ((errno = posix_spawnattr_init(&spawn_attr)) ||
+      (errno = posix_spawnattr_setflags(&spawn_attr,
+                 POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK)) ||
+      (errno = posix_spawnattr_setpgroup(&spawn_attr, 0)) ||
+      (errno = posix_spawnattr_setsigmask(&spawn_attr, &child_mask)))
+    unix_error("posix_spawnattr error");
+
+  if (use_script) {
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+  }
 
   /* This one provides a clean way to kill the shell */
   Signal(SIGQUIT, sigquit_handler);
 
   /* Initialize the job list */
-  initjobs(jobs);
+  initjobs(&jobs);
 
   /* Execute the shell's read/eval loop */
   while (1) {
@@ -182,19 +512,20 @@ int main(int argc, char **argv) {
       fflush(stdout);
     }
 
-  if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin)) {
-      app_error("fgets error");
-    }
-
-  if (feof(stdin)) { /* End of file (ctrl-d) */
+  if (use_script ? !readscript(cmdline, MAXLINE)
+                 : !readcmdline(cmdline, MAXLINE)) { /* End of file (ctrl-d) */
     fflush(stdout);
     exit(0);
   }
+  phase(PH_READ);
 
   /* Evaluate the command line */
   eval(cmdline);
-  fflush(stdout);
-  fflush(stdout);
+  phase(PH_PROMPT);
+  /* a script's output goes out in blocks, before each child starts */
+  if (!use_script) {
+    fflush(stdout);
+  }
   }
 
   exit(0); /* control never reaches here */
@@ -214,36 +545,616 @@ int main(int argc, char **argv) {
 void eval(char *cmdline)
 {
     char* argv[MAXARGS] = { NULL };
+    char* args[MAXARGS + MAXSTAGES];
+    struct stage_t stages[MAXSTAGES];
+    int redirects[MAXSTAGES][2];
+    struct job_t *job = NULL;
     int bg = parseline(cmdline, argv);
     if (!argv[0]) {
       return;
     }
-    if (!builtin_cmd(argv)) {
-      sigset_t mask;
-      sigemptyset(&mask);
-      sigaddset(&mask, SIGCHLD);
-      sigprocmask(SIG_BLOCK, &mask, NULL);
-
-      pid_t pid;
-      if ((pid = Fork()) == 0) {
-        sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        Setpgid(0, 0); // create a new process group
-        Execve(argv[0], argv, environ);
-      }
 
-      // add job
-      addjob(jobs, pid, bg ? BG : FG, cmdline);
-      if (bg) {
-        VerboseCurrentBackgroundJob(pid);
+    // "time command" runs the command as usual and reports its usage
+    int timed = !strcmp(argv[0], "time");
+    if (timed && !argv[1]) {
+      do_times();
+      return;
+    }
+    // "sched [options] command" runs it with the given scheduling
+    char **cmd = argv + timed;
+    struct sched_t sched;
+    memset(&sched, 0, sizeof(sched));
+    if (!strcmp(cmd[0], "sched")) {
+      int n = parsesched(cmd, &sched);
+      if (!n || do_sched(cmd + n, &sched)) {
+        return;
       }
-      fg_job_stopped_or_finished = 0;
-      sigprocmask(SIG_UNBLOCK, &mask, NULL);
+      cmd += n;
+    }
+    sched.spread = spread && bg && !sched.hascpus;
+
+    int nstages = parsepipeline(cmd, args, stages);
+    if (!nstages) {
+      return;
+    }
+    if (nstages == 1 && builtin_cmd(stages[0].argv)) {
+      return;
+    }
+    if (!openredirects(stages, nstages, redirects)) {
+      return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (nstages == 1 && !strcmp(stages[0].argv[0], "parallel")) {
+      job = do_parallel(stages[0].argv, bg, cmdline,
+                  redirects[0][0] >= 0 ? redirects[0][0] : STDIN_FILENO,
+                  redirects[0][1] >= 0 ? redirects[0][1] : STDOUT_FILENO,
+                  &sched);
+    } else {
+      job = runpipeline(stages, nstages, redirects, bg, cmdline, &sched);
+    }
+    if (!job) {
+      return;
+    }
 
-      if (!bg) waitfg(pid);
+    job->timed = timed;
+    job->start = start;
+    if (bg) {
+      VerboseCurrentBackgroundJob(job->pid);
     }
+
+    if (!bg) waitfg(job->jid);
     return;
 }
 
+/*
+ * runpipeline - Start the stages of a pipeline, each reading the output
+ *    of the one before, as a new job with the scheduling sched. Return
+ *    the job, NULL if no stage could be started.
+ */
+struct job_t *runpipeline(struct stage_t *stages, int nstages,
+                          int redirects[][2], int bg, char *cmdline,
+                          struct sched_t *sched)
+{
+    pid_t pids[MAXSTAGES];
+
+    placejob(sched, nstages);
+    phase(PH_PARSED);
+
+    // SIGCHLD is only read from sigfd, so no stage can be reaped before
+    // the job is added to the job list
+    int npids = 0, in = STDIN_FILENO, i;
+    for (i = 0; i < nstages; i++) {
+      int pipefd[2] = { -1, STDOUT_FILENO };
+      if (i + 1 < nstages && pipe2(pipefd, O_CLOEXEC) < 0) {
+        unix_error("pipe error");
+      }
+      int stage_in = redirects[i][0] >= 0 ? redirects[i][0] : in;
+      int stage_out = redirects[i][1] >= 0 ? redirects[i][1] : pipefd[1];
+
+      // the first stage started leads the process group of the job
+      pid_t pid = launch(stages[i].argv, stage_in, stage_out,
+                         npids ? pids[0] : 0, sched);
+      if (pid) {
+        pids[npids++] = pid;
+      }
+
+      if (in != STDIN_FILENO) close(in);
+      if (pipefd[1] != STDOUT_FILENO) close(pipefd[1]);
+      if (redirects[i][0] >= 0) close(redirects[i][0]);
+      if (redirects[i][1] >= 0) close(redirects[i][1]);
+      in = pipefd[0];
+    }
+    phase(PH_LAUNCHED);
+    if (!npids || !addjob(&jobs, pids, npids, bg ? BG : FG, cmdline)) {
+      return NULL;
+    }
+    struct job_t *job = getjobpid(&jobs, pids[0]);
+    job->sched = *sched;
+    return job;
+}
+
+/*
+ * parsepipeline - Split the argv of a command line at '|' into the
+ *    stages of a pipeline, and take out the '<', '>' and '>>'
+ *    redirections of each stage. The file name may follow the operator
+ *    directly or as the next argument. The argv of the stages are kept
+ *    in args, MAXARGS + MAXSTAGES pointers. Return the number of stages,
+ *    0 on a syntax error.
+ */
+int parsepipeline(char **argv, char **args, struct stage_t *stages)
+{
+  int nstages = 1, nargs = 0, i;
+  struct stage_t *stage = &stages[0];
+
+  memset(stage, 0, sizeof(*stage));
+  stage->argv = args;
+  for (i = 0; argv[i]; i++) {
+    char *arg = argv[i];
+    char **file = NULL;
+
+    if (!strcmp(arg, "|")) {
+      if (stage->argv == args + nargs || nstages == MAXSTAGES) {
+        printf("syntax error near '|'\n");
+        return 0;
+      }
+      args[nargs++] = NULL;
+      stage = &stages[nstages++];
+      memset(stage, 0, sizeof(*stage));
+      stage->argv = args + nargs;
+      continue;
+    }
+
+    if (arg[0] == '<') {
+      file = &stage->infile;
+      arg++;
+    } else if (arg[0] == '>') {
+      file = &stage->outfile;
+      arg++;
+      stage->append = (arg[0] == '>');
+      arg += stage->append;
+    }
+    if (file) {
+      if (!*arg) arg = argv[++i];
+      if (!arg || !*arg || strchr("<>|", arg[0])) {
+        printf("syntax error: missing file name for redirection\n");
+        return 0;
+      }
+      *file = arg;
+      continue;
+    }
+    args[nargs++] = arg;
+  }
+  if (stage->argv == args + nargs) {
+    printf("syntax error near '|'\n");
+    return 0;
+  }
+  args[nargs] = NULL;
+  return nstages;
+}
+
+/*
+ * openredirects - Open the redirections of every stage before any stage
+ *    runs, so a missing file cancels the whole job. redirects[i] gets
+ *    the stdin and stdout of stage i, -1 where there is none. Return 0
+ *    after printing the error if a file cannot be opened.
+ */
+int openredirects(struct stage_t *stages, int nstages, int redirects[][2])
+{
+  int i, j;
+
+  for (i = 0; i < nstages; i++) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+                (stages[i].append ? O_APPEND : O_TRUNC);
+    const char *failed = NULL;
+
+    redirects[i][0] = redirects[i][1] = -1;
+    if (stages[i].infile &&
+        (redirects[i][0] = open(stages[i].infile, O_RDONLY | O_CLOEXEC)) < 0)
+      failed = stages[i].infile;
+    else if (stages[i].outfile &&
+             (redirects[i][1] = open(stages[i].outfile, flags, 0666)) < 0)
+      failed = stages[i].outfile;
+
+    if (failed) {
+      printf("%s: %s\n", failed, strerror(errno));
+      for (j = 0; j <= i; j++) {
+        if (redirects[j][0] >= 0) close(redirects[j][0]);
+        if (redirects[j][1] >= 0) close(redirects[j][1]);
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * launch - Start argv[0], looked up in PATH if it has no '/', with stdin
+ *    in and stdout out, in the process group pgid (0 for a new group) and
+ *    with the signal mask the shell started with. Return its pid, or 0
+ *    if it could not be run.
+ */
+pid_t launch(char **argv, int in, int out, pid_t pgid,
+             const struct sched_t *sched) {
+  pid_t pid;
+  // what the shell printed goes before anything the child prints
+  fflush(stdout);
+  int tee = !strcmp(argv[0], "tee");
+  const char *path = tee ? argv[0] : findcmd(&pathcache, argv[0]);
+  if (!path) {
+    printf("%s: Command not found\n", argv[0]);
+    return 0;
+  }
+
+  // posix_spawn cannot set an affinity or a nice level, so a job with a
+  // scheduling is forked, and the child takes it before the exec: no
+  // process of the job ever runs without it
+  int forked = use_fork || tee || sched->hascpus || sched->hasnice ||
+               sched->haspolicy;
+  if (use_zygotes && !forked &&
+      (pid = zygotelaunch(path, argv, in, out, pgid))) {
+    return pid;
+  }
+
+  if (forked) {
+    if ((pid = Fork()) == 0) {
+      sigprocmask(SIG_SETMASK, &child_mask, NULL);
+      Setpgid(0, pgid);
+      if (!applysched(0, sched)) {
+        fflush(stdout);
+        _exit(1); // the job fails rather than run without its scheduling
+      }
+      fflush(stdout);
+      if (in != STDIN_FILENO) dup2(in, STDIN_FILENO);
+      if (out != STDOUT_FILENO) dup2(out, STDOUT_FILENO);
+      if (tee) exit(builtin_tee(argv));
+      Execve(path, argv, environ);
+    }
+    // the shell sets the group too, so that the next stage can join it
+    // whichever of the two runs first
+    setpgid(pid, pgid ? pgid : pid);
+    return pid;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (in != STDIN_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  if (out != STDOUT_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+  posix_spawnattr_setpgroup(&spawn_attr, pgid);
+
+  // posix_spawn reports a failed exec itself, no child is left to reap
+  int err = posix_spawn(&pid, path, &actions, &spawn_attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err) {
+    printf("%s: Command not found\n", argv[0]);
+    return 0;
+  }
+  return pid;
+}
+
+/*
+ * pipemove - Move at most n bytes from in to out with splice, or through
+ *    a buffer where out cannot be spliced to. Return the number of bytes
+ *    moved, 0 at the end of in, -1 on error.
+ */
+static ssize_t pipemove(int in, int out, size_t n) {
+  static char buf[TEE_CHUNK];
+  ssize_t rc;
+
+  while ((rc = splice(in, NULL, out, NULL, n, SPLICE_F_MOVE)) < 0 &&
+         errno == EINTR)
+    ;
+  if (rc >= 0 || errno != EINVAL)
+    return rc;
+
+  // e.g. a terminal, or a file opened with O_APPEND
+  while ((rc = read(in, buf, n < TEE_CHUNK ? n : TEE_CHUNK)) < 0 &&
+         errno == EINTR)
+    ;
+  if (rc > 0 && writeall(out, buf, rc) < 0)
+    return -1;
+  return rc;
+}
+
+/* pipemoveall - Move exactly n bytes from in to out, return 0 on error */
+static int pipemoveall(int in, int out, size_t n) {
+  while (n > 0) {
+    ssize_t rc = pipemove(in, out, n);
+    if (rc <= 0) return 0;
+    n -= rc;
+  }
+  return 1;
+}
+
+/*
+ * builtin_tee - The "tee [-a] [file]" stage of a pipeline, run in a
+ *    child of the shell: copy stdin to stdout and to file. When stdin is
+ *    a pipe the data stays in the kernel: tee(2) duplicates the pipe's
+ *    contents into stdout, or into a second pipe when stdout is not one,
+ *    and splice(2) then moves the same bytes out to the file.
+ */
+int builtin_tee(char **argv) {
+  int append = 0, file = -1, mid[2] = { -1, -1 };
+  struct stat in_st, out_st;
+  ssize_t n;
+
+  argv++;
+  if (*argv && !strcmp(*argv, "-a")) {
+    append = 1;
+    argv++;
+  }
+  if (*argv && (file = open(*argv, O_WRONLY | O_CREAT |
+                            (append ? O_APPEND : O_TRUNC), 0666)) < 0) {
+    fprintf(stderr, "tee: %s: %s\n", *argv, strerror(errno));
+    return 1;
+  }
+  if (fstat(STDIN_FILENO, &in_st) < 0 || fstat(STDOUT_FILENO, &out_st) < 0) {
+    unix_error("fstat error");
+  }
+
+  if (file < 0 || !S_ISFIFO(in_st.st_mode)) {
+    // nothing to duplicate, or no pipe to tee from: plain copy
+    char buf[TEE_CHUNK];
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+      if (writeall(STDOUT_FILENO, buf, n) < 0 ||
+          (file >= 0 && writeall(file, buf, n) < 0))
+        return 1;
+    }
+    return n < 0;
+  }
+
+  int copy = STDOUT_FILENO;
+  if (!S_ISFIFO(out_st.st_mode)) {
+    if (pipe(mid) < 0) unix_error("pipe error");
+    copy = mid[1];
+  }
+  while ((n = tee(STDIN_FILENO, copy, TEE_CHUNK, 0)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 1;
+    }
+    if (!pipemoveall(STDIN_FILENO, file, n) ||
+        (copy != STDOUT_FILENO && !pipemoveall(mid[0], STDOUT_FILENO, n)))
+      return 1;
+  }
+  return 0;
+}
+
+/* writeall - write all n bytes of buf, return -1 on error */
+ssize_t writeall(int fd, const char *buf, size_t n) {
+  size_t left = n;
+  while (left > 0) {
+    ssize_t rc = write(fd, buf, left);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += rc;
+    left -= rc;
+  }
+  return n;
+}
+
+/*
+ * do_parallel - Execute the builtin "parallel [-j N] command [arg...] :::
+ *    input...". The command runs once for each input, with the input in
+ *    place of every {} argument, or appended if there is none. At most N
+ *    commands run at once, by default one per CPU.
+ *
+ *    The run is a single job with N process slots. Whenever reap_children
+ *    reaps a command, the next input is started in its slot, so the
+ *    slots stay busy without the shell ever waiting on one command. The
+ *    job can be listed, stopped, continued and killed like any other.
+ *    Every command writes to a memfd of its own, and the outputs are
+ *    written to out in input order as soon as the ones before are done.
+ *    The commands run with the scheduling sched; a spread job gets up to
+ *    N CPUs. Return the job, NULL if it is already done.
+ */
+struct job_t *do_parallel(char **argv, int bg, char *cmdline, int in,
+                          int out, struct sched_t *sched)
+{
+  long nslots = sysconf(_SC_NPROCESSORS_ONLN);
+  int n, i;
+
+  argv++;
+  if (*argv && !strcmp(*argv, "-j")) {
+    if (!argv[1] || (nslots = atoi(argv[1])) < 1) {
+      printf("parallel: -j requires a positive number\n");
+      goto fail;
+    }
+    argv += 2;
+  }
+  for (n = 0; argv[n] && strcmp(argv[n], ":::"); n++)
+    ;
+  if (!n || !argv[n]) {
+    printf("usage: parallel [-j N] command [arg...] ::: input...\n");
+    goto fail;
+  }
+
+  struct parallel_t *run = Calloc(1, sizeof(struct parallel_t));
+  char **inputs = argv + n + 1;
+  for (run->ninputs = 0; inputs[run->ninputs]; run->ninputs++)
+    ;
+  if (!run->ninputs) {
+    free(run);
+    goto fail;
+  }
+  if (nslots > run->ninputs) {
+    nslots = run->ninputs;
+  }
+
+  // argv points into the line being parsed, keep a copy for later slots
+  run->argv = Calloc(n + 1, sizeof(char *));
+  for (i = 0; i < n; i++) {
+    run->argv[i] = strdup(argv[i]);
+  }
+  run->inputs = Calloc(run->ninputs, sizeof(char *));
+  for (i = 0; i < run->ninputs; i++) {
+    run->inputs[i] = strdup(inputs[i]);
+  }
+  run->outputs = Calloc(run->ninputs, sizeof(struct output_t));
+  run->slotinput = Calloc(nslots, sizeof(int));
+  run->slotfd = Calloc(nslots, sizeof(int));
+  run->in = in;
+  run->out = out;
+
+  struct job_t *job = newjob(&jobs, 0, nslots, bg ? BG : FG, cmdline);
+  if (!job) {
+    freeparallel(run);
+    return NULL;
+  }
+  placejob(sched, nslots);
+  job->sched = *sched;
+  job->parallel = run;
+  // NULL if no command could be started
+  return stepparallel(job) ? job : NULL;
+
+fail:
+  if (in != STDIN_FILENO) close(in);
+  if (out != STDOUT_FILENO) close(out);
+  return NULL;
+}
+
+/*
+ * startslot - Start the next input of a parallel job in an empty slot.
+ *    The command joins the process group of the job, or leads a new one
+ *    if every process of the group has been reaped. Return 0 if it could
+ *    not be started.
+ */
+static int startslot(struct job_t *job, int slot) {
+  struct parallel_t *run = job->parallel;
+  char *argv[MAXARGS + 2];
+  int input = run->next++, n = 0, i, fd;
+  int replaced = 0;
+
+  for (i = 0; run->argv[i]; i++) {
+    if (!strcmp(run->argv[i], "{}")) {
+      argv[n++] = run->inputs[input];
+      replaced = 1;
+    } else {
+      argv[n++] = run->argv[i];
+    }
+  }
+  if (!replaced) {
+    argv[n++] = run->inputs[input];
+  }
+  argv[n] = NULL;
+
+  if ((fd = memfd_create("parallel", MFD_CLOEXEC)) < 0) {
+    unix_error("memfd_create error");
+  }
+  // a zombie stays in its process group until it is reaped
+  pid_t pid = launch(argv, run->in, fd, job->nlive ? job->pid : 0,
+                     &job->sched);
+  if (!pid) {
+    close(fd);
+    run->outputs[input].done = 1;
+    return 0;
+  }
+  if (!job->nlive) {
+    job->pid = pid;
+  }
+  addproc(&jobs, job, slot, pid);
+  run->slotinput[slot] = input;
+  run->slotfd[slot] = fd;
+  return 1;
+}
+
+/*
+ * collectslot - Take the output of the command reaped from a slot. It is
+ *    written out now if all the inputs before it are, else kept until
+ *    they are.
+ */
+static void collectslot(struct parallel_t *run, int slot) {
+  struct output_t *output = &run->outputs[run->slotinput[slot]];
+  int fd = run->slotfd[slot];
+  struct stat st;
+  off_t off = 0;
+
+  if (fstat(fd, &st) < 0) {
+    unix_error("fstat error");
+  }
+  if (run->slotinput[slot] == run->flushed) {
+    // next in line: straight from the memfd, without a copy in the shell
+    while (off < st.st_size) {
+      ssize_t rc = sendfile(run->out, fd, &off, st.st_size - off);
+      if (rc < 0 && errno == EINTR) continue;
+      if (rc <= 0) break;
+    }
+  }
+  if (off < st.st_size) {
+    output->len = st.st_size - off;
+    output->buf = Malloc(output->len);
+    if (pread(fd, output->buf, output->len, off) != (ssize_t)output->len) {
+      unix_error("pread error");
+    }
+  }
+  close(fd);
+  output->done = 1;
+}
+
+/* flushparallel - Write out the outputs that are next in input order */
+static void flushparallel(struct parallel_t *run) {
+  while (run->flushed < run->ninputs && run->outputs[run->flushed].done) {
+    struct output_t *output = &run->outputs[run->flushed++];
+    if (output->len) {
+      writeall(run->out, output->buf, output->len);
+    }
+    free(output->buf);
+    output->buf = NULL;
+  }
+}
+
+/*
+ * stepparallel - Fill the empty slots of a parallel job with the next
+ *    inputs, unless the job is stopped or was cancelled. Delete the job
+ *    once its last command is reaped. Return 0 if the job was deleted.
+ */
+int stepparallel(struct job_t *job) {
+  struct parallel_t *run = job->parallel;
+  int slot;
+
+  for (slot = 0; slot < job->nprocs; slot++) {
+    while (job->procs[slot].reaped && run->next < run->ninputs &&
+           !run->cancelled && job->state != ST && !startslot(job, slot))
+      ;
+  }
+  flushparallel(run);
+
+  if (job->nlive || (job->state == ST && !run->cancelled &&
+                     run->next < run->ninputs)) {
+    return 1;
+  }
+  if (job->termsig) {
+    printf("Job [%d] (%d) terminated by signal %d\n",
+            job->jid, job->pid, job->termsig);
+  }
+  if (job->timed) {
+    printusage(job);
+  }
+  freeparallel(run);
+  removejob(&jobs, job);
+  return 0;
+}
+
+/*
+ * reapparallel - Account for a reaped command of a parallel job. A
+ *    command killed by a signal cancels the inputs not started yet.
+ */
+void reapparallel(struct job_t *job, pid_t pid, int status) {
+  int slot = reapslot(&jobs, pid);
+
+  if (WIFSIGNALED(status)) {
+    job->termsig = WTERMSIG(status);
+    job->parallel->cancelled = 1;
+  }
+  collectslot(job->parallel, slot);
+  stepparallel(job);
+}
+
+/* freeparallel - Free a parallel run and close its redirections */
+void freeparallel(struct parallel_t *run) {
+  int i;
+
+  if (run->in != STDIN_FILENO) close(run->in);
+  if (run->out != STDOUT_FILENO) close(run->out);
+  for (i = 0; run->argv[i]; i++) {
+    free(run->argv[i]);
+  }
+  for (i = 0; i < run->ninputs; i++) {
+    free(run->inputs[i]);
+    free(run->outputs[i].buf);
+  }
+  free(run->argv);
+  free(run->inputs);
+  free(run->outputs);
+  free(run->slotinput);
+  free(run->slotfd);
+  free(run);
+}
+
 /*
  * builtin_cmd - If the user has typed a built-in command then execute
  *    it immediately.
@@ -262,7 +1173,12 @@ int builtin_cmd(char **argv)
   }
 
   if (!strcmp(argv[0], "jobs")) {
-    listjobs(jobs);
+    listjobs(&jobs, argv[1] && !strcmp(argv[1], "-l"));
+    return 1;
+  }
+
+  if (!strcmp(argv[0], "hash")) {
+    do_hash(argv);
     return 1;
   }
   return 0;     /* not a builtin command */
@@ -280,22 +1196,16 @@ void do_bgfg(char **argv) {
   int jid = -1;
   pid_t pid = -1;
 
-  // make sure sigchld_handler will not schedule
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGCHLD);
-  sigprocmask(SIG_BLOCK, &mask, NULL);
-
   struct job_t* job = NULL;
   int arg_valid = 0;
   if (argv[1][0] == '%') {
     jid = atoi(argv[1] + 1);
     arg_valid = jid ? 1 : 0;
-    job = getjobjid(jobs, jid);
+    job = getjobjid(&jobs, jid);
   } else {
     pid = atoi(argv[1]);
     arg_valid = pid ? 1 : 0;
-    job = getjobpid(jobs, pid);
+    job = getjobpid(&jobs, pid);
   }
 
   if (!arg_valid) {
@@ -316,116 +1226,918 @@ void do_bgfg(char **argv) {
   jid = job->jid;
 
   int fg = !strcmp(argv[0], "fg");
-  job->state = fg ? FG : BG;
-  Kill(-pid, SIGCONT);
+  setjobstate(&jobs, job, fg ? FG : BG);
+  if (job->nlive) {
+    Kill(-pid, SIGCONT);
+  }
+  // a parallel job starts the inputs it held back while stopped
+  if (job->parallel && !stepparallel(job)) {
+    return;
+  }
+  pid = job->pid;
 
   if (!fg) VerboseCurrentBackgroundJob(pid);
 
-  fg_job_stopped_or_finished = 0;
-  sigprocmask(SIG_UNBLOCK, &mask, NULL);
-
-  if (fg) waitfg(pid);
+  if (fg) waitfg(jid);
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * waitfg - Block until job jid is no longer the foreground job. The
+ *    caller passes the jid it started or resumed: the leader of a
+ *    pipeline may be reaped already, and the process group of a
+ *    parallel job changes as it runs, so neither pid finds the job.
  */
-void waitfg(pid_t pid) {
-  DebugStr("wait fg job with pid %d finish \n", pid);
-  while (!fg_job_stopped_or_finished) {
-    sleep(1);
+void waitfg(int jid) {
+  DebugStr("wait fg job %d finish \n", jid);
+  struct pollfd pfd = { sigfd, POLLIN, 0 };
+  while (jobs.fg && jobs.fg->jid == jid) {
+    if (poll(&pfd, 1, use_script ? scripttimeout() : -1) < 0 &&
+        errno != EINTR) {
+      unix_error("poll error");
+    }
+    dispatch_signals();
+    // the driver goes on while the shell waits, e.g. to send a TSTP
+    if (use_script) {
+      advancescript();
+    }
   }
 }
 
-/*****************
- * Signal handlers
- *****************/
-
 /*
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.
+ * readcmdline - Read the next line of input into cmdline, handling the
+ *     signals that arrive while the shell waits. Like fgets, the line
+ *     keeps its '\n' and is cut at size-1 chars. Return 0 at end of file.
  */
-void sigchld_handler(int sig)
-{
-  pid_t pid;
-  int status;
-  // when there is no child process return -1
-  // when no child process stop or terminate return 0
-  // otherwise return pid of the child process
-  while ( (pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-    // if fg stopped or terminated
-    if (pid == fgpid(jobs)) {
-      DebugStr("foreground job stopped or finish\n");
-      fg_job_stopped_or_finished = 1;
+int readcmdline(char *cmdline, int size) {
+  static char buf[MAXLINE]; /* input read past the current line */
+  static int len = 0;
+  static int eof = 0;
+  struct pollfd pfds[2] = { { STDIN_FILENO, POLLIN, 0 }, { sigfd, POLLIN, 0 } };
+
+  while (1) {
+    char *nl = memchr(buf, '\n', len);
+    int n = nl ? nl - buf + 1 : len;
+    if (n > size - 1) n = size - 1;
+    if (nl || n == size - 1 || (eof && n)) {
+      memcpy(cmdline, buf, n);
+      cmdline[n] = '\0';
+      memmove(buf, buf + n, len - n);
+      len -= n;
+      return 1;
     }
+    if (eof) return 0;
 
-    struct job_t* job = getjobpid(jobs, pid);
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      unix_error("poll error");
+    }
+    if (pfds[1].revents & POLLIN) {
+      dispatch_signals();
+    }
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t rc = read(STDIN_FILENO, buf + len, sizeof(buf) - len);
+      if (rc < 0 && errno != EINTR && errno != EAGAIN) {
+        app_error("read error");
+      }
+      if (rc == 0) eof = 1;
+      if (rc > 0) len += rc;
+    }
+  }
+}
 
-    // if the child process terminated because of a signal that was
-    // not caught
-    if (WIFSIGNALED(status)) {
-      printf("Job [%d] (%d) terminated by signal %d\n",
-              job->jid, job->pid, WTERMSIG(status));
+/*********
+ * Zygotes
+ *********/
+
+/* cooperates - Return true if the binary at path cooperates with zygotes */
+static int cooperates(const char *path, struct stat *st) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  int found = 0;
+
+  if (fd < 0) {
+    return 0;
+  }
+  if (st->st_size > 0) {
+    char *text = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      found = memmem(text, st->st_size, ZYGOTE_MAGIC,
+                     sizeof(ZYGOTE_MAGIC) - 1) != NULL;
+      munmap(text, st->st_size);
     }
+  }
+  close(fd);
+  return found;
+}
 
-    int stop = WIFSTOPPED(status); // stoped or terminated
-    // if the child process is the job process
-    if (job) {
-      job->state = stop ? ST : UNDEF;
-      if (!stop) { // if the job process terminated, delte it
-        deletejob(jobs, pid);
-        DebugStr("pid = %d, jid = %d is deleted\n", pid, pid2jid(pid));
-      } else {
-        DebugStr("pid = %d, jid = %d is stopped\n", pid, pid2jid(pid));
-        printf("Job [%d] (%d) stopped by signal %d\n",
-                job->jid, job->pid, WSTOPSIG(status));
+/* closezygote - Stop a zygote; it exits when it sees its socket closed */
+static void closezygote(struct zygote_t *z) {
+  if (z->fd >= 0) {
+    close(z->fd);
+  }
+  z->fd = -1;
+  z->pid = 0;
+}
+
+/*
+ * startzygote - Start the zygote of z->path. A cooperating binary is
+ *    exec'ed with ZYGOTE_ENV set and becomes its own zygote; for any
+ *    other binary the zygote is a copy of the shell. Either way the
+ *    zygote keeps only its socket and stdin, stdout and stderr, leaves
+ *    the shell's process group so that it never gets the signals of the
+ *    keyboard, and has the signal mask the commands should start with.
+ */
+static int startzygote(struct zygote_t *z, struct stat *st) {
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    return 0;
+  }
+  z->cooperative = cooperates(z->path, st);
+  z->ino = st->st_ino;
+  z->mtime = st->st_mtim;
+  if ((z->pid = Fork()) == 0) {
+    Signal(SIGQUIT, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &child_mask, NULL);
+    setpgid(0, 0);
+    if (dup2(sv[1], ZYGOTE_FD) < 0) {
+      _exit(1);
+    }
+    close_range(ZYGOTE_FD + 1, ~0U, 0);
+    if (z->cooperative) {
+      char *argv[] = { z->path, NULL };
+      char fd[16];
+      snprintf(fd, sizeof(fd), "%d", ZYGOTE_FD);
+      setenv(ZYGOTE_ENV, fd, 1);
+      execve(z->path, argv, environ);
+      _exit(127);
+    }
+    zygote_serve(ZYGOTE_FD, z->path);
+  }
+  close(sv[1]);
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  z->fd = sv[0];
+  return 1;
+}
+
+/*
+ * getzygote - The running zygote of path, NULL if there is none yet. A
+ *    command gets one when it is started the ZYGOTE_USES-th time, if a
+ *    zygote slot is free. A zygote of a binary that was replaced on disk
+ *    since is started again.
+ */
+static struct zygote_t *getzygote(const char *path) {
+  struct zygote_t *z = NULL;
+  struct stat st;
+  int i;
+
+  for (i = 0; i < nzygotes && strcmp(zygotes[i].path, path); i++)
+    ;
+  if (i < nzygotes) {
+    z = &zygotes[i];
+  } else if (nzygotes < MAXZYGOTES) {
+    z = &zygotes[nzygotes++];
+    z->path = strdup(path);
+    z->fd = -1;
+  } else {
+    return NULL;
+  }
+
+  if (++z->uses < ZYGOTE_USES || stat(path, &st) < 0) {
+    return NULL;
+  }
+  if (z->pid && (z->ino != st.st_ino ||
+                 z->mtime.tv_sec != st.st_mtim.tv_sec ||
+                 z->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+    closezygote(z);
+  }
+  if (!z->pid && !startzygote(z, &st)) {
+    return NULL;
+  }
+  return z;
+}
+
+/*
+ * zygotelaunch - Have the zygote of path start argv with stdin in and
+ *    stdout out in the process group pgid, like launch. Return the pid
+ *    of the child, or 0 if the command has no zygote or the zygote
+ *    failed; the caller then starts the command itself.
+ */
+pid_t zygotelaunch(const char *path, char **argv, int in, int out,
+                   pid_t pgid) {
+  struct zygote_t *z = getzygote(path);
+  char buf[ZYGOTE_MSGSIZE];
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  size_t len = sizeof(pid_t);
+  pid_t pid = -1;
+  int i;
+
+  if (!z) {
+    return 0;
+  }
+  memcpy(buf, &pgid, sizeof(pid_t));
+  for (i = 0; argv[i]; i++) {
+    size_t n = strlen(argv[i]) + 1;
+    if (len + n > sizeof(buf)) {
+      return 0;
+    }
+    memcpy(buf + len, argv[i], n);
+    len += n;
+  }
+
+  struct iovec iov = { buf, len };
+  struct msghdr msg = { 0 };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  int fds[2] = { in, out };
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(z->fd, &msg, MSG_NOSIGNAL) != (ssize_t)len ||
+      recv(z->fd, &pid, sizeof(pid), 0) != sizeof(pid) || pid < 0) {
+    DebugStr("zygote of %s failed\n", path);
+    closezygote(z);
+    return 0;
+  }
+  // as in the fork path, in case the child has not set it yet
+  setpgid(pid, pgid ? pgid : pid);
+  return pid;
+}
+/**************
+ * End zygotes
+ **************/
+
+/************
+ * Scheduling
+ ************/
+
+/* The scheduling classes sched -p takes */
+static const struct {
+  const char *name;
+  int policy;
+} policies[] = {
+  { "other", SCHED_OTHER },
+  { "batch", SCHED_BATCH },
+  { "idle", SCHED_IDLE },
+  { "fifo", SCHED_FIFO },
+  { "rr", SCHED_RR },
+};
+#define NPOLICIES (int)(sizeof(policies) / sizeof(policies[0]))
+
+/* parsecpus - Parse a CPU list like 0-3,6 into set, return 0 if bad */
+static int parsecpus(const char *list, cpu_set_t *set) {
+  const char *p = list;
+  char *end;
+
+  CPU_ZERO(set);
+  do {
+    long first = strtol(p, &end, 10), last = first;
+    if (end == p || first < 0) {
+      return 0;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return 0;
       }
     }
+    if (last >= CPU_SETSIZE) {
+      return 0;
+    }
+    for (; first <= last; first++) {
+      CPU_SET(first, set);
+    }
+    p = end + 1;
+  } while (*end == ',');
+  return *end == '\0';
+}
+
+/* printcpus - Print a CPU set as a list like 0-3,6 */
+static void printcpus(const cpu_set_t *set) {
+  const char *sep = "";
+  int cpu, last;
+
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, set)) {
+      continue;
+    }
+    for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set);
+         last++)
+      ;
+    if (last == cpu) {
+      printf("%s%d", sep, cpu);
+    } else {
+      printf("%s%d-%d", sep, cpu, last);
+    }
+    sep = ",";
+    cpu = last;
   }
 }
 
+/* policyname - The name of a scheduling class */
+static const char *policyname(int policy) {
+  int i;
+  for (i = 0; i < NPOLICIES; i++) {
+    if (policies[i].policy == policy) {
+      return policies[i].name;
+    }
+  }
+  return "?";
+}
+
 /*
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.
+ * applysched - Give thread tid (0 for the caller) the scheduling of
+ *    sched. Print what could not be set and return 0, else return 1.
  */
-void sigint_handler(int sig) {
-  DebugStr("shell received SIGINT signal\n");
-  pid_t pid = fgpid(jobs);
-  if (!pid) {
-    DebugStr("No foreground job\n");
-    return; // no foreground job
+int applysched(pid_t tid, const struct sched_t *sched) {
+  pid_t id = tid ? tid : getpid();
+
+  if (sched->hascpus &&
+      sched_setaffinity(tid, sizeof(cpu_set_t), &sched->cpus) < 0) {
+    printf("sched: (%d): cannot set the CPUs: %s\n", id, strerror(errno));
+    return 0;
+  }
+  if (sched->haspolicy) {
+    struct sched_param param = { .sched_priority = sched->priority };
+    if (sched_setscheduler(tid, sched->policy, &param) < 0) {
+      printf("sched: (%d): cannot set the class: %s\n", id, strerror(errno));
+      return 0;
+    }
+  }
+  if (sched->hasnice && setpriority(PRIO_PROCESS, tid, sched->nice) < 0) {
+    printf("sched: (%d): cannot set the nice level: %s\n", id,
+           strerror(errno));
+    return 0;
   }
+  return 1;
+}
 
-  // since the pid of the job process is same as the group id
-  DebugStr("dispatch SIGINT to process group %d\n", pid);
-  Kill(-pid, SIGINT);
+/*
+ * schedgroup - Give every thread of every process in process group pgid
+ *    the scheduling of sched. There is no system call that does it for a
+ *    group, and the group may have processes the shell does not know of,
+ *    so it is looked for in /proc. Return 0 if it failed for some thread.
+ */
+static int schedgroup(pid_t pgid, const struct sched_t *sched) {
+  DIR *proc = opendir("/proc");
+  struct dirent *ent;
+  int ok = 1;
+
+  if (!proc) {
+    unix_error("opendir error");
+  }
+  while (ok && (ent = readdir(proc))) {
+    pid_t pid = atoi(ent->d_name);
+    if (pid <= 0 || getpgid(pid) != pgid) {
+      continue;
+    }
+    char path[32];
+    sprintf(path, "/proc/%d/task", pid);
+    DIR *tasks = opendir(path);
+    // the process has just exited
+    if (!tasks) {
+      continue;
+    }
+    while (ok && (ent = readdir(tasks))) {
+      pid_t tid = atoi(ent->d_name);
+      // a thread that has exited since is no error
+      if (tid > 0 && !applysched(tid, sched) && errno != ESRCH) {
+        ok = 0;
+      }
+    }
+    closedir(tasks);
+  }
+  closedir(proc);
+  return ok;
+}
+
+/*
+ * placejob - Pick the CPUs of a job started with spread on, for nprocs
+ *    processes that run at once: the nprocs least loaded of the CPUs the
+ *    shell may use, where the load of a CPU is the number of jobs not
+ *    stopped that are bound to it.
+ */
+void placejob(struct sched_t *sched, int nprocs) {
+  static int load[CPU_SETSIZE];
+  cpu_set_t allowed;
+  int cpu, i;
+
+  if (!sched->spread) {
+    return;
+  }
+  sched->spread = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    return;
+  }
+  memset(load, 0, sizeof(load));
+  for (i = 1; i <= jobs.maxjid; i++) {
+    struct job_t *job = jobs.byjid[i];
+    if (job && job->state != ST && job->sched.hascpus) {
+      for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        load[cpu] += CPU_ISSET(cpu, &job->sched.cpus) != 0;
+      }
+    }
+  }
+
+  if (nprocs > CPU_COUNT(&allowed)) {
+    nprocs = CPU_COUNT(&allowed);
+  }
+  CPU_ZERO(&sched->cpus);
+  for (i = 0; i < nprocs; i++) {
+    int best = -1;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &sched->cpus) &&
+          (best < 0 || load[cpu] < load[best])) {
+        best = cpu;
+      }
+    }
+    CPU_SET(best, &sched->cpus);
+  }
+  sched->hascpus = 1;
+}
+
+/*
+ * parsesched - Parse the options of the builtin sched into sched. Return
+ *    the index of the first argument after them, 0 on an error.
+ */
+int parsesched(char **argv, struct sched_t *sched) {
+  int i;
+
+  for (i = 1; argv[i] && argv[i][0] == '-'; i += 2) {
+    char *opt = argv[i], *val = argv[i + 1], *end;
+    if (!strcmp(opt, "--")) {
+      return i + 1;
+    }
+    if (!val || strlen(opt) != 2) {
+      goto usage;
+    }
+    switch (opt[1]) {
+      case 'c':
+        if (!parsecpus(val, &sched->cpus)) {
+          printf("sched: bad CPU list %s\n", val);
+          return 0;
+        }
+        sched->hascpus = 1;
+        break;
+      case 'n':
+        sched->nice = strtol(val, &end, 10);
+        if (*end || end == val || sched->nice < -20 || sched->nice > 19) {
+          printf("sched: the nice level must be in [-20, 19]\n");
+          return 0;
+        }
+        sched->hasnice = 1;
+        break;
+      case 'p': {
+        // class[:priority]
+        char *colon = strchr(val, ':');
+        int j, len = colon ? colon - val : (int)strlen(val);
+        for (j = 0; j < NPOLICIES; j++) {
+          if ((int)strlen(policies[j].name) == len &&
+              !strncmp(policies[j].name, val, len)) {
+            break;
+          }
+        }
+        if (j == NPOLICIES) {
+          printf("sched: the class must be other, batch, idle, fifo "
+                 "or rr\n");
+          return 0;
+        }
+        sched->policy = policies[j].policy;
+        int realtime = sched->policy == SCHED_FIFO ||
+                       sched->policy == SCHED_RR;
+        sched->priority = realtime ? 1 : 0;
+        if (colon) {
+          sched->priority = strtol(colon + 1, &end, 10);
+          if (!realtime || *end || end == colon + 1 ||
+              sched->priority < sched_get_priority_min(sched->policy) ||
+              sched->priority > sched_get_priority_max(sched->policy)) {
+            printf("sched: bad priority for class %s\n", policies[j].name);
+            return 0;
+          }
+        }
+        sched->haspolicy = 1;
+        break;
+      }
+      default:
+        goto usage;
+    }
+  }
+  return i;
+
+usage:
+  printf("usage: sched [-c cpus] [-n nice] [-p class[:priority]] "
+         "[%%jobid | pid | command]\n");
+  return 0;
+}
+
+/* listsched - Print the scheduling of the jobs, as the kernel has it */
+static void listsched(void) {
+  cpu_set_t cpus;
+  int i;
+
+  sched_getaffinity(0, sizeof(cpus), &cpus);
+  printf("spread %s, CPUs ", spread ? "on" : "off");
+  printcpus(&cpus);
+  printf("\n");
+  for (i = 1; i <= jobs.maxjid; i++) {
+    struct job_t *job = jobs.byjid[i];
+    if (!job) {
+      continue;
+    }
+    printf("[%d] (%d) ", job->jid, job->pid);
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, job->pid);
+    int policy = sched_getscheduler(job->pid);
+    if (!job->nlive || errno ||
+        sched_getaffinity(job->pid, sizeof(cpus), &cpus) < 0 || policy < 0) {
+      printf("- %s", job->cmdline);
+      continue;
+    }
+    printf("cpus ");
+    printcpus(&cpus);
+    printf(" nice %d class %s ", nice,
+           policyname(policy & ~SCHED_RESET_ON_FORK));
+    printf("%s", job->cmdline);
+  }
+}
+
+/*
+ * do_sched - Execute the builtin sched, given the arguments after its
+ *    options:
+ *
+ *    sched                           list the scheduling of the jobs
+ *    sched spread [on | off]         spread background jobs over CPUs
+ *    sched [options] %jobid | pid    change the scheduling of a job
+ *    sched [options] command         run a command with the scheduling
+ *
+ *    The options are -c with a CPU list like 0-3,6 for the affinity, -n
+ *    for the nice level and -p other, batch, idle, fifo or rr, with an
+ *    optional :priority for fifo and rr, for the scheduling class. They
+ *    apply to every process of the job's group. With spread on, every
+ *    background job started without -c is bound to the least loaded
+ *    CPUs, one per process it runs at once, see placejob. Return 0 if
+ *    argv is a command to run, 1 if it was handled here.
+ */
+int do_sched(char **argv, struct sched_t *sched) {
+  int given = sched->hascpus || sched->hasnice || sched->haspolicy;
+
+  if (!argv[0]) {
+    if (given) {
+      printf("sched: the options need a job or a command\n");
+    } else {
+      listsched();
+    }
+    return 1;
+  }
+
+  if (!strcmp(argv[0], "spread") && !given) {
+    if (argv[1] && strcmp(argv[1], "on") && strcmp(argv[1], "off")) {
+      printf("usage: sched spread [on | off]\n");
+    } else if (argv[1]) {
+      spread = !strcmp(argv[1], "on");
+    } else {
+      printf("spread %s\n", spread ? "on" : "off");
+    }
+    return 1;
+  }
+
+  struct job_t *job;
+  if (argv[0][0] == '%') {
+    int jid = atoi(argv[0] + 1);
+    if (!(job = getjobjid(&jobs, jid))) {
+      printf("%s: no such job\n", argv[0]);
+      return 1;
+    }
+  } else if (isdigit((unsigned char)argv[0][0])) {
+    pid_t pid = atoi(argv[0]);
+    if (!(job = getjobpid(&jobs, pid))) {
+      printf("(%d): no such process\n", pid);
+      return 1;
+    }
+  } else {
+    return 0;
+  }
+
+  if (!given) {
+    printf("sched: give the job a -c, -n or -p option\n");
+    return 1;
+  }
+  if (!job->nlive || !schedgroup(job->pid, sched)) {
+    return 1;
+  }
+  if (sched->hascpus) {
+    job->sched.hascpus = 1;
+    job->sched.cpus = sched->cpus;
+  }
+  if (sched->hasnice) {
+    job->sched.hasnice = 1;
+    job->sched.nice = sched->nice;
+  }
+  if (sched->haspolicy) {
+    job->sched.haspolicy = 1;
+    job->sched.policy = sched->policy;
+    job->sched.priority = sched->priority;
+  }
+  return 1;
+}
+/****************
+ * End scheduling
+ ****************/
+
+/**************
+ * Script mode
+ **************/
+
+/* nowms - Milliseconds on the monotonic clock */
+static long nowms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * loadscript - Map a trace file and split it into lines up front, sorting
+ *    out each line the way sdriver.pl does: comment, blank, a directive
+ *    if the line contains its name, or else a command for the shell.
+ */
+void loadscript(const char *path) {
+  static const struct { const char *name; int kind; int sig; } directives[] = {
+    { "TSTP", SC_SIGNAL, SIGTSTP }, { "INT", SC_SIGNAL, SIGINT },
+    { "QUIT", SC_SIGNAL, SIGQUIT }, { "KILL", SC_SIGNAL, SIGKILL },
+    { "CLOSE", SC_CLOSE, 0 }, { "WAIT", SC_CLOSE, 0 },
+  };
+  struct stat st;
+  int fd, i, n;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    printf("%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  script.size = st.st_size;
+  script.text = "";
+  if (script.size &&
+      (script.text = mmap(NULL, script.size, PROT_READ, MAP_PRIVATE, fd, 0))
+      == MAP_FAILED) {
+    unix_error("mmap error");
+  }
+  close(fd);
+
+  const char *p = script.text, *end = script.text + script.size;
+  for (n = 0; p < end; n++) {
+    const char *nl = memchr(p, '\n', end - p);
+    p = nl ? nl + 1 : end;
+  }
+  script.lines = Calloc(n ? n : 1, sizeof(struct scriptline_t));
+
+  for (p = script.text; p < end; ) {
+    const char *nl = memchr(p, '\n', end - p);
+    struct scriptline_t line = { SC_COMMAND, p, (nl ? nl : end) - p, 0 };
+    char word[MAXLINE];
+    p = nl ? nl + 1 : end;
+
+    int len = line.len < MAXLINE - 1 ? line.len : MAXLINE - 2;
+    memcpy(word, line.text, len);
+    word[len] = '\0';
+    line.len = len;
+    if (word[0] == '#') {
+      line.kind = SC_COMMENT;
+    } else if (!word[strspn(word, " \t\r\f\v")]) {
+      continue; // blank
+    } else {
+      char *sleep = strstr(word, "SLEEP ");
+      for (i = 0; i < (int)(sizeof(directives) / sizeof(directives[0])); i++) {
+        if (strstr(word, directives[i].name)) {
+          line.kind = directives[i].kind;
+          line.arg = directives[i].sig;
+          break;
+        }
+      }
+      if (line.kind == SC_COMMAND && sleep && isdigit(sleep[6])) {
+        line.kind = SC_SLEEP;
+        line.arg = atoi(sleep + 6) * 1000;
+      }
+    }
+    script.lines[script.nlines++] = line;
+  }
+  script.queue = Calloc(script.nlines ? script.nlines : 1, sizeof(int));
+  script.wake = nowms();
+}
+
+/* jobsrunning - Return true if some job is not stopped */
+static int jobsrunning(struct joblist_t *jobs) {
+  int i;
+  for (i = 1; i <= jobs->maxjid; i++) {
+    if (jobs->byjid[i] && jobs->byjid[i]->state != ST) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * advancescript - Play the driver's side of the script up to now: hand
+ *    commands to the shell, send it signals, and stop at a SLEEP that has
+ *    not run out yet. Signals are handled right away, as the shell would
+ *    on reading them from sigfd.
+ *    The rest of a SLEEP is skipped when the shell has run every command
+ *    it was given and no job is running: until the driver goes on, no
+ *    output and no job state can change.
+ */
+void advancescript(void) {
+  if (script.head == script.tail && !jobsrunning(&jobs)) {
+    script.wake = 0;
+  }
+  while (!script.done && script.next < script.nlines && nowms() >= script.wake) {
+    struct scriptline_t *line = &script.lines[script.next];
+
+    switch (line->kind) {
+      case SC_COMMENT:
+        printf("%.*s\n", line->len, line->text);
+        break;
+      case SC_COMMAND:
+        script.queue[script.tail++] = script.next;
+        break;
+      case SC_SLEEP:
+        script.wake = nowms() + line->arg;
+        break;
+      case SC_SIGNAL:
+        DebugStr("script sends signal %d\n", line->arg);
+        if (line->arg == SIGQUIT) {
+          sigquit_handler(SIGQUIT);
+        } else if (line->arg == SIGKILL) {
+          fflush(stdout);
+          kill(getpid(), SIGKILL);
+        } else {
+          forward_signal(line->arg);
+        }
+        break;
+      case SC_CLOSE:
+        script.done = 1;
+        break;
+    }
+    script.next++;
+  }
+  if (script.next == script.nlines) {
+    script.done = 1;
+  }
+}
+
+/*
+ * scripttimeout - How long the shell may block before the script has to
+ *    advance again, in ms for poll. -1 if the driver's side is done.
+ */
+int scripttimeout(void) {
+  if (script.done) {
+    return -1;
+  }
+  long left = script.wake - nowms();
+  return left > 0 ? left : 0;
+}
+
+/*
+ * readscript - Get the next command of the script into cmdline, like
+ *    readcmdline. Between SLEEPs of the script the shell waits on sigfd,
+ *    so it reaps children and handles signals while it has no command.
+ *    Return 0 at the end of the script.
+ */
+int readscript(char *cmdline, int size) {
+  struct pollfd pfd = { sigfd, POLLIN, 0 };
+
+  while (1) {
+    advancescript();
+    if (script.head < script.tail) {
+      struct scriptline_t *line = &script.lines[script.queue[script.head++]];
+      int len = line->len < size - 1 ? line->len : size - 2;
+      memcpy(cmdline, line->text, len);
+      cmdline[len] = '\n';
+      cmdline[len + 1] = '\0';
+      return 1;
+    }
+    if (script.done) {
+      return 0;
+    }
+    if (poll(&pfd, 1, scripttimeout()) < 0 && errno != EINTR) {
+      unix_error("poll error");
+    }
+    dispatch_signals();
+  }
+}
+/*****************
+ * End script mode
+ *****************/
+
+/*****************
+ * Signal handling
+ *****************/
+
+/*
+ * dispatch_signals - Handle every signal pending on sigfd. Standard
+ *     signals do not queue, so one SIGCHLD may stand for several
+ *     children; reap_children collects all of them.
+ */
+void dispatch_signals(void) {
+  struct signalfd_siginfo info;
+  while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+    switch (info.ssi_signo) {
+      case SIGCHLD:
+        reap_children();
+        break;
+      case SIGINT:
+      case SIGTSTP:
+        forward_signal(info.ssi_signo);
+        break;
+    }
+  }
+}
+
+/*
+ * reap_children - Called whenever a child job terminates (becomes a
+ *     zombie), or stops because it received a SIGSTOP or SIGTSTP
+ *     signal. Reaps all available zombie children, but doesn't wait
+ *     for any other currently running children to terminate.
+ */
+void reap_children(void)
+{
+  pid_t pid;
+  int status;
+  // when there is no child process return -1
+  // when no child process stop or terminate return 0
+  // otherwise return pid of the child process
+  struct rusage usage;
+  while ( (pid = wait4(-1, &status, WNOHANG | WUNTRACED, &usage)) > 0) {
+    struct job_t* job = getjobpid(&jobs, pid);
+    if (!job) continue;
+    if (!WIFSTOPPED(status)) {
+      addusage(&job->usage, &usage);
+    }
+
+    // every stage of a stopped pipeline stops, report the job once
+    if (WIFSTOPPED(status)) {
+      DebugStr("pid = %d, jid = %d is stopped\n", pid, job->jid);
+      if (job->state != ST) {
+        setjobstate(&jobs, job, ST);
+        printf("Job [%d] (%d) stopped by signal %d\n",
+                job->jid, job->pid, WSTOPSIG(status));
+      }
+      continue;
+    }
+
+    if (job->parallel) {
+      reapparallel(job, pid, status);
+      continue;
+    }
+
+    // a pipeline reports the signal that killed its last stage, e.g. not
+    // the SIGPIPE of a writer whose reader is gone
+    if (WIFSIGNALED(status) && pid == job->procs[job->nprocs - 1].pid) {
+      job->termsig = WTERMSIG(status);
+    }
+    if (reapproc(&jobs, pid)) {
+      continue; // other stages of the job are still running
+    }
+
+    // if the last process of the job terminated because of a signal
+    // that was not caught
+    if (job->termsig) {
+      printf("Job [%d] (%d) terminated by signal %d\n",
+              job->jid, job->pid, job->termsig);
+    }
+    if (job->timed) {
+      printusage(job);
+    }
+    if (job->state == FG) {
+      phase(PH_REAPED);
+    }
+    DebugStr("pid = %d, jid = %d is deleted\n", pid, job->jid);
+    deletejob(&jobs, pid);
+  }
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.
+ * forward_signal - The kernel sends a SIGINT (SIGTSTP) to the shell
+ *    whenever the user types ctrl-c (ctrl-z) at the keyboard. Send it
+ *    along to the process group of the foreground job.
  */
-void sigtstp_handler(int sig) {
-  DebugStr("shell received SIGTSTP signal\n");
-  pid_t pid = fgpid(jobs);
+void forward_signal(int sig) {
+  DebugStr("shell received signal %d\n", sig);
+  pid_t pid = fgpid(&jobs);
   if (!pid) {
     DebugStr("No foreground job\n");
-    return;
+    return; // no foreground job
   }
 
   // since the pid of the job process is same as the group id
-  DebugStr("dispatch SIGTSTP to process group %d\n", pid);
-  Kill(-pid, SIGTSTP);
-  return;
+  DebugStr("dispatch signal %d to process group %d\n", sig, pid);
+  Kill(-pid, sig);
 }
 
 /*********************
- * End signal handlers
+ * End signal handling
  *********************/
 
 /***********************************************
@@ -434,135 +2146,359 @@ void sigtstp_handler(int sig) {
 
 /* clearjob - Clear the entries in a job struct */
 void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+  job->pid = 0;
+  job->jid = 0;
+  job->state = UNDEF;
+  job->cmdline[0] = '\0';
+  job->nprocs = 0;
+  job->nlive = 0;
+  job->termsig = 0;
+  job->procs = NULL;
+  job->parallel = NULL;
+  job->timed = 0;
+  memset(&job->usage, 0, sizeof(job->usage));
+  memset(&job->sched, 0, sizeof(job->sched));
 }
 
 /* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-  clearjob(&jobs[i]);
+void initjobs(struct joblist_t *jobs) {
+  jobs->jidcap = MINJOBS;
+  jobs->byjid = Calloc(jobs->jidcap, sizeof(struct job_t *));
+  jobs->pidcap = MINJOBS;
+  jobs->bypid = Calloc(jobs->pidcap, sizeof(struct proc_t *));
+  jobs->maxjid = 0;
+  memset(jobs->freejids, 0xff, sizeof(jobs->freejids));
+  memset(jobs->freewords, 0xff, sizeof(jobs->freewords));
+  jobs->freegroups = MAXJID / 64 / 64 == 64 ?
+                     ~(uint64_t)0 : ((uint64_t)1 << (MAXJID / 64 / 64)) - 1;
+  jobs->count = 0;
+  jobs->nprocs = 0;
+  jobs->fg = NULL;
 }
 
 /* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs)
+int maxjid(struct joblist_t *jobs)
 {
-    int i, max=0;
+  return jobs->maxjid;
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-  if (jobs[i].jid > max)
-      max = jobs[i].jid;
-    return max;
+/* pidbucket - The pid hash chain a pid belongs to */
+static struct proc_t **pidbucket(struct joblist_t *jobs, pid_t pid) {
+  /* pids are handed out nearly sequentially, their low bits spread well */
+  return &jobs->bypid[pid & (jobs->pidcap - 1)];
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
-{
+/* growpids - Double the pid hash buckets and rehash every process */
+static void growpids(struct joblist_t *jobs) {
+  struct proc_t **old = jobs->bypid;
+  int oldcap = jobs->pidcap;
   int i;
 
-  if (pid < 1) return 0;
+  jobs->pidcap *= 2;
+  jobs->bypid = Calloc(jobs->pidcap, sizeof(struct proc_t *));
+  for (i = 0; i < oldcap; i++) {
+    struct proc_t *proc = old[i];
+    while (proc) {
+      struct proc_t *next = proc->pid_next;
+      struct proc_t **bucket = pidbucket(jobs, proc->pid);
+      proc->pid_next = *bucket;
+      *bucket = proc;
+      proc = next;
+    }
+  }
+  free(old);
+}
 
-  for (i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid == 0) {
-    jobs[i].pid = pid;
-    jobs[i].state = state;
-    jobs[i].jid = nextjid++;
-    if (nextjid > MAXJOBS) {
-        nextjid = 1;
-      }
+/* getproc - Find a process that is not reaped yet, NULL if none */
+static struct proc_t *getproc(struct joblist_t *jobs, pid_t pid) {
+  struct proc_t *proc = *pidbucket(jobs, pid);
+  while (proc && proc->pid != pid) {
+    proc = proc->pid_next;
+  }
+  return proc;
+}
 
-      strcpy(jobs[i].cmdline, cmdline);
+/* unlinkproc - Remove a process from the pid index */
+static void unlinkproc(struct joblist_t *jobs, struct proc_t *proc) {
+  struct proc_t **pp = pidbucket(jobs, proc->pid);
+  while (*pp != proc) {
+    pp = &(*pp)->pid_next;
+  }
+  *pp = proc->pid_next;
+  proc->pid_next = NULL;
+  proc->reaped = 1;
+  jobs->nprocs--;
+}
 
-      if(verbose) {
-      printf("Added job [%d] %d %s\n", jobs[i].jid,
-                                         jobs[i].pid,
-                                         jobs[i].cmdline);
-      }
-      return 1;
+/* jidtake - Mark jid as in use */
+static void jidtake(struct joblist_t *jobs, int jid) {
+  int w = (jid - 1) / 64;
+  jobs->freejids[w] &= ~((uint64_t)1 << (jid - 1) % 64);
+  if (!jobs->freejids[w]) {
+    jobs->freewords[w / 64] &= ~((uint64_t)1 << w % 64);
+    if (!jobs->freewords[w / 64]) {
+      jobs->freegroups &= ~((uint64_t)1 << w / 64);
     }
   }
-  printf("Tried to create too many jobs\n");
-  return 0;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid)
+/* jidgive - Mark jid as free */
+static void jidgive(struct joblist_t *jobs, int jid) {
+  int w = (jid - 1) / 64;
+  jobs->freejids[w] |= (uint64_t)1 << (jid - 1) % 64;
+  jobs->freewords[w / 64] |= (uint64_t)1 << w % 64;
+  jobs->freegroups |= (uint64_t)1 << w / 64;
+}
+
+/* jidfirst - The lowest free jid, 0 if all MAXJID are in use */
+static int jidfirst(struct joblist_t *jobs) {
+  if (!jobs->freegroups) {
+    return 0;
+  }
+  int k = __builtin_ctzll(jobs->freegroups);
+  int w = k * 64 + __builtin_ctzll(jobs->freewords[k]);
+  return w * 64 + __builtin_ctzll(jobs->freejids[w]) + 1;
+}
+
+/*
+ * newjob - Add a job with nslots process slots, all of them empty, to
+ *    the job list. pgid is the process group of the job, 0 if it is set
+ *    by the first process added. Return NULL if there are too many jobs.
+ */
+struct job_t *newjob(struct joblist_t *jobs, pid_t pgid, int nslots,
+                     int state, char *cmdline)
 {
-    int i;
+  int i;
 
-    if (pid < 1)
-  return 0;
+  /*
+   * A new job gets the lowest free jid, found in constant time in the
+   * free jid bitmap. So maxjid, the size of byjid and the loops over it
+   * stay bounded by the most jobs alive at once, however many jobs were
+   * started before.
+   */
+  int jid = jidfirst(jobs);
+  if (!jid) {
+    printf("Tried to create too many jobs\n");
+    return NULL;
+  }
+  if (jid >= jobs->jidcap) {
+    int cap = jobs->jidcap * 2;
+    jobs->byjid = Realloc(jobs->byjid, cap * sizeof(struct job_t *));
+    memset(jobs->byjid + jobs->jidcap, 0,
+           (cap - jobs->jidcap) * sizeof(struct job_t *));
+    jobs->jidcap = cap;
+  }
 
-    for (i = 0; i < MAXJOBS; i++) {
-  if (jobs[i].pid == pid) {
-      clearjob(&jobs[i]);
-      nextjid = maxjid(jobs)+1;
-      return 1;
+  struct job_t *job = Malloc(sizeof(struct job_t));
+  clearjob(job);
+  job->pid = pgid;
+  job->jid = jid;
+  strcpy(job->cmdline, cmdline);
+  clock_gettime(CLOCK_MONOTONIC, &job->start);
+  job->procs = Calloc(nslots, sizeof(struct proc_t));
+  job->nprocs = nslots;
+  for (i = 0; i < nslots; i++) {
+    job->procs[i].reaped = 1;
+    job->procs[i].job = job;
   }
-    }
+
+  jobs->byjid[jid] = job;
+  jidtake(jobs, jid);
+  if (jid > jobs->maxjid) {
+    jobs->maxjid = jid;
+  }
+  jobs->count++;
+  setjobstate(jobs, job, state);
+  return job;
+}
+
+/* addproc - Put the process pid in the empty slot of a job */
+void addproc(struct joblist_t *jobs, struct job_t *job, int slot, pid_t pid)
+{
+  struct proc_t *proc = &job->procs[slot];
+
+  if (jobs->nprocs + 1 > jobs->pidcap) {
+    growpids(jobs);
+  }
+  struct proc_t **bucket = pidbucket(jobs, pid);
+  proc->pid = pid;
+  proc->reaped = 0;
+  proc->pid_next = *bucket;
+  *bucket = proc;
+  jobs->nprocs++;
+  job->nlive++;
+}
+
+/*
+ * addjob - Add a job to the job list. The job is made of the npids
+ *    processes in pids, pids[0] leads the process group of the job.
+ */
+int addjob(struct joblist_t *jobs, pid_t *pids, int npids, int state,
+           char *cmdline)
+{
+  struct job_t *job;
+  int i;
+
+  if (npids < 1 || pids[0] < 1) return 0;
+  if (!(job = newjob(jobs, pids[0], npids, state, cmdline))) return 0;
+  for (i = 0; i < npids; i++) {
+    addproc(jobs, job, i, pids[i]);
+  }
+
+  if(verbose) {
+    printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+  }
+  return 1;
+}
+
+/*
+ * reapproc - Account for a reaped process of a job that has other
+ *    processes still running. Return 0 if pid is not such a process.
+ */
+int reapproc(struct joblist_t *jobs, pid_t pid)
+{
+  struct proc_t *proc;
+
+  if (pid < 1 || !(proc = getproc(jobs, pid)) || proc->job->nlive < 2)
     return 0;
+  unlinkproc(jobs, proc);
+  proc->job->nlive--;
+  return 1;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
+/*
+ * reapslot - Empty the slot of the reaped process pid, even if it was the
+ *    last one of its job. Return the slot, -1 if pid is not in a job.
+ */
+int reapslot(struct joblist_t *jobs, pid_t pid)
+{
+  struct proc_t *proc;
+
+  if (pid < 1 || !(proc = getproc(jobs, pid)))
+    return -1;
+  unlinkproc(jobs, proc);
+  proc->job->nlive--;
+  return proc - proc->job->procs;
+}
+
+/* deletejob - Delete the job with a process PID=pid from the job list */
+int deletejob(struct joblist_t *jobs, pid_t pid)
+{
+  struct proc_t *proc;
+
+  if (pid < 1 || !(proc = getproc(jobs, pid)))
+    return 0;
+  removejob(jobs, proc->job);
+  return 1;
+}
+
+/* removejob - Delete a job from the job list */
+void removejob(struct joblist_t *jobs, struct job_t *job)
+{
   int i;
-  for (i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].state == FG) return jobs[i].pid;
+
+  for (i = 0; i < job->nprocs; i++) {
+    if (!job->procs[i].reaped) {
+      unlinkproc(jobs, &job->procs[i]);
+    }
   }
-  return 0;
+  jobs->byjid[job->jid] = NULL;
+  jidgive(jobs, job->jid);
+  while (jobs->maxjid && !jobs->byjid[jobs->maxjid]) {
+    jobs->maxjid--;
+  }
+  if (jobs->fg == job) {
+    jobs->fg = NULL;
+  }
+  jobs->count--;
+  free(job->procs);
+  free(job);
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/* setjobstate - Change the state of a job, keeping track of the FG job */
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state) {
+  if (jobs->fg == job) {
+    jobs->fg = NULL;
+  }
+  job->state = state;
+  if (state == FG) {
+    jobs->fg = job;
+  }
+}
 
-    if (pid < 1)
-  return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-  if (jobs[i].pid == pid)
-      return &jobs[i];
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct joblist_t *jobs) {
+  return jobs->fg ? jobs->fg->pid : 0;
+}
+
+/* getjobpid  - Find a job (by the PID of any of its processes) */
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid) {
+  if (pid < 1)
     return NULL;
+
+  struct proc_t *proc = getproc(jobs, pid);
+  return proc ? proc->job : NULL;
 }
 
 /* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid)
+struct job_t *getjobjid(struct joblist_t *jobs, int jid)
 {
-    int i;
-
-    if (jid < 1)
-  return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-  if (jobs[i].jid == jid)
-      return &jobs[i];
+  if (jid < 1 || jid > jobs->maxjid)
     return NULL;
+  return jobs->byjid[jid];
 }
 
 /* pid2jid - Map process ID to job ID */
 int pid2jid(pid_t pid)
 {
-    int i;
+  struct job_t *job = getjobpid(&jobs, pid);
+  return job ? job->jid : 0;
+}
 
-    if (pid < 1)
-  return 0;
-    for (i = 0; i < MAXJOBS; i++)
-  if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+/* tvsec - A timeval in seconds */
+static double tvsec(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* elapsed - Seconds since the start of a job */
+static double elapsed(struct job_t *job) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - job->start.tv_sec) +
+         (now.tv_nsec - job->start.tv_nsec) / 1e9;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
+/* listjobusage - The details of a job printed by "jobs -l" */
+static void listjobusage(struct job_t *job) {
+  struct rusage *ru = &job->usage;
   int i;
 
-  for (i = 0; i < MAXJOBS; i++) {
-    if (jobs[i].pid != 0) {
-      printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-      switch (jobs[i].state) {
+  printf("    pids");
+  for (i = 0; i < job->nprocs; i++) {
+    if (!job->procs[i].reaped) {
+      printf(" %d", job->procs[i].pid);
+    }
+  }
+  printf("\n    %.3fs real, %.3fs user, %.3fs sys, %ld KB maxrss, "
+         "%ld/%ld faults, %ld/%ld csw (reaped processes)\n",
+         elapsed(job), tvsec(ru->ru_utime), tvsec(ru->ru_stime),
+         ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt,
+         ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/*
+ * listjobs - Print the job list. With details, also print for each job
+ *    its processes, the time since it started and the usage of the
+ *    processes already reaped.
+ */
+void listjobs(struct joblist_t *jobs, int details) {
+  int i;
+
+  for (i = 1; i <= jobs->maxjid; i++) {
+    struct job_t *job = jobs->byjid[i];
+    if (job) {
+      printf("[%d] (%d) ", job->jid, job->pid);
+      switch (job->state) {
         case BG:
           printf("Running ");
           break;
@@ -574,30 +2510,336 @@ void listjobs(struct job_t *jobs) {
           break;
         default:
           printf("listjobs: Internal error: job[%d].state=%d ",
-          i, jobs[i].state);
+          i, job->state);
+      }
+      printf("%s", job->cmdline);
+      if (details) {
+        listjobusage(job);
       }
-      printf("%s", jobs[i].cmdline);
     }
   }
 }
+
+/*
+ * addusage - Add the usage of a reaped process to the usage of its job.
+ *    Times and counts add up, maxrss is the largest of the processes.
+ */
+void addusage(struct rusage *sum, const struct rusage *usage) {
+  timeradd(&sum->ru_utime, &usage->ru_utime, &sum->ru_utime);
+  timeradd(&sum->ru_stime, &usage->ru_stime, &sum->ru_stime);
+  if (usage->ru_maxrss > sum->ru_maxrss) {
+    sum->ru_maxrss = usage->ru_maxrss;
+  }
+  sum->ru_minflt += usage->ru_minflt;
+  sum->ru_majflt += usage->ru_majflt;
+  sum->ru_nvcsw += usage->ru_nvcsw;
+  sum->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/* printtime - One line of the time report, like the one of bash */
+static void printtime(const char *name, double sec) {
+  printf("%s\t%dm%.3fs\n", name, (int)(sec / 60), sec - 60 * (int)(sec / 60));
+}
+
+/* printusage - Print the report of "time" for a job that is done */
+void printusage(struct job_t *job) {
+  struct rusage *ru = &job->usage;
+
+  printf("\n");
+  printtime("real", elapsed(job));
+  printtime("user", tvsec(ru->ru_utime));
+  printtime("sys", tvsec(ru->ru_stime));
+  printf("maxrss\t%ld KB\n", ru->ru_maxrss);
+  printf("faults\t%ld minor, %ld major\n", ru->ru_minflt, ru->ru_majflt);
+  printf("csw\t%ld voluntary, %ld involuntary\n", ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/*
+ * do_times - Execute the builtin time with no command: print the time
+ *    used by the shell itself and by all the children it has reaped.
+ */
+void do_times(void) {
+  struct rusage self, children;
+
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  printf("shell\t%.3fs user, %.3fs sys, %ld KB maxrss\n",
+         tvsec(self.ru_utime), tvsec(self.ru_stime), self.ru_maxrss);
+  printf("children\t%.3fs user, %.3fs sys, %ld KB maxrss\n",
+         tvsec(children.ru_utime), tvsec(children.ru_stime),
+         children.ru_maxrss);
+}
 /******************************
  * end job list helper routines
  ******************************/
 
 
+/*************************
+ * Command lookup in PATH
+ *************************/
+
+/* pathhash - FNV-1a hash of a command name */
+static unsigned pathhash(const char *name) {
+  unsigned hash = 2166136261u;
+  for (; *name; name++) {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * loadpath - Split $PATH into pathdirs, if it changed since the last call.
+ *    An empty entry stands for the current directory.
+ */
+static void loadpath(struct pathcache_t *cache) {
+  const char *path = getenv("PATH");
+  char *dir;
+  int i;
+
+  if (!path) path = DEFPATH;
+  if (cache->path && !strcmp(cache->path, path)) {
+    return;
+  }
+
+  hashclear(cache);
+  for (i = 0; i < cache->ndirs; i++) {
+    free(cache->dirs[i].name);
+  }
+  free(cache->dirs);
+  free(cache->path);
+
+  cache->path = strdup(path);
+  cache->ndirs = 1;
+  for (dir = cache->path; *dir; dir++) {
+    cache->ndirs += (*dir == ':');
+  }
+  cache->dirs = Calloc(cache->ndirs, sizeof(struct pathdir_t));
+  for (i = 0, dir = cache->path; i < cache->ndirs; i++) {
+    size_t len = strcspn(dir, ":");
+    cache->dirs[i].name = len ? strndup(dir, len) : strdup(".");
+    dir += len + 1;
+  }
+}
+
+/*
+ * dirchanged - Compare the mtime of PATH directory i with the one seen
+ *    last time, and remember the new one. Creating, removing or renaming
+ *    a file in a directory updates its mtime. A directory that cannot be
+ *    read is remembered as missing: it changes when it appears or goes
+ *    away, not on every lookup while it stays missing.
+ */
+static int dirchanged(struct pathcache_t *cache, int i) {
+  struct pathdir_t *dir = &cache->dirs[i];
+  struct stat st;
+
+  if (stat(dir->name, &st) < 0) {
+    if (dir->seen == DIR_MISSING) {
+      return 0;
+    }
+    dir->seen = DIR_MISSING;
+    return 1;
+  }
+  if (dir->seen == DIR_SEEN && dir->ino == st.st_ino &&
+      dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+      dir->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    return 0;
+  }
+  dir->seen = DIR_SEEN;
+  dir->ino = st.st_ino;
+  dir->mtime = st.st_mtim;
+  return 1;
+}
+
+/*
+ * hashflush - Drop the commands found in PATH directory dir or after it.
+ *    These are the ones a change to dir can hide or remove, the commands
+ *    found before it are still the first match in PATH.
+ */
+static void hashflush(struct pathcache_t *cache, int dir) {
+  int i;
+  for (i = 0; i < PATHBUCKETS; i++) {
+    struct pathent_t **pp = &cache->buckets[i];
+    while (*pp) {
+      struct pathent_t *ent = *pp;
+      if (ent->dir >= dir) {
+        *pp = ent->next;
+        free(ent->name);
+        free(ent->path);
+        free(ent);
+        cache->count--;
+      } else {
+        pp = &ent->next;
+      }
+    }
+  }
+}
+
+/* hashclear - Forget all hashed commands, the builtin "hash -r" */
+void hashclear(struct pathcache_t *cache) {
+  hashflush(cache, 0);
+}
+
+/*
+ * searchpath - Find name in the PATH directories, in order. Every
+ *    directory looked at is checked for changes first, so that the mtimes
+ *    stay in step with what the lookup saw. Return the index of the
+ *    directory, or -1 if name is not an executable file in any of them.
+ */
+static int searchpath(struct pathcache_t *cache, const char *name,
+                      char *path, size_t size) {
+  struct stat st;
+  int i;
+
+  for (i = 0; i < cache->ndirs; i++) {
+    if (dirchanged(cache, i)) {
+      hashflush(cache, i);
+    }
+    if (snprintf(path, size, "%s/%s", cache->dirs[i].name, name) >=
+        (int)size) {
+      continue;
+    }
+    if (!stat(path, &st) && S_ISREG(st.st_mode) && !access(path, X_OK)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* hashfind - The hashed entry of name, NULL if there is none */
+static struct pathent_t *hashfind(struct pathcache_t *cache,
+                                  const char *name) {
+  struct pathent_t *ent = cache->buckets[pathhash(name) % PATHBUCKETS];
+  for (; ent; ent = ent->next) {
+    if (!strcmp(ent->name, name)) {
+      return ent;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * findcmd - Resolve a command name to the path to execute. A name with
+ *    a '/' is used as it is. Other names are looked up in the hash table
+ *    first: a hit costs one stat per PATH directory up to the one the
+ *    command was found in, to see that none of them changed. On a miss,
+ *    or if one did change, PATH is searched and the result hashed.
+ *    Return NULL if the command is not found.
+ */
+const char *findcmd(struct pathcache_t *cache, const char *name) {
+  static char path[MAXLINE];
+  struct pathent_t *ent;
+  int i, dir;
+
+  if (strchr(name, '/')) {
+    return name;
+  }
+  loadpath(cache);
+
+  if ((ent = hashfind(cache, name))) {
+    for (i = 0; i <= ent->dir && !dirchanged(cache, i); i++)
+      ;
+    if (i > ent->dir) {
+      ent->hits++;
+      return ent->path;
+    }
+    hashflush(cache, i);
+  }
+
+  if ((dir = searchpath(cache, name, path, sizeof(path))) < 0) {
+    return NULL;
+  }
+  ent = Malloc(sizeof(struct pathent_t));
+  ent->name = strdup(name);
+  ent->path = strdup(path);
+  ent->dir = dir;
+  ent->hits = 1;
+  unsigned bucket = pathhash(name) % PATHBUCKETS;
+  ent->next = cache->buckets[bucket];
+  cache->buckets[bucket] = ent;
+  cache->count++;
+  return ent->path;
+}
+
+/*
+ * do_hash - Execute the builtin hash command: with no argument list the
+ *    hashed commands, with -r forget them, and otherwise look up and hash
+ *    the named commands.
+ */
+void do_hash(char **argv) {
+  int i;
+
+  if (argv[1] && !strcmp(argv[1], "-r")) {
+    hashclear(&pathcache);
+    return;
+  }
+  if (argv[1]) {
+    for (i = 1; argv[i]; i++) {
+      if (!strchr(argv[i], '/') && !findcmd(&pathcache, argv[i])) {
+        printf("hash: %s: not found\n", argv[i]);
+      }
+    }
+    return;
+  }
+
+  if (!pathcache.count) {
+    printf("hash: hash table empty\n");
+    return;
+  }
+  printf("hits\tcommand\n");
+  for (i = 0; i < PATHBUCKETS; i++) {
+    struct pathent_t *ent;
+    for (ent = pathcache.buckets[i]; ent; ent = ent->next) {
+      printf("%4d\t%s\n", ent->hits, ent->path);
+    }
+  }
+}
+/****************************
+ * end command lookup in PATH
+ ****************************/
+
+
 /***********************
  * Other helper routines
  ***********************/
 
+/*
+ * phase - With -T, record the time the current command line reached a
+ *    phase. When the shell is ready for the next line, the phases are
+ *    printed if a foreground job ran, and forgotten.
+ */
+void phase(int which) {
+  struct timespec ts;
+
+  if (!use_phases) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  phases[which] = ts.tv_sec * 1000000000L + ts.tv_nsec;
+  if (which != PH_PROMPT) {
+    return;
+  }
+  if (phases[PH_LAUNCHED] && phases[PH_REAPED]) {
+    printf("phases %ld %ld %ld %ld %ld\n", phases[PH_READ],
+           phases[PH_PARSED], phases[PH_LAUNCHED], phases[PH_REAPED],
+           phases[PH_PROMPT]);
+  }
+  memset(phases, 0, sizeof(phases));
+}
+
 /*
  * usage - print a help message
  */
 void usage(void)
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpFZT] [-f <trace>]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -F   start commands with fork + execve, not posix_spawn\n");
+    printf("   -Z   start commands run often from zygote processes\n");
+    printf("   -T   print the times of the phases of each foreground job\n");
+    printf("   -f   run a trace file, directives included, without sdriver.pl\n");
     exit(1);
 }
 
@@ -0,0 +1,136 @@
+/*
+ * zygote.h - Zygote processes for tsh -Z
+ *
+ * A zygote is a process that waits on a socket for launch requests from
+ * the shell. For each request it clones a child with CLONE_PARENT, so
+ * the child is a child of the shell, which reaps it and controls it as
+ * any other job. The child joins the job's process group, takes the stdin
+ * and stdout sent along with the request, and then
+ *
+ *  - execs the command, for a plain zygote forked from the shell, or
+ *  - returns into main with the requested argv, for a cooperating binary:
+ *    its zygote is the binary itself, exec'ed once and parked at the top
+ *    of main, so a launch costs no exec and no dynamic loading.
+ *
+ * A binary cooperates by calling ZYGOTE_MAIN(argc, argv) first thing in
+ * main. Outside of a zygote the call does nothing. tsh recognizes such
+ * binaries by the ZYGOTE_MAGIC string compiled into them.
+ *
+ * Request: the pgid to join (0 for a new group), then the argv strings,
+ * each NUL terminated, with the stdin and stdout fds as SCM_RIGHTS.
+ * Reply: the pid of the child, -1 if it could not be created.
+ *
+ * Needs _GNU_SOURCE, for CLONE_PARENT.
+ */
+#ifndef __ZYGOTE_H__
+#define __ZYGOTE_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define ZYGOTE_ENV      "TSH_ZYGOTE"   /* fd of the request socket */
+#define ZYGOTE_MAGIC    "tsh-zygote-cooperating-binary-v1"
+#define ZYGOTE_FD       3              /* where the socket is in a zygote */
+#define ZYGOTE_MSGSIZE  8192           /* max size of a request */
+#define ZYGOTE_MAXARGS  128
+
+extern char **environ;
+
+/* zygote_recv - Receive a request and its two fds, return its size */
+static ssize_t zygote_recv(int sock, char *buf, size_t size, int fds[2]) {
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = { buf, size };
+  struct msghdr msg = { 0 };
+  ssize_t n;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+    return n;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+  return n;
+}
+
+/*
+ * zygote_serve - Serve the launch requests on sock until the shell closes
+ *    it, then exit. Returns only in a child of a cooperating zygote (path
+ *    NULL), with the argv it has to run main with.
+ */
+static char **zygote_serve(int sock, const char *path) {
+  static char buf[ZYGOTE_MSGSIZE];
+  static char *argv[ZYGOTE_MAXARGS + 1];
+
+  while (1) {
+    int fds[2], argc = 0;
+    pid_t pgid, pid = -1;
+    ssize_t n = zygote_recv(sock, buf, sizeof(buf) - 1, fds);
+    if (n == 0 || (n < 0 && errno != EINTR)) {
+      _exit(0);
+    }
+    if (n < (ssize_t)sizeof(pid_t) + 1) {
+      continue;
+    }
+    buf[n] = '\0';
+    memcpy(&pgid, buf, sizeof(pid_t));
+    char *arg = buf + sizeof(pid_t);
+    while (arg < buf + n && argc < ZYGOTE_MAXARGS) {
+      argv[argc++] = arg;
+      arg += strlen(arg) + 1;
+    }
+    argv[argc] = NULL;
+
+    /* like fork, but the child belongs to the shell */
+    if (argc) {
+      pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    }
+    if (pid == 0) {
+      close(sock);
+      setpgid(0, pgid);
+      dup2(fds[0], STDIN_FILENO);
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      if (!path) {
+        return argv;
+      }
+      execve(path, argv, environ);
+      _exit(127);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+  }
+}
+
+/* zygote_main - Turn a cooperating binary into its own zygote */
+static inline void zygote_main(int *argc, char ***argv) {
+  static volatile const char magic[] = ZYGOTE_MAGIC;
+  const char *fd = getenv(ZYGOTE_ENV);
+
+  if (!fd || !magic[0]) {
+    return;
+  }
+  unsetenv(ZYGOTE_ENV);
+  *argv = zygote_serve(atoi(fd), NULL);
+  for (*argc = 0; (*argv)[*argc]; (*argc)++)
+    ;
+}
+
+#define ZYGOTE_MAIN(argc, argv) zygote_main(&(argc), &(argv))
+
+#endif /* __ZYGOTE_H__ */
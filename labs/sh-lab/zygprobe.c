@@ -0,0 +1,32 @@
+/*
+ * zygprobe.c - A command for measuring how fast the shell starts commands
+ *
+ * usage: zygprobe
+ * Prints the CLOCK_MONOTONIC time in ns at which its main started and
+ * the time at which it is about to exit. Run back to back in the
+ * foreground, the gap between one probe's exit and the next one's start
+ * is the time the shell takes to reap a command and start the next.
+ * It cooperates with tsh -Z zygotes, see zygote.h.
+ */
+#define _GNU_SOURCE  /* CLONE_PARENT, for zygote.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "zygote.h"
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    ZYGOTE_MAIN(argc, argv);
+    long start = now_ns();
+
+    printf("%ld ", start);
+    printf("%ld\n", now_ns());
+    exit(0);
+}